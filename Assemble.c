@@ -191,6 +191,208 @@ static int ident_matches(struct mddev_ident *ident,
 	return 1;
 }
 
+/**
+ * struct sb_cache - Superblock loaded from a candidate device.
+ * @rdev: Device the superblock was read from.
+ * @generation: Identifies the media in @rdev, see dev_generation().
+ * @st: Loaded superblock, NULL if none could be loaded.
+ * @status: One of &enum sb_cache_status.
+ * @guessed: Set if the metadata type was guessed rather than given.
+ * @refcnt: Number of users currently holding @st.
+ * @cached: Set if the entry is linked on the cache list.
+ *
+ * With --scan, Assemble() is called once for every ARRAY line and every
+ * call looks at every device.  Loading the superblock once per device and
+ * matching all idents against that copy saves re-reading every device
+ * for every array.  Entries live until the device is claimed for an array
+ * or assemble_cache_flush() is called.
+ */
+struct sb_cache {
+	dev_t rdev;
+	unsigned long long generation;
+	struct supertype *st;
+	int status;
+	int guessed;
+	int refcnt;
+	int cached;
+	struct sb_cache *next;
+};
+
+enum sb_cache_status {
+	SBC_OK = 0,
+	SBC_UNKNOWN,	/* no recognisable superblock */
+	SBC_BAD,	/* superblock type known, but it could not be loaded */
+};
+
+static struct sb_cache *sb_cache_list;
+
+/**
+ * dev_generation() - Identify the media currently behind a device.
+ * @fd: Open file descriptor of the device.
+ * @rdev: Device number of @fd.
+ *
+ * Newer kernels expose a "diskseq" that changes whenever the media
+ * changes.  Mix in the size so something changes even when it doesn't.
+ */
+static unsigned long long dev_generation(int fd, dev_t rdev)
+{
+	unsigned long long size = 0;
+	char path[64];
+	char buf[32];
+
+	get_dev_size(fd, NULL, &size);
+	snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/diskseq",
+		 major(rdev), minor(rdev));
+	if (load_sys(path, buf, sizeof(buf)) == 0)
+		return (strtoull(buf, NULL, 10) << 32) ^ size;
+	return size;
+}
+
+static void sb_cache_free(struct sb_cache *sbc)
+{
+	if (sbc->st) {
+		sbc->st->ss->free_super(sbc->st);
+		free(sbc->st);
+	}
+	free(sbc);
+}
+
+static void sb_cache_unlink(struct sb_cache *sbc)
+{
+	struct sb_cache **sbcp;
+
+	for (sbcp = &sb_cache_list; *sbcp; sbcp = &(*sbcp)->next)
+		if (*sbcp == sbc) {
+			*sbcp = sbc->next;
+			break;
+		}
+	sbc->cached = 0;
+}
+
+/**
+ * sb_cache_get() - Get the superblock of a device, loading it if needed.
+ * @dfd: Open file descriptor of the device.
+ * @rdev: Device number of @dfd.
+ * @st: Metadata type to load, or NULL to guess.
+ * @devname: Device name for error messages, or NULL.
+ *
+ * The returned entry holds a reference which must be dropped with
+ * sb_cache_put() or sb_cache_claim().  A cached entry is only reused if
+ * it was loaded the way @st asks for; otherwise a private entry is
+ * returned so behaviour is the same as without the cache.
+ */
+static struct sb_cache *sb_cache_get(int dfd, dev_t rdev,
+				     struct supertype *st, char *devname)
+{
+	unsigned long long gen = dev_generation(dfd, rdev);
+	struct sb_cache *sbc;
+	int cache = 1;
+
+	for (sbc = sb_cache_list; sbc; sbc = sbc->next) {
+		if (sbc->rdev != rdev)
+			continue;
+		if (sbc->generation != gen) {
+			sb_cache_unlink(sbc);
+			if (sbc->refcnt == 0)
+				sb_cache_free(sbc);
+			break;
+		}
+		if (!st && sbc->guessed)
+			goto found;
+		if (st && sbc->st && sbc->st->ss == st->ss &&
+		    (st->minor_version == -1 ||
+		     st->minor_version == sbc->st->minor_version))
+			goto found;
+		/* Loaded differently, don't share it */
+		cache = 0;
+		break;
+	}
+
+	sbc = xcalloc(1, sizeof(*sbc));
+	sbc->rdev = rdev;
+	sbc->generation = gen;
+	sbc->guessed = !st;
+	if (st)
+		sbc->st = dup_super(st);
+	else
+		sbc->st = guess_super(dfd);
+	if (!sbc->st) {
+		sbc->status = SBC_UNKNOWN;
+	} else {
+		sbc->st->ignore_hw_compat = 0;
+		if (sbc->st->ss->load_super(sbc->st, dfd, devname)) {
+			free(sbc->st);
+			sbc->st = NULL;
+			sbc->status = SBC_BAD;
+		}
+	}
+	if (cache) {
+		sbc->cached = 1;
+		sbc->next = sb_cache_list;
+		sb_cache_list = sbc;
+	}
+found:
+	sbc->refcnt++;
+	return sbc;
+}
+
+static void sb_cache_put(struct sb_cache *sbc)
+{
+	sbc->refcnt--;
+	if (!sbc->cached && sbc->refcnt == 0)
+		sb_cache_free(sbc);
+}
+
+/**
+ * sb_cache_claim() - Take private ownership of a cached superblock.
+ * @sbc: Entry obtained from sb_cache_get().
+ * @devname: Device to reload from if the superblock is shared.
+ *
+ * Once a device is chosen for an array its superblock gets merged into,
+ * and possibly stolen by, the array's supertype, and may be rewritten.
+ * Remove it from the cache so later passes read it afresh.
+ * Returns the superblock, or NULL if it needed reloading and that failed.
+ */
+static struct supertype *sb_cache_claim(struct sb_cache *sbc, char *devname)
+{
+	struct supertype *st;
+	int dfd;
+
+	if (sbc->cached)
+		sb_cache_unlink(sbc);
+	if (sbc->refcnt == 1) {
+		st = sbc->st;
+		sbc->st = NULL;
+		sb_cache_put(sbc);
+		return st;
+	}
+	st = dup_super(sbc->st);
+	sb_cache_put(sbc);
+	dfd = dev_open(devname, O_RDONLY);
+	if (dfd < 0 || st->ss->load_super(st, dfd, NULL)) {
+		close_fd(&dfd);
+		free(st);
+		return NULL;
+	}
+	close(dfd);
+	return st;
+}
+
+/**
+ * assemble_cache_flush() - Forget all superblocks cached by Assemble().
+ */
+void assemble_cache_flush(void)
+{
+	struct sb_cache *sbc;
+
+	while (sb_cache_list) {
+		sbc = sb_cache_list;
+		sb_cache_unlink(sbc);
+		if (sbc->refcnt == 0)
+			sb_cache_free(sbc);
+	}
+}
+
 static int select_devices(struct mddev_dev *devlist,
 			  struct mddev_ident *ident,
 			  struct supertype **stp,
@@ -226,6 +428,7 @@ static int select_devices(struct mddev_dev *devlist,
 		char *devname = tmpdev->devname;
 		int dfd;
 		struct supertype *tst;
+		struct sb_cache *sbc = NULL;
 		struct dev_policy *pol = NULL;
 		int found_container = 0;
 
@@ -292,14 +495,16 @@ static int select_devices(struct mddev_dev *devlist,
 			} else
 				found_container = 1;
 		} else {
-			if (!tst && (tst = guess_super(dfd)) == NULL) {
+			free(tst);
+			sbc = sb_cache_get(dfd, rdev, st,
+					   report_mismatch ? devname : NULL);
+			tst = sbc->st;
+			if (sbc->status == SBC_UNKNOWN) {
 				if (report_mismatch)
 					pr_err("no recogniseable superblock on %s\n",
 					       devname);
 				tmpdev->used = 2;
-			} else if ((tst->ignore_hw_compat = 0),
-				   tst->ss->load_super(tst, dfd,
-						       report_mismatch ? devname : NULL)) {
+			} else if (sbc->status == SBC_BAD) {
 				if (report_mismatch)
 					pr_err("no RAID superblock on %s\n",
 					       devname);
@@ -341,7 +546,9 @@ static int select_devices(struct mddev_dev *devlist,
 				st->ss->free_super(st);
 			dev_policy_free(pol);
 			domain_free(domains);
-			if (tst)
+			if (sbc)
+				sb_cache_put(sbc);
+			else if (tst)
 				tst->ss->free_super(tst);
 			return -1;
 		}
@@ -493,6 +700,18 @@ static int select_devices(struct mddev_dev *devlist,
 				goto loop;
 			}
 
+			/* compare_super() may take over tst's superblock,
+			 * and this device is about to become ours anyway.
+			 */
+			tst = sb_cache_claim(sbc, devname);
+			sbc = NULL;
+			if (!tst) {
+				if (report_mismatch)
+					pr_err("cannot reload superblock on %s\n",
+					       devname);
+				goto loop;
+			}
+
 			if (st->ss != tst->ss ||
 			    st->minor_version != tst->minor_version ||
 			    st->ss->compare_super(st, tst, 1) != 0) {
@@ -546,7 +765,9 @@ static int select_devices(struct mddev_dev *devlist,
 		}
 		dev_policy_free(pol);
 		pol = NULL;
-		if (tst)
+		if (sbc)
+			sb_cache_put(sbc);
+		else if (tst)
 			tst->ss->free_super(tst);
 	}
 
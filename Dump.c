@@ -19,6 +19,210 @@
 
 #include "mdadm.h"
 #include <sys/dir.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+
+/* Each dump directory has an index listing, for every dump file, its size
+ * and the data extents in it with their crc32.  Restore checks all of
+ * them before touching any device.
+ */
+#define DUMP_INDEX ".index"
+/* Number of devices dumped at once by Dump_devices() */
+#define DUMP_JOBS 8
+#define DUMP_BUF_SIZE (1024 * 1024)
+
+static unsigned long crc_range(int fd, off_t start, off_t end,
+			       unsigned char *buf, int *err)
+{
+	unsigned long crc = 0;
+
+	while (start < end) {
+		size_t len = end - start;
+		ssize_t n;
+
+		if (len > DUMP_BUF_SIZE)
+			len = DUMP_BUF_SIZE;
+		n = pread(fd, buf, len, start);
+		if (n <= 0) {
+			*err = 1;
+			break;
+		}
+		crc = crc32(crc, buf, n);
+		start += n;
+	}
+	return crc;
+}
+
+static int dump_index_keep(char *dir, char *name, char *line)
+{
+	/* Should this index line stay when 'name' is (re)added?  Lines
+	 * for 'name' are replaced, lines for files that are gone dropped.
+	 */
+	char *path = NULL;
+	struct stat stb;
+	size_t len = strcspn(line, " \n");
+	int keep;
+
+	if (!len || (strlen(name) == len && strncmp(line, name, len) == 0))
+		return 0;
+	xasprintf(&path, "%s/%.*s", dir, (int)len, line);
+	keep = stat(path, &stb) == 0;
+	free(path);
+	return keep;
+}
+
+static void dump_index_add(char *dir, char *name, int fl)
+{
+	/* Walk the data extents of a sparse dump file with SEEK_DATA/
+	 * SEEK_HOLE, so only metadata is read, and record one line in
+	 * the index:  name size start+len:crc ...
+	 * The index is rewritten under a lock on the directory, which
+	 * workers dumping concurrently take in turn, and then renamed
+	 * into place.
+	 */
+	unsigned char *buf;
+	char *line = NULL, *path = NULL, *tmp = NULL;
+	char *old = NULL;
+	size_t oldsize = 0;
+	off_t data, hole, size;
+	int len, err = 0;
+	int dfd;
+	FILE *in, *out;
+
+	size = lseek(fl, 0, SEEK_END);
+	if (size < 0 || posix_memalign((void **)&buf, 4096, DUMP_BUF_SIZE))
+		return;
+	len = xasprintf(&line, "%s %llu", name, (unsigned long long)size);
+	for (data = lseek(fl, 0, SEEK_DATA); data >= 0 && data < size;
+	     data = lseek(fl, hole, SEEK_DATA)) {
+		unsigned long crc;
+
+		hole = lseek(fl, data, SEEK_HOLE);
+		if (hole < 0)
+			hole = size;
+		crc = crc_range(fl, data, hole, buf, &err);
+		line = xrealloc(line, len + 64);
+		len += snprintf(line + len, 64, " %llu+%llu:%08lx",
+				(unsigned long long)data,
+				(unsigned long long)(hole - data), crc);
+	}
+	free(buf);
+	if (err) {
+		free(line);
+		return;
+	}
+	line = xrealloc(line, len + 2);
+	strcpy(line + len++, "\n");
+
+	xasprintf(&path, "%s/%s", dir, DUMP_INDEX);
+	xasprintf(&tmp, "%s/%s.new", dir, DUMP_INDEX);
+	dfd = open(dir, O_RDONLY|O_DIRECTORY);
+	if (dfd < 0 || flock(dfd, LOCK_EX) != 0) {
+		err = 1;
+		goto out;
+	}
+	out = fopen(tmp, "w");
+	if (!out) {
+		err = 1;
+		goto out;
+	}
+	in = fopen(path, "r");
+	if (in) {
+		while (getline(&old, &oldsize, in) > 0)
+			if (dump_index_keep(dir, name, old))
+				fputs(old, out);
+		fclose(in);
+	}
+	fputs(line, out);
+	if (fflush(out) != 0 || fsync(fileno(out)) != 0)
+		err = 1;
+	if (fclose(out) != 0 || err || rename(tmp, path) != 0) {
+		err = 1;
+		unlink(tmp);
+	}
+out:
+	if (err)
+		pr_err("Could not add %s to %s\n", name, path);
+	if (dfd >= 0)
+		close(dfd);
+	free(old);
+	free(tmp);
+	free(path);
+	free(line);
+}
+
+/**
+ * Dump_verify() - Check every dump file listed in a dump directory's index.
+ * @dir: Dump directory.
+ * @verbose: Verbosity level.
+ *
+ * Only the extents recorded in the index are read.  A directory without
+ * an index (from an older mdadm) is accepted as it is, and so are dump
+ * files that were removed since they were indexed.
+ *
+ * Return: 0 if all files match, 1 otherwise.
+ */
+int Dump_verify(char *dir, int verbose)
+{
+	unsigned char *buf;
+	char *path = NULL;
+	char *line = NULL;
+	size_t size_line = 0;
+	int rv = 0;
+	FILE *f;
+
+	xasprintf(&path, "%s/%s", dir, DUMP_INDEX);
+	f = fopen(path, "r");
+	free(path);
+	if (!f)
+		return 0;
+	if (posix_memalign((void **)&buf, 4096, DUMP_BUF_SIZE)) {
+		fclose(f);
+		return 1;
+	}
+	while (getline(&line, &size_line, f) > 0) {
+		char *name = strtok(line, " \n");
+		char *tok = strtok(NULL, " \n");
+		unsigned long long size, start, len;
+		unsigned long crc;
+		struct stat stb;
+		int fl, bad = 0;
+
+		if (!name || !tok)
+			continue;
+		size = strtoull(tok, NULL, 10);
+		path = NULL;
+		xasprintf(&path, "%s/%s", dir, name);
+		fl = open(path, O_RDONLY);
+		if (fl < 0 && errno == ENOENT) {
+			free(path);
+			continue;
+		}
+		if (fl < 0 || fstat(fl, &stb) != 0 ||
+		    (unsigned long long)stb.st_size != size)
+			bad = 1;
+		while (!bad && (tok = strtok(NULL, " \n")) != NULL) {
+			int err = 0;
+
+			if (sscanf(tok, "%llu+%llu:%lx", &start, &len, &crc) != 3 ||
+			    crc_range(fl, start, start + len, buf, &err) != crc ||
+			    err)
+				bad = 1;
+		}
+		if (bad) {
+			pr_err("%s does not match the index in %s\n", path, dir);
+			rv = 1;
+		} else if (verbose > 0)
+			pr_err("%s verified.\n", path);
+		if (fl >= 0)
+			close(fl);
+		free(path);
+	}
+	fclose(f);
+	free(line);
+	free(buf);
+	return rv;
+}
 
 int Dump_metadata(char *dev, char *dir, struct context *c,
 		  struct supertype *st)
@@ -110,6 +314,7 @@ int Dump_metadata(char *dev, char *dir, struct context *c,
 		free(fname);
 		return 1;
 	}
+	dump_index_add(dir, base, fl);
 	if (c->verbose >= 0)
 		printf("%s saved as %s.\n", dev, fname);
 	fstat(fd, &dstb);
@@ -155,6 +360,79 @@ int Dump_metadata(char *dev, char *dir, struct context *c,
 	return 0;
 }
 
+/**
+ * Dump_devices() - Dump metadata from several devices concurrently.
+ * @devlist: Devices to dump.
+ * @dir: Directory to dump to.
+ * @c: Context.
+ * @st: Metadata type, or NULL to guess.
+ * @quiet_missing: Don't report devices without metadata, for --scan.
+ *
+ * Up to DUMP_JOBS devices are dumped at a time, each by Dump_metadata()
+ * in a child process.
+ *
+ * Return: the OR of the Dump_metadata() results.
+ */
+int Dump_devices(struct mddev_dev *devlist, char *dir, struct context *c,
+		 struct supertype *st, int quiet_missing)
+{
+	struct stat stb;
+	int running = 0;
+	int rv = 0;
+	int status;
+
+	if (stat(dir, &stb) != 0 ||
+	    (S_IFMT & stb.st_mode) != S_IFDIR) {
+		pr_err("--dump requires an existing directory, not: %s\n",
+			dir);
+		return 16;
+	}
+	fflush(stdout);
+	fflush(stderr);
+	for (; devlist; devlist = devlist->next) {
+		pid_t pid;
+
+		if (running >= DUMP_JOBS && wait(&status) > 0) {
+			running--;
+			if (WIFEXITED(status))
+				rv |= WEXITSTATUS(status);
+		}
+		pid = fork();
+		if (pid == 0) {
+			struct supertype *tst = dup_super(st);
+
+			if (quiet_missing) {
+				int fd = dev_open(devlist->devname, O_RDONLY);
+
+				if (fd < 0)
+					exit(0);
+				if (!tst)
+					tst = guess_super_type(fd, guess_array);
+				close(fd);
+				if (!tst)
+					exit(0);
+			}
+			exit(Dump_metadata(devlist->devname, dir, c, tst));
+		}
+		if (pid < 0) {
+			struct supertype *tst = dup_super(st);
+
+			rv |= Dump_metadata(devlist->devname, dir, c, tst);
+			if (tst) {
+				tst->ss->free_super(tst);
+				free(tst);
+			}
+		} else
+			running++;
+	}
+	while (running && wait(&status) > 0) {
+		running--;
+		if (WIFEXITED(status))
+			rv |= WEXITSTATUS(status);
+	}
+	return rv;
+}
+
 int Restore_metadata(char *dev, char *dir, struct context *c,
 		     struct supertype *st, int only)
 {
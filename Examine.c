@@ -30,6 +30,23 @@
 #endif
 #include	"md_u.h"
 #include	"md_p.h"
+
+static int examine_json(char *devname, struct context *c, void *forcest)
+{
+	struct mddev_dev dv = { .devname = devname };
+
+	if (c->scan) {
+		/* devices without metadata are expected, keep quiet */
+		int fd = open("/dev/null", O_WRONLY);
+
+		if (fd >= 0) {
+			dup2(fd, 2);
+			close(fd);
+		}
+	}
+	return Examine(&dv, c, forcest);
+}
+
 int Examine(struct mddev_dev *devlist,
 	    struct context *c,
 	    struct supertype *forcest)
@@ -62,6 +79,25 @@ int Examine(struct mddev_dev *devlist,
 		int spares;
 	} *arrays = NULL;
 
+	if (c->json) {
+		struct context jc = *c;
+		struct mddev_dev *dv;
+		char **names;
+		int cnt = 0;
+
+		for (dv = devlist; dv; dv = dv->next)
+			cnt++;
+		names = xcalloc(cnt, sizeof(*names));
+		for (cnt = 0, dv = devlist; dv; dv = dv->next)
+			names[cnt++] = dv->devname;
+		jc.json = 0;
+		jc.brief = 0;
+		rv = json_scan("devices", names, cnt, examine_json, &jc,
+			       forcest, c->scan);
+		free(names);
+		return rv;
+	}
+
 	for (; devlist ; devlist = devlist->next) {
 		struct supertype *st;
 		int have_container = 0;
@@ -3868,7 +3868,8 @@ int progress_reshape(struct mdinfo *info, struct reshape *reshape,
 		     unsigned long long backup_point,
 		     unsigned long long wait_point,
 		     unsigned long long *suspend_point,
-		     unsigned long long *reshape_completed, int *frozen)
+		     unsigned long long *reshape_completed, int *frozen,
+		     struct reshape_wait *rw)
 {
 	/* This function is called repeatedly by the reshape manager.
 	 * It determines how much progress can safely be made and allows
@@ -4091,43 +4092,22 @@ int progress_reshape(struct mdinfo *info, struct reshape *reshape,
 		sysfs_set_num(info, NULL, "sync_max", max_progress);
 
 	/* Now wait.  If we have already reached the point that we were
-	 * asked to wait to, don't wait at all, else wait for any change.
-	 * We need to select on 'sync_completed' as that is the place that
-	 * notifications happen, but we are really interested in
-	 * 'reshape_position'
+	 * asked to wait to, don't wait at all, else sleep until
+	 * 'sync_completed' gets there or 'sync_action' stops being
+	 * 'reshape'.  We are really interested in 'reshape_position'
+	 * but 'sync_completed' is where the notifications happen.
 	 */
-	fd = sysfs_get_fd(info, NULL, "sync_completed");
+	fd = rw->completed_fd;
 	if (fd < 0)
 		goto check_progress;
 
-	if (sysfs_fd_get_ll(fd, &completed) < 0)
+	switch (reshape_wait_step(rw, min(max_progress, wait_point), -1)) {
+	case RESHAPE_WAIT_ERROR:
+	case RESHAPE_WAIT_NONE:
 		goto check_progress;
-
-	while (completed < max_progress && completed < wait_point) {
-		/* Check that sync_action is still 'reshape' to avoid
-		 * waiting forever on a dead array
-		 */
-		char action[20];
-		if (sysfs_get_str(info, NULL, "sync_action", action, 20) <= 0 ||
-		    strncmp(action, "reshape", 7) != 0)
-			break;
-		/* Some kernels reset 'sync_completed' to zero
-		 * before setting 'sync_action' to 'idle'.
-		 * So we need these extra tests.
-		 */
-		if (completed == 0 && advancing &&
-		    strncmp(action, "idle", 4) == 0 &&
-		    info->reshape_progress > 0)
-			break;
-		if (completed == 0 && !advancing &&
-		    strncmp(action, "idle", 4) == 0 &&
-		    info->reshape_progress <
-		    (info->component_size * reshape->after.data_disks))
-			break;
-		sysfs_wait(fd, NULL);
-		if (sysfs_fd_get_ll(fd, &completed) < 0)
-			goto check_progress;
 	}
+	completed = rw->completed;
+
 	/* Some kernels reset 'sync_completed' to zero,
 	 * we need to have real point we are in md.
 	 * So in that case, read 'reshape_position' from sysfs.
@@ -4154,8 +4134,6 @@ int progress_reshape(struct mdinfo *info, struct reshape *reshape,
 		*reshape_completed = completed;
 	}
 
-	close(fd);
-
 	/* We return the need_backup flag.  Caller will decide
 	 * how much - a multiple of ->backup_blocks up to *suspend_point
 	 */
@@ -4199,13 +4177,9 @@ check_progress:
 				break;
 			}
 		}
-		if (fd >= 0)
-			close(fd);
 		return rv; /* abort */
 	} else {
 		/* Maybe racing with array shutdown - check state */
-		if (fd >= 0)
-			close(fd);
 		if (sysfs_get_str(info, NULL, "array_state", buf,
 				  sizeof(buf)) < 0 ||
 		    strncmp(buf, "inactive", 8) == 0 ||
@@ -4493,6 +4467,7 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 	unsigned long stripes;
 	int uuid[4];
 	int frozen = 0;
+	struct reshape_wait rw;
 
 	/* set up the backup-super-block.  This requires the
 	 * uuid from the array.
@@ -4546,6 +4521,7 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 		suspend_point = array_size;
 	}
 
+	reshape_wait_open(&rw, sra);
 	while (!done) {
 		int rv;
 
@@ -4574,7 +4550,7 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 		rv = progress_reshape(sra, reshape,
 				      backup_point, wait_point,
 				      &suspend_point, &reshape_completed,
-				      &frozen);
+				      &frozen, &rw);
 		/* external metadata would need to ping_monitor here */
 		sra->reshape_progress = reshape_completed;
 
@@ -4660,6 +4636,8 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 		}
 	}
 
+	reshape_wait_close(&rw, sra->sys_name);
+
 	/* FIXME maybe call progress_reshape one more time instead */
 	/* remove any remaining suspension */
 	sysfs_set_num(sra, NULL, "suspend_lo", 0x7FFFFFFFFFFFFFFFULL);
@@ -32,10 +32,14 @@
 #include	<sys/wait.h>
 #include	<dirent.h>
 #include	<ctype.h>
+#include	<poll.h>
+#include	<sys/socket.h>
+#include	<sys/un.h>
 
 static int count_active(struct supertype *st, struct mdinfo *sra,
 			int mdfd, char **availp,
 			struct mdinfo *info);
+static void member_cache_remove(char *devnm);
 static void find_reject(int mdfd, struct supertype *st, struct mdinfo *sra,
 			int number, __u64 events, int verbose,
 			char *array_name);
@@ -585,6 +589,7 @@ int Incremental(struct mddev_dev *devlist, struct context *c,
 		 */
 		reopen_mddev(mdfd);
 		if (rv == 0) {
+			member_cache_remove(fd2devnm(mdfd));
 			if (c->export) {
 				printf("MD_STARTED=yes\n");
 			} else if (c->verbose >= 0)
@@ -676,6 +681,174 @@ static void find_reject(int mdfd, struct supertype *st, struct mdinfo *sra,
 	}
 }
 
+/*
+ * Each arrival used to load the superblock of every member already in
+ * the array, so assembling N devices took N^2 reads.  While an array is
+ * inactive nothing writes to its members' metadata, so count_active()
+ * keeps what it needs from each member in MAP_DIR/<devnm>.members and
+ * only reads the superblocks of new members, and of the best one.
+ * An entry is only trusted while the member is still bound to the same
+ * array: it records the inode of the member's dev-* directory in sysfs,
+ * which is created afresh whenever a device is bound.
+ */
+struct member_state {
+	char sys_name[32];
+	unsigned long long ino;
+	unsigned long long events;
+	int state;
+	int raid_disk;
+	char *devmap;		/* this member's view of each role */
+	struct member_state *next;
+};
+
+static void member_cache_name(char *path, int len, char *devnm, char *suffix)
+{
+	snprintf(path, len, "%s/%s.members%s", MAP_DIR, devnm, suffix);
+}
+
+static unsigned long long member_ino(struct mdinfo *sra, struct mdinfo *d)
+{
+	char path[PATH_MAX];
+	struct stat stb;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/md/%s",
+		 sra->sys_name, d->sys_name);
+	if (stat(path, &stb) < 0)
+		return 0;
+	return stb.st_ino;
+}
+
+static void free_member_states(struct member_state *ms)
+{
+	while (ms) {
+		struct member_state *next = ms->next;
+
+		free(ms->devmap);
+		free(ms);
+		ms = next;
+	}
+}
+
+/* Read the cache for @sra, if it is for array @uuid */
+static struct member_state *member_cache_read(struct mdinfo *sra, int uuid[4],
+					      int *raid_disksp)
+{
+	struct member_state *list = NULL;
+	char path[PATH_MAX];
+	char *line = NULL;
+	size_t len = 0;
+	int u[4], raid_disks;
+	FILE *f;
+
+	member_cache_name(path, sizeof(path), sra->sys_name, "");
+	f = fopen(path, "r");
+	if (!f)
+		return NULL;
+	if (fscanf(f, "%x:%x:%x:%x %d\n", &u[0], &u[1], &u[2], &u[3],
+		   &raid_disks) != 5 || !same_uuid(u, uuid, 0) ||
+	    raid_disks <= 0)
+		goto out;
+	while (getline(&line, &len, f) > 0) {
+		struct member_state *ms = xcalloc(1, sizeof(*ms));
+		char *map = xmalloc(strlen(line) + 1);
+		int i;
+
+		if (sscanf(line, "%31s %llu %llu %d %d %s", ms->sys_name,
+			   &ms->ino, &ms->events, &ms->state, &ms->raid_disk,
+			   map) != 6 ||
+		    (int)strlen(map) != raid_disks) {
+			free(map);
+			free(ms);
+			continue;
+		}
+		for (i = 0; i < raid_disks; i++)
+			map[i] = map[i] == '1';
+		ms->devmap = map;
+		ms->next = list;
+		list = ms;
+	}
+	*raid_disksp = raid_disks;
+out:
+	free(line);
+	fclose(f);
+	return list;
+}
+
+static void member_cache_write(struct mdinfo *sra, int uuid[4], int raid_disks,
+			       struct member_state **states, int numdevs)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	FILE *f;
+	int n, i;
+
+	member_cache_name(path, sizeof(path), sra->sys_name, "");
+	member_cache_name(tmp, sizeof(tmp), sra->sys_name, ".new");
+	f = fopen(tmp, "w");
+	if (!f)
+		return;
+	fprintf(f, "%08x:%08x:%08x:%08x %d\n", uuid[0], uuid[1], uuid[2],
+		uuid[3], raid_disks);
+	for (n = 0; n < numdevs; n++) {
+		struct member_state *ms = states[n];
+
+		if (!ms)
+			continue;
+		fprintf(f, "%s %llu %llu %d %d ", ms->sys_name, ms->ino,
+			ms->events, ms->state, ms->raid_disk);
+		for (i = 0; i < raid_disks; i++)
+			fputc(ms->devmap[i] ? '1' : '0', f);
+		fputc('\n', f);
+	}
+	if (fclose(f) != 0 || rename(tmp, path) != 0)
+		unlink(tmp);
+}
+
+static void member_cache_remove(char *devnm)
+{
+	char path[PATH_MAX];
+
+	member_cache_name(path, sizeof(path), devnm, "");
+	unlink(path);
+}
+
+static int load_member_super(struct supertype *st, struct mdinfo *d)
+{
+	char dn[30];
+	int dfd, rv;
+
+	sprintf(dn, "%d:%d", d->disk.major, d->disk.minor);
+	dfd = dev_open(dn, O_RDONLY);
+	if (dfd < 0)
+		return -1;
+	rv = st->ss->load_super(st, dfd, NULL);
+	close(dfd);
+	return rv;
+}
+
+/* Fill @ms from the superblock of @d.  Sets *raid_disksp if still 0 */
+static int load_member_state(struct supertype *st, struct mdinfo *d,
+			     struct member_state *ms, int *raid_disksp)
+{
+	struct mdinfo info;
+
+	if (load_member_super(st, d) != 0)
+		return -1;
+
+	info.array.raid_disks = *raid_disksp;
+	st->ss->getinfo_super(st, &info, NULL);
+	if (!*raid_disksp)
+		*raid_disksp = info.array.raid_disks;
+	ms->devmap = xcalloc(*raid_disksp, 1);
+	info.array.raid_disks = *raid_disksp;
+	st->ss->getinfo_super(st, &info, ms->devmap);
+	st->ss->free_super(st);
+
+	ms->events = info.events;
+	ms->state = info.disk.state;
+	ms->raid_disk = info.disk.raid_disk;
+	return 0;
+}
+
 static int count_active(struct supertype *st, struct mdinfo *sra,
 			int mdfd, char **availp,
 			struct mdinfo *bestinfo)
@@ -688,7 +861,11 @@ static int count_active(struct supertype *st, struct mdinfo *sra,
 	__u64 max_journal_events = 0;
 	char *avail = NULL;
 	int *best = NULL;
-	char *devmap = NULL;
+	struct member_state *cache = NULL, **states = NULL;
+	struct mdinfo *bestdev = NULL;
+	int use_cache, changed = 0;
+	int cache_disks = 0;
+	int uuid[4];
 	int numdevs = 0;
 	int devnum;
 	int b, i;
@@ -697,82 +874,111 @@ static int count_active(struct supertype *st, struct mdinfo *sra,
 	if (!sra)
 		return 0;
 
+	/* On arrival @bestinfo describes the new device, so it names
+	 * the array the cache must belong to.
+	 */
+	memcpy(uuid, bestinfo->uuid, sizeof(uuid));
+	use_cache = !md_array_active(mdfd);
+	if (use_cache)
+		cache = member_cache_read(sra, uuid, &cache_disks);
+	else
+		member_cache_remove(sra->sys_name);
+
 	for (d = sra->devs ; d ; d = d->next)
 		numdevs++;
+	states = xcalloc(numdevs, sizeof(*states));
 	for (d = sra->devs, devnum = 0 ; d ; d = d->next, devnum++) {
-		char dn[30];
-		int dfd;
-		int ok;
-		struct mdinfo info;
+		unsigned long long ino = use_cache ? member_ino(sra, d) : 0;
+		struct member_state *ms, **msp;
 
-		sprintf(dn, "%d:%d", d->disk.major, d->disk.minor);
-		dfd = dev_open(dn, O_RDONLY);
-		if (dfd < 0)
-			continue;
-		ok =  st->ss->load_super(st, dfd, NULL);
-		close(dfd);
-		if (ok != 0)
-			continue;
+		for (msp = &cache; ino && *msp; msp = &(*msp)->next)
+			if ((*msp)->ino == ino &&
+			    strcmp((*msp)->sys_name, d->sys_name) == 0)
+				break;
+		if (ino && *msp &&
+		    (raid_disks == 0 || raid_disks == cache_disks)) {
+			ms = *msp;
+			*msp = ms->next;
+			raid_disks = cache_disks;
+		} else {
+			ms = xcalloc(1, sizeof(*ms));
+			if (load_member_state(st, d, ms, &raid_disks) != 0) {
+				free(ms);
+				continue;
+			}
+			snprintf(ms->sys_name, sizeof(ms->sys_name), "%s",
+				 d->sys_name);
+			ms->ino = ino;
+			changed = 1;
+		}
+		states[devnum] = ms;
 
-		info.array.raid_disks = raid_disks;
-		st->ss->getinfo_super(st, &info, devmap + raid_disks * devnum);
-		if (info.disk.raid_disk == MD_DISK_ROLE_JOURNAL &&
-		    info.events > max_journal_events)
-			max_journal_events = info.events;
+		if (ms->raid_disk == MD_DISK_ROLE_JOURNAL &&
+		    ms->events > max_journal_events)
+			max_journal_events = ms->events;
 		if (!avail) {
-			raid_disks = info.array.raid_disks;
 			avail = xcalloc(raid_disks, 1);
 			*availp = avail;
 
 			best = xcalloc(raid_disks, sizeof(int));
-			devmap = xcalloc(raid_disks, numdevs);
-
-			st->ss->getinfo_super(st, &info, devmap);
 		}
 
-		if (info.disk.state & (1<<MD_DISK_SYNC))
+		if (ms->state & (1<<MD_DISK_SYNC))
 		{
 			if (cnt == 0) {
 				cnt++;
-				max_events = info.events;
-				avail[info.disk.raid_disk] = 2;
-				best[info.disk.raid_disk] = devnum;
-				st->ss->getinfo_super(st, bestinfo, NULL);
-			} else if (info.events == max_events) {
-				avail[info.disk.raid_disk] = 2;
-				best[info.disk.raid_disk] = devnum;
-			} else if (info.events == max_events-1) {
-				if (avail[info.disk.raid_disk] == 0) {
-					avail[info.disk.raid_disk] = 1;
-					best[info.disk.raid_disk] = devnum;
+				max_events = ms->events;
+				avail[ms->raid_disk] = 2;
+				best[ms->raid_disk] = devnum;
+				bestdev = d;
+			} else if (ms->events == max_events) {
+				avail[ms->raid_disk] = 2;
+				best[ms->raid_disk] = devnum;
+			} else if (ms->events == max_events-1) {
+				if (avail[ms->raid_disk] == 0) {
+					avail[ms->raid_disk] = 1;
+					best[ms->raid_disk] = devnum;
 				}
-			} else if (info.events < max_events - 1)
+			} else if (ms->events < max_events - 1)
 				;
-			else if (info.events == max_events+1) {
+			else if (ms->events == max_events+1) {
 				int i;
-				max_events = info.events;
+				max_events = ms->events;
 				for (i = 0; i < raid_disks; i++)
 					if (avail[i])
 						avail[i]--;
-				avail[info.disk.raid_disk] = 2;
-				best[info.disk.raid_disk] = devnum;
-				st->ss->getinfo_super(st, bestinfo, NULL);
-			} else { /* info.events much bigger */
+				avail[ms->raid_disk] = 2;
+				best[ms->raid_disk] = devnum;
+				bestdev = d;
+			} else { /* ms->events much bigger */
 				memset(avail, 0, raid_disks);
-				max_events = info.events;
-				avail[info.disk.raid_disk] = 2;
-				best[info.disk.raid_disk] = devnum;
-				st->ss->getinfo_super(st, bestinfo, NULL);
+				max_events = ms->events;
+				avail[ms->raid_disk] = 2;
+				best[ms->raid_disk] = devnum;
+				bestdev = d;
 			}
-		} else if (info.disk.state & (1<<MD_DISK_REPLACEMENT))
+		} else if (ms->state & (1<<MD_DISK_REPLACEMENT))
 			replcnt++;
+	}
+	/* anything left in the cache is no longer a member */
+	if (cache)
+		changed = 1;
+	free_member_states(cache);
+	if (use_cache && changed)
+		member_cache_write(sra, uuid, raid_disks, states, numdevs);
+
+	/* The caller wants everything about the freshest member */
+	if (bestdev && load_member_super(st, bestdev) == 0) {
+		st->ss->getinfo_super(st, bestinfo, NULL);
 		st->ss->free_super(st);
 	}
 	if (max_journal_events >= max_events - 1)
 		bestinfo->journal_clean = 1;
 
-	if (!avail)
+	if (!avail) {
+		free(states);
 		return 0;
+	}
 	/* We need to reject any device that thinks the best device is
 	 * failed or missing */
 	for (b = 0; b < raid_disks; b++)
@@ -781,7 +987,7 @@ static int count_active(struct supertype *st, struct mdinfo *sra,
 	cnt = 0;
 	for (i = 0 ; i < raid_disks ; i++) {
 		if (i != b && avail[i])
-			if (devmap[raid_disks * best[i] + b] == 0) {
+			if (states[best[i]]->devmap[b] == 0) {
 				/* This device thinks 'b' is failed -
 				 * don't use it */
 				devnum = best[i];
@@ -802,7 +1008,12 @@ static int count_active(struct supertype *st, struct mdinfo *sra,
 			d->disk.state |= (1 << MD_DISK_REMOVED);
 	}
 	free(best);
-	free(devmap);
+	for (i = 0; i < numdevs; i++)
+		if (states[i]) {
+			free(states[i]->devmap);
+			free(states[i]);
+		}
+	free(states);
 	return cnt + replcnt;
 }
 
@@ -1776,3 +1987,324 @@ end:
 	free_mdstat(ent);
 	return rv;
 }
+
+/*
+ * --incremental --listen: a long lived assembler.
+ *
+ * When many devices appear at once, udev runs one "mdadm --incremental"
+ * for each, and they all serialise on the map lock, each re-reading
+ * mdadm.conf and the state of the array.  If a listener is running,
+ * "mdadm --incremental device" instead hands the device name to it over a
+ * datagram socket and exits.  The listener groups devices by array uuid
+ * and only assembles an array once no new member has turned up for
+ * INC_SETTLE_MSEC (or the batch has waited INC_BATCH_MAX_MSEC), adding
+ * all of them from the one process.  Only the last device of a batch is
+ * allowed to start the array early with --run, so an array is started
+ * once, with every member that arrived.  Callers that want --export
+ * output still add the device themselves; for handed over devices the
+ * listener arms mdadm-last-resort@.timer where the udev rules would.
+ */
+#define INCREMENTAL_SOCK MAP_DIR "/incremental.sock"
+#define INC_SETTLE_MSEC 500
+#define INC_BATCH_MAX_MSEC 5000
+
+struct inc_batch {
+	int uuid[4];
+	int known;		/* uuid is valid */
+	struct mddev_dev *devs, **tail;
+	unsigned long long first, last;	/* msec, when devices were queued */
+	struct inc_batch *next;
+};
+
+static volatile sig_atomic_t inc_stop;
+
+static void inc_sig(int sig)
+{
+	inc_stop = 1;
+}
+
+static unsigned long long inc_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static int inc_sockaddr(struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	return snprintf(addr->sun_path, sizeof(addr->sun_path), "%s",
+			INCREMENTAL_SOCK) >= (int)sizeof(addr->sun_path);
+}
+
+/*
+ * Pass @devname to a running listener.
+ * Returns 0 if it was queued there, 1 if the caller must add the device
+ * itself because no listener is running, or it cannot take more.
+ */
+int IncrementalHandoff(char *devname)
+{
+	struct sockaddr_un addr;
+	int fd, rv;
+
+	if (devname[0] != '/' || strlen(devname) >= PATH_MAX)
+		return 1;
+	if (inc_sockaddr(&addr))
+		return 1;
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return 1;
+	rv = sendto(fd, devname, strlen(devname) + 1, MSG_DONTWAIT,
+		    (struct sockaddr *)&addr, sizeof(addr));
+	close(fd);
+	return rv < 0;
+}
+
+/* uuid of the array @devname belongs to, or -1 if it has no metadata */
+static int inc_device_uuid(char *devname, int uuid[4])
+{
+	struct supertype *st;
+	struct mdinfo info;
+	int fd, rv = -1;
+
+	fd = dev_open(devname, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	st = guess_super(fd);
+	if (st && st->ss->load_super(st, fd, NULL) == 0) {
+		st->ss->getinfo_super(st, &info, NULL);
+		memcpy(uuid, info.uuid, sizeof(info.uuid));
+		st->ss->free_super(st);
+		rv = 0;
+	}
+	free(st);
+	close(fd);
+	return rv;
+}
+
+static void inc_queue(struct inc_batch **batches, char *devname,
+		      unsigned long long now)
+{
+	struct inc_batch *b;
+	struct mddev_dev *dv;
+	int uuid[4];
+	int known = inc_device_uuid(devname, uuid) == 0;
+
+	for (b = *batches; b; b = b->next)
+		if (known && b->known && same_uuid(b->uuid, uuid, 0))
+			break;
+	if (!b) {
+		b = xcalloc(1, sizeof(*b));
+		memcpy(b->uuid, uuid, sizeof(uuid));
+		b->known = known;
+		b->tail = &b->devs;
+		b->first = now;
+		b->next = *batches;
+		*batches = b;
+	}
+	for (dv = b->devs; dv; dv = dv->next)
+		if (strcmp(dv->devname, devname) == 0)
+			break;
+	if (!dv) {
+		dv = xcalloc(1, sizeof(*dv));
+		dv->devname = xstrdup(devname);
+		*b->tail = dv;
+		b->tail = &dv->next;
+	}
+	b->last = now;
+}
+
+/* Start mdadm-last-resort@devnm.timer, as udev would for "unsafe" */
+static void inc_last_resort(char *devnm)
+{
+	char unit[64];
+	int status;
+	pid_t pid;
+
+	if (check_env("MDADM_NO_SYSTEMCTL"))
+		return;
+	snprintf(unit, sizeof(unit), "mdadm-last-resort@%s.timer", devnm);
+	pid = fork();
+	if (pid == 0) {
+		manage_fork_fds(1);
+		execl("/usr/bin/systemctl", "systemctl", "start", unit, NULL);
+		execl("/bin/systemctl", "systemctl", "start", unit, NULL);
+		exit(1);
+	}
+	while (pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR)
+		;
+}
+
+/*
+ * Add the last device of a batch with its --export output captured, and
+ * arm the last-resort timer the way udev-md-raid-assembly.rules does when
+ * the array was left waiting for devices it could do without.
+ */
+static void inc_run_last(struct mddev_dev *dv, struct context *c)
+{
+	FILE *out = tmpfile();
+	int export = c->export;
+	char devnm[32] = "";
+	int unsafe = 0, foreign = 1;
+	char *line = NULL;
+	size_t len = 0;
+	int saved = -1;
+
+	if (out) {
+		fflush(stdout);
+		saved = dup(1);
+		if (saved >= 0 && dup2(fileno(out), 1) < 0)
+			close_fd(&saved);
+	}
+	if (saved < 0) {
+		if (out)
+			fclose(out);
+		Incremental(dv, c, NULL);
+		return;
+	}
+	c->export = 1;
+	Incremental(dv, c, NULL);
+	c->export = export;
+	fflush(stdout);
+	dup2(saved, 1);
+	close(saved);
+
+	rewind(out);
+	while (getline(&line, &len, out) > 0) {
+		line[strcspn(line, "\n")] = 0;
+		if (strncmp(line, "MD_DEVICE=", 10) == 0)
+			snprintf(devnm, sizeof(devnm), "%s", line + 10);
+		else if (strncmp(line, "MD_FOREIGN=", 11) == 0)
+			foreign = strcmp(line + 11, "no") != 0;
+		else if (strncmp(line, "MD_STARTED=", 11) == 0)
+			unsafe = strstr(line + 11, "unsafe") != NULL;
+	}
+	free(line);
+	fclose(out);
+	if (unsafe && !foreign && devnm[0]) {
+		if (c->verbose > 0)
+			pr_err("%s not started safely, arming last resort timer\n",
+			       devnm);
+		inc_last_resort(devnm);
+	}
+}
+
+static void inc_run_batch(struct inc_batch *b, struct context *c)
+{
+	int runstop = c->runstop;
+	struct mddev_dev *dv, *next;
+
+	/* Device names and superblocks found for earlier batches may
+	 * have changed since.
+	 */
+	map_dev_flush();
+	assemble_cache_flush();
+
+	for (dv = b->devs; dv; dv = next) {
+		next = dv->next;
+		dv->next = NULL;
+		if (c->verbose > 0)
+			pr_err("adding %s%s\n", dv->devname,
+			       next ? "" : " (last of batch)");
+		c->runstop = next ? min(runstop, 0) : runstop;
+		if (next)
+			Incremental(dv, c, NULL);
+		else
+			inc_run_last(dv, c);
+		free(dv->devname);
+		free(dv);
+	}
+	c->runstop = runstop;
+	free(b);
+}
+
+/* msec until the next batch is due, or -1 if there are none */
+static int inc_run_due(struct inc_batch **batches, struct context *c,
+		       unsigned long long now, int all)
+{
+	struct inc_batch **bp = batches;
+	int wait = -1;
+
+	while (*bp) {
+		struct inc_batch *b = *bp;
+		unsigned long long due = min(b->last + INC_SETTLE_MSEC,
+					     b->first + INC_BATCH_MAX_MSEC);
+
+		if (all || !b->known || due <= now) {
+			*bp = b->next;
+			inc_run_batch(b, c);
+			continue;
+		}
+		if (wait < 0 || due - now < (unsigned long long)wait)
+			wait = due - now;
+		bp = &b->next;
+	}
+	return wait;
+}
+
+int IncrementalListen(struct context *c)
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	struct inc_batch *batches = NULL;
+	char buf[PATH_MAX];
+	int fd, timeout = -1;
+	mode_t mask;
+
+	if (inc_sockaddr(&addr))
+		return 1;
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		pr_err("cannot create socket: %s\n", strerror(errno));
+		return 1;
+	}
+	mkdir(MAP_DIR, 0755);
+	unlink(addr.sun_path);
+	mask = umask(0077);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		pr_err("cannot bind to %s: %s\n", addr.sun_path,
+		       strerror(errno));
+		umask(mask);
+		close(fd);
+		return 1;
+	}
+	umask(mask);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = inc_sig;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	if (c->verbose > 0)
+		pr_err("listening on %s\n", addr.sun_path);
+
+	while (!inc_stop) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		int n = poll(&pfd, 1, timeout);
+
+		if (n < 0 && errno != EINTR) {
+			pr_err("poll failed: %s\n", strerror(errno));
+			break;
+		}
+		if (n > 0) {
+			ssize_t len;
+
+			while ((len = recv(fd, buf, sizeof(buf) - 1,
+					   MSG_DONTWAIT)) > 0) {
+				buf[len] = 0;
+				inc_queue(&batches, buf, inc_now());
+			}
+		}
+		timeout = inc_run_due(&batches, c, inc_now(), 0);
+	}
+
+	/* Stop taking new devices before finishing the queued ones, so
+	 * anything sent from now on is added by its sender.
+	 */
+	unlink(addr.sun_path);
+	close(fd);
+	inc_run_due(&batches, c, inc_now(), 1);
+	return 0;
+}
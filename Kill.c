@@ -28,12 +28,63 @@
 #include	"mdadm.h"
 #include	"md_u.h"
 #include	"md_p.h"
+#include	<poll.h>
+#include	<sys/wait.h>
 
-int Kill(char *dev, struct supertype *st, int force, int verbose, int noexcl)
+/* Number of devices --zero-superblock works on at once */
+#define KILL_JOBS 16
+/* Most metadata areas a superswitch reports for one device */
+#define KILL_MAX_AREAS 4
+
+struct kill_report {
+	int rv;
+	int supers;		/* superblocks zeroed */
+	char metadata[32];	/* their versions */
+	unsigned long long cleared;	/* bytes of other metadata cleared */
+	int offloaded;		/* all of it by BLKZEROOUT */
+};
+
+static int zero_area(int fd, unsigned long long offset,
+		     unsigned long long len, int *offloaded)
+{
+	/* Clear the range with BLKZEROOUT so the device can do it without
+	 * moving any data, and fall back to writing zeroes.
+	 */
+	uint64_t range[2] = { offset, len };
+	unsigned long long done = 0;
+	void *buf;
+	int n;
+
+	if (ioctl(fd, BLKZEROOUT, &range) == 0)
+		return 0;
+	*offloaded = 0;
+
+	if (posix_memalign(&buf, 4096, 1024 * 1024) != 0)
+		return -1;
+	memset(buf, 0, 1024 * 1024);
+	while (done < len) {
+		n = 1024 * 1024;
+		if ((unsigned long long)n > len - done)
+			n = len - done;
+		n = pwrite(fd, buf, n, offset + done);
+		if (n <= 0) {
+			free(buf);
+			return -1;
+		}
+		done += n;
+	}
+	free(buf);
+	return fsync(fd);
+}
+
+static int kill_device(char *dev, struct supertype *st, int force,
+		       int verbose, int noexcl, struct kill_report *rep)
 {
 	/*
 	 * Nothing fancy about Kill.  It just zeroes out a superblock
 	 * Definitely not safe.
+	 * With @rep, the other metadata areas the superblock describes
+	 * are cleared too, and what was done is added to @rep.
 	 * Returns:
 	 *  0 - a zero superblock was successfully written out
 	 *  1 - failed to write the zero superblock
@@ -41,7 +92,11 @@ int Kill(char *dev, struct supertype *st, int force, int verbose, int noexcl)
 	 *  4 - failed to find a superblock.
 	 */
 
+	unsigned long long areas[KILL_MAX_AREAS][2];
+	char version[16];
 	int fd, rv = 0;
+	int nareas = 0;
+	int i;
 
 	if (force)
 		noexcl = 1;
@@ -62,6 +117,12 @@ int Kill(char *dev, struct supertype *st, int force, int verbose, int noexcl)
 	}
 	st->ignore_hw_compat = 1;
 	rv = st->ss->load_super(st, fd, dev);
+	if (rv == 0 && rep && st->ss->metadata_areas)
+		nareas = st->ss->metadata_areas(st, areas, KILL_MAX_AREAS);
+	if (strcmp(st->ss->name, "1.x") == 0)
+		snprintf(version, sizeof(version), "1.%d", st->minor_version);
+	else
+		snprintf(version, sizeof(version), "%s", st->ss->name);
 	if (rv == 0 || (force && rv >= 2)) {
 		st->ss->free_super(st);
 		st->ss->init_super(st, NULL, NULL, "", NULL, NULL,
@@ -77,10 +138,182 @@ int Kill(char *dev, struct supertype *st, int force, int verbose, int noexcl)
 			rv = 0;
 		}
 	}
+	if (rv == 0 && rep) {
+		size_t len = strlen(rep->metadata);
+
+		snprintf(rep->metadata + len, sizeof(rep->metadata) - len,
+			 "%s%s", len ? ", " : "", version);
+		rep->supers++;
+		for (i = 0; i < nareas; i++) {
+			if (zero_area(fd, areas[i][0], areas[i][1],
+				      &rep->offloaded) != 0) {
+				if (verbose >= 0)
+					pr_err("Could not clear metadata at %llu on %s\n",
+					       areas[i][0], dev);
+				rv = 1;
+				break;
+			}
+			rep->cleared += areas[i][1];
+		}
+	}
 	close(fd);
 	return rv;
 }
 
+int Kill(char *dev, struct supertype *st, int force, int verbose, int noexcl)
+{
+	return kill_device(dev, st, force, verbose, noexcl, NULL);
+}
+
+static void kill_one(char *dev, struct supertype *st, int force,
+		     int verbose, struct kill_report *rep)
+{
+	/* Without a given metadata type, keep going until no more
+	 * superblocks are found.
+	 */
+	memset(rep, 0, sizeof(*rep));
+	rep->offloaded = 1;
+	if (st) {
+		rep->rv = kill_device(dev, st, force, verbose, 0, rep);
+		return;
+	}
+	do {
+		rep->rv |= kill_device(dev, NULL, force, verbose, 0, rep);
+		verbose = -1;
+	} while (rep->rv == 0);
+	rep->rv &= ~4;
+}
+
+struct kill_job {
+	pid_t pid;
+	int fd;
+	struct kill_report rep;
+};
+
+static void kill_job_start(struct kill_job *job, char *dev,
+			   struct supertype *st, int force, int verbose)
+{
+	int pfd[2];
+
+	job->fd = -1;
+	if (pipe(pfd) < 0) {
+		kill_one(dev, st, force, verbose, &job->rep);
+		return;
+	}
+	fflush(stdout);
+	fflush(stderr);
+	job->pid = fork();
+	switch (job->pid) {
+	case 0:
+		close(pfd[0]);
+		kill_one(dev, st, force, verbose, &job->rep);
+		if (write(pfd[1], &job->rep, sizeof(job->rep)) != sizeof(job->rep))
+			exit(1);
+		exit(0);
+	case -1:
+		close(pfd[0]);
+		close(pfd[1]);
+		kill_one(dev, st, force, verbose, &job->rep);
+		return;
+	}
+	close(pfd[1]);
+	job->fd = pfd[0];
+}
+
+static void kill_job_finish(struct kill_job *job)
+{
+	if (read(job->fd, &job->rep, sizeof(job->rep)) != sizeof(job->rep)) {
+		memset(&job->rep, 0, sizeof(job->rep));
+		job->rep.rv = 1;
+	}
+	close(job->fd);
+	job->fd = -1;
+	waitpid(job->pid, NULL, 0);
+}
+
+/**
+ * Kill_devices() - Zero the superblocks on a list of devices.
+ * @devs: Devices to work on.
+ * @cnt: Number of @devs.
+ * @st: Metadata to look for, or NULL to remove all that is found.
+ * @force: Zero where the superblock would be even if none is found.
+ * @verbose: Verbosity.
+ *
+ * This is --zero-superblock.  Apart from the superblocks, the metadata
+ * areas they describe (bitmap, PPL, bad block log, journal) are cleared,
+ * using BLKZEROOUT where the device supports it.  Each device is handled
+ * in its own child process, up to KILL_JOBS at a time, so that slow
+ * devices don't hold up the rest.  When there is more than one device,
+ * or with --verbose, a summary line per device is printed in the order
+ * of @devs.
+ *
+ * Return: the OR of the Kill() results for the devices.
+ */
+int Kill_devices(char **devs, int cnt, struct supertype *st, int force,
+		 int verbose)
+{
+	struct kill_job *jobs = xcalloc(cnt, sizeof(*jobs));
+	struct pollfd pfds[KILL_JOBS];
+	int running[KILL_JOBS];
+	int next = 0, nrun = 0;
+	int rv = 0;
+	int i, j;
+
+	if (cnt == 1) {
+		kill_one(devs[0], st, force, verbose, &jobs[0].rep);
+	} else while (next < cnt || nrun) {
+		while (nrun < KILL_JOBS && next < cnt) {
+			kill_job_start(&jobs[next], devs[next], st, force,
+				       verbose);
+			if (jobs[next].fd >= 0)
+				running[nrun++] = next;
+			next++;
+		}
+		if (!nrun)
+			break;
+		for (i = 0; i < nrun; i++) {
+			pfds[i].fd = jobs[running[i]].fd;
+			pfds[i].events = POLLIN;
+			pfds[i].revents = 0;
+		}
+		if (poll(pfds, nrun, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = 0, j = 0; i < nrun; i++) {
+			if (pfds[i].revents)
+				kill_job_finish(&jobs[running[i]]);
+			else
+				running[j++] = running[i];
+		}
+		nrun = j;
+	}
+	for (i = 0; i < nrun; i++)
+		kill_job_finish(&jobs[running[i]]);
+
+	for (i = 0; i < cnt; i++) {
+		struct kill_report *rep = &jobs[i].rep;
+
+		rv |= rep->rv;
+		if (verbose < 0 || (cnt == 1 && verbose == 0))
+			continue;
+		if (rep->rv)
+			printf("%s: failed\n", devs[i]);
+		else if (!rep->supers)
+			printf("%s: no superblock found\n", devs[i]);
+		else if (!rep->cleared)
+			printf("%s: zeroed %s superblock\n", devs[i],
+			       rep->metadata);
+		else
+			printf("%s: zeroed %s superblock, cleared %lluK of metadata%s\n",
+			       devs[i], rep->metadata, rep->cleared >> 10,
+			       rep->offloaded ? " (write-zeroes)" : "");
+	}
+	free(jobs);
+	return rv;
+}
+
 int Kill_subarray(char *dev, char *subarray, int verbose)
 {
 	/* Delete a subarray out of a container, the subarry must be
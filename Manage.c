@@ -715,7 +715,7 @@ int Manage_add(int fd, int tfd, struct mddev_dev *dv,
 	       struct supertype *tst, mdu_array_info_t *array,
 	       int force, int verbose, char *devname,
 	       char *update, unsigned long rdev, unsigned long long array_size,
-	       int raid_slot)
+	       int raid_slot, int batch)
 {
 	unsigned long long ldsize;
 	struct supertype *dev_st;
@@ -1033,7 +1033,8 @@ int Manage_add(int fd, int tfd, struct mddev_dev *dv,
 			sysfs_free(sra);
 			return -1;
 		}
-		ping_monitor(devnm);
+		if (!batch)
+			ping_monitor(devnm);
 		sysfs_free(sra);
 		close(container_fd);
 	} else {
@@ -1330,6 +1331,9 @@ int Manage_subdevs(char *devname, int fd,
 	int frozen = 0;
 	int busy = 0;
 	int raid_slot = -1;
+	int batch = -1;
+	char container[32] = "";
+	char *devnm;
 
 	if (sysfs_init(&info, fd, NULL)) {
 		pr_err("sysfs not availabile for %s\n", devname);
@@ -1355,6 +1359,21 @@ int Manage_subdevs(char *devname, int fd,
 		goto abort;
 	}
 
+	/* When several devices are added to or removed from a
+	 * container, have mdmon record them all in one metadata
+	 * update, rather than writing the metadata out for each.
+	 */
+	devnm = fd2devnm(fd);
+	if (devnm)
+		snprintf(container, sizeof(container), "%s", devnm);
+	if (devnm && tst->ss->external && !subarray && !test && devlist &&
+	    (devlist->next || strcmp(devlist->devname, "failed") == 0 ||
+	     strcmp(devlist->devname, "faulty") == 0 ||
+	     strcmp(devlist->devname, "detached") == 0 ||
+	     strcmp(devlist->devname, "missing") == 0) &&
+	    mdmon_running(container))
+		batch = begin_container_batch(container);
+
 	for (dv = devlist; dv; dv = dv->next) {
 		dev_t rdev = 0; /* device to add/remove etc */
 		int rv;
@@ -1570,7 +1589,8 @@ int Manage_subdevs(char *devname, int fd,
 			}
 			rv = Manage_add(fd, tfd, dv, tst, &array,
 					force, verbose, devname, update,
-					rdev, array_size, raid_slot);
+					rdev, array_size, raid_slot,
+					batch >= 0);
 			close(tfd);
 			tfd = -1;
 			if (rv < 0)
@@ -1650,6 +1670,7 @@ int Manage_subdevs(char *devname, int fd,
 			break;
 		}
 	}
+	end_container_batch(batch, container);
 	if (frozen > 0)
 		sysfs_set_str(&info, NULL, "sync_action","idle");
 	if (test && count == 0)
@@ -1657,6 +1678,7 @@ int Manage_subdevs(char *devname, int fd,
 	return 0;
 
 abort:
+	end_container_batch(batch, container);
 	if (frozen > 0)
 		sysfs_set_str(&info, NULL, "sync_action","idle");
 	return !test && busy ? 2 : 1;
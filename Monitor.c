@@ -27,6 +27,8 @@
 #include	"md_u.h"
 #include	<sys/wait.h>
 #include	<limits.h>
+#include	<poll.h>
+#include	<ctype.h>
 #include	<syslog.h>
 #ifndef NO_LIBUDEV
 #include	<libudev.h>
@@ -62,11 +64,16 @@ struct alert_info {
 	char *mailfrom;
 	char *alert_cmd;
 	int dosyslog;
+	int json;		/* write each event to stdout as a JSON line */
+	int window;		/* seconds to collect an array's events for */
+	int helper_fd;		/* pipe to the delivery process, or -1 */
+	pid_t helper;
 };
 static int make_daemon(char *pidfile);
 static int check_one_sharer(int scan);
 static void write_autorebuild_pid(void);
 static void alert(char *event, char *dev, char *disc, struct alert_info *info);
+static void alert_helper_stop(struct alert_info *info);
 static int check_array(struct state *st, struct mdstat_ent *mdstat,
 		       int test, struct alert_info *info,
 		       int increments, char *prefer);
@@ -83,7 +90,7 @@ int Monitor(struct mddev_dev *devlist,
 	    struct context *c,
 	    int daemonise, int oneshot,
 	    int dosyslog, char *pidfile, int increments,
-	    int share)
+	    int alert_window, int share)
 {
 	/*
 	 * Every few seconds, scan every md device looking for changes
@@ -144,7 +151,7 @@ int Monitor(struct mddev_dev *devlist,
 
 	mailfrom = conf_get_mailfrom();
 
-	if (c->scan && !mailaddr && !alert_cmd && !dosyslog) {
+	if (c->scan && !mailaddr && !alert_cmd && !dosyslog && !c->json) {
 		pr_err("No mail address or alert command - not monitoring.\n");
 		return 1;
 	}
@@ -161,6 +168,9 @@ int Monitor(struct mddev_dev *devlist,
 	info.mailaddr = mailaddr;
 	info.mailfrom = mailfrom;
 	info.dosyslog = dosyslog;
+	info.json = c->json;
+	info.window = alert_window;
+	info.helper_fd = -1;
 
 	if (share){
 		if (check_one_sharer(c->scan))
@@ -304,6 +314,7 @@ int Monitor(struct mddev_dev *devlist,
 		statelist = st2->next;
 		free(st2);
 	}
+	alert_helper_stop(&info);
 
 	if (pidfile)
 		unlink(pidfile);
@@ -407,79 +418,311 @@ static void write_autorebuild_pid()
 	}
 }
 
-static void alert(char *event, char *dev, char *disc, struct alert_info *info)
+/*
+ * Alerts go out in three ways.  Syslog and --json output are written
+ * straight away.  Running the alert program and sending mail is left to
+ * a helper process, so a burst of events does not stall monitoring.
+ * The helper collects an array's events until no more have arrived for
+ * ALERT_SETTLE_MSEC, or for --alert-window seconds after the first, and
+ * then handles them together: one mail per array, and no RebuildNN that
+ * a later Rebuild event has made out of date.
+ */
+#define ALERT_SETTLE_MSEC 200
+
+struct alert_event {
+	char event[32];
+	char dev[MD_NAME_MAX + sizeof("/dev/md/")];
+	char disc[256];
+	int has_disc;
+};
+
+struct alert_batch {
+	struct alert_event *events;
+	int cnt, size;
+	unsigned long long due;
+	struct alert_batch *next;
+};
+
+static unsigned long long alert_now(void)
 {
-	int priority;
+	struct timespec ts;
 
-	if (!info->alert_cmd && !info->mailaddr && !info->dosyslog) {
-		time_t now = time(0);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
 
-		printf("%1.15s: %s on %s %s\n", ctime(&now) + 4,
-		       event, dev, disc?disc:"unknown device");
+static int is_mail_event(char *event)
+{
+	return strncmp(event, "Fail", 4) == 0 ||
+		strncmp(event, "Test", 4) == 0 ||
+		strncmp(event, "Spares", 6) == 0 ||
+		strncmp(event, "Degrade", 7) == 0;
+}
+
+static void run_alert_cmd(struct alert_info *info, struct alert_event *ev)
+{
+	int pid = fork();
+
+	switch(pid) {
+	default:
+		waitpid(pid, NULL, 0);
+		break;
+	case -1:
+		break;
+	case 0:
+		execl(info->alert_cmd, info->alert_cmd, ev->event, ev->dev,
+		      ev->has_disc ? ev->disc : NULL, NULL);
+		exit(2);
+	}
+}
+
+/* Send one mail for the mail-worthy events among @ev, all on one array */
+static void send_alert_mail(struct alert_info *info, struct alert_event *ev,
+			    int cnt)
+{
+	struct alert_event *first = NULL;
+	int i, n = 0;
+	FILE *mp, *mdstat;
+	char hname[256];
+
+	for (i = 0; i < cnt; i++)
+		if (is_mail_event(ev[i].event)) {
+			if (!first)
+				first = &ev[i];
+			n++;
+		}
+	if (!first)
+		return;
+
+	mp = popen(Sendmail, "w");
+	if (!mp)
+		return;
+
+	gethostname(hname, sizeof(hname));
+	signal_s(SIGPIPE, SIG_IGN);
+
+	if (info->mailfrom)
+		fprintf(mp, "From: %s\n", info->mailfrom);
+	else
+		fprintf(mp, "From: %s monitoring <root>\n", Name);
+	fprintf(mp, "To: %s\n", info->mailaddr);
+	if (n > 1)
+		fprintf(mp, "Subject: %s event on %s:%s (and %d more)\n\n",
+			first->event, first->dev, hname, n - 1);
+	else
+		fprintf(mp, "Subject: %s event on %s:%s\n\n",
+			first->event, first->dev, hname);
+
+	fprintf(mp,
+		"This is an automatically generated mail message from %s\n", Name);
+	fprintf(mp, "running on %s\n\n", hname);
+
+	for (i = 0; i < cnt; i++) {
+		char *disc = ev[i].has_disc ? ev[i].disc : NULL;
+
+		if (!is_mail_event(ev[i].event))
+			continue;
+		fprintf(mp,
+			"A %s event had been detected on md device %s.\n\n",
+			ev[i].event, ev[i].dev);
+
+		if (disc && disc[0] != ' ')
+			fprintf(mp,
+				"It could be related to component device %s.\n\n", disc);
+		if (disc && disc[0] == ' ')
+			fprintf(mp, "Extra information:%s.\n\n", disc);
 	}
-	if (info->alert_cmd) {
-		int pid = fork();
-		switch(pid) {
-		default:
-			waitpid(pid, NULL, 0);
+
+	fprintf(mp, "Faithfully yours, etc.\n");
+
+	mdstat = fopen("/proc/mdstat", "r");
+	if (mdstat) {
+		char buf[8192];
+		int n;
+		fprintf(mp,
+			"\nP.S. The /proc/mdstat file currently contains the following:\n\n");
+		while ((n = fread(buf, 1, sizeof(buf), mdstat)) > 0)
+			n = fwrite(buf, 1, n, mp);
+		fclose(mdstat);
+	}
+	pclose(mp);
+}
+
+/* Handle the events collected for one array */
+static void deliver_alerts(struct alert_info *info, struct alert_event *ev,
+			   int cnt)
+{
+	int i, j;
+
+	if (info->alert_cmd)
+		for (i = 0; i < cnt; i++) {
+			/* progress that was overtaken is not worth a fork */
+			if (strncmp(ev[i].event, "Rebuild", 7) == 0 &&
+			    isdigit(ev[i].event[7])) {
+				for (j = i + 1; j < cnt; j++)
+					if (strncmp(ev[j].event, "Rebuild", 7) == 0)
+						break;
+				if (j < cnt)
+					continue;
+			}
+			run_alert_cmd(info, &ev[i]);
+		}
+	if (info->mailaddr)
+		send_alert_mail(info, ev, cnt);
+}
+
+static void alert_queue(struct alert_batch **batches, struct alert_event *ev,
+			int window)
+{
+	unsigned long long now = alert_now();
+	struct alert_batch *b;
+
+	for (b = *batches; b; b = b->next)
+		if (strcmp(b->events[0].dev, ev->dev) == 0)
 			break;
-		case -1:
+	if (!b) {
+		b = xcalloc(1, sizeof(*b));
+		b->due = now + window * 1000ULL;
+		b->next = *batches;
+		*batches = b;
+	}
+	if (b->cnt == b->size) {
+		b->size = b->size ? b->size * 2 : 8;
+		b->events = xrealloc(b->events, b->size * sizeof(*ev));
+	}
+	b->events[b->cnt++] = *ev;
+	if (!window)
+		b->due = now + ALERT_SETTLE_MSEC;
+}
+
+/* Deliver the batches that are due, or all of them.  Returns the msec
+ * until the next one is due, or -1.
+ */
+static int alert_deliver_due(struct alert_info *info,
+			     struct alert_batch **batches, int all)
+{
+	unsigned long long now = alert_now();
+	struct alert_batch **bp = batches;
+	int wait = -1;
+
+	while (*bp) {
+		struct alert_batch *b = *bp;
+
+		if (all || b->due <= now) {
+			*bp = b->next;
+			deliver_alerts(info, b->events, b->cnt);
+			free(b->events);
+			free(b);
+			continue;
+		}
+		if (wait < 0 || b->due - now < (unsigned long long)wait)
+			wait = b->due - now;
+		bp = &b->next;
+	}
+	return wait;
+}
+
+static void alert_helper(struct alert_info *info, int fd)
+{
+	struct alert_batch *batches = NULL;
+	int timeout = -1;
+
+	while (1) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		struct alert_event ev;
+		int n = poll(&pfd, 1, timeout);
+
+		if (n < 0 && errno != EINTR)
 			break;
-		case 0:
-			execl(info->alert_cmd, info->alert_cmd,
-			      event, dev, disc, NULL);
-			exit(2);
+		if (n > 0) {
+			n = read(fd, &ev, sizeof(ev));
+			if (n == 0 || (n < 0 && errno != EINTR))
+				break;
+			if (n == sizeof(ev))
+				alert_queue(&batches, &ev, info->window);
 		}
+		timeout = alert_deliver_due(info, &batches, 0);
 	}
-	if (info->mailaddr && (strncmp(event, "Fail", 4) == 0 ||
-			       strncmp(event, "Test", 4) == 0 ||
-			       strncmp(event, "Spares", 6) == 0 ||
-			       strncmp(event, "Degrade", 7) == 0)) {
-		FILE *mp = popen(Sendmail, "w");
-		if (mp) {
-			FILE *mdstat;
-			char hname[256];
-
-			gethostname(hname, sizeof(hname));
-			signal_s(SIGPIPE, SIG_IGN);
-
-			if (info->mailfrom)
-				fprintf(mp, "From: %s\n", info->mailfrom);
-			else
-				fprintf(mp, "From: %s monitoring <root>\n",
-					Name);
-			fprintf(mp, "To: %s\n", info->mailaddr);
-			fprintf(mp, "Subject: %s event on %s:%s\n\n",
-				event, dev, hname);
+	alert_deliver_due(info, &batches, 1);
+}
 
-			fprintf(mp,
-				"This is an automatically generated mail message from %s\n", Name);
-			fprintf(mp, "running on %s\n\n", hname);
+static void alert_helper_start(struct alert_info *info)
+{
+	int pfd[2];
+
+	if (pipe(pfd) < 0)
+		return;
+	fflush(stdout);
+	info->helper = fork();
+	if (info->helper < 0) {
+		close(pfd[0]);
+		close(pfd[1]);
+		return;
+	}
+	if (info->helper == 0) {
+		close(pfd[1]);
+		alert_helper(info, pfd[0]);
+		exit(0);
+	}
+	close(pfd[0]);
+	fcntl(pfd[1], F_SETFD, FD_CLOEXEC);
+	signal_s(SIGPIPE, SIG_IGN);
+	info->helper_fd = pfd[1];
+}
 
-			fprintf(mp,
-				"A %s event had been detected on md device %s.\n\n", event, dev);
-
-			if (disc && disc[0] != ' ')
-				fprintf(mp,
-					"It could be related to component device %s.\n\n", disc);
-			if (disc && disc[0] == ' ')
-				fprintf(mp, "Extra information:%s.\n\n", disc);
-
-			fprintf(mp, "Faithfully yours, etc.\n");
-
-			mdstat = fopen("/proc/mdstat", "r");
-			if (mdstat) {
-				char buf[8192];
-				int n;
-				fprintf(mp,
-					"\nP.S. The /proc/mdstat file currently contains the following:\n\n");
-				while ((n = fread(buf, 1, sizeof(buf),
-						  mdstat)) > 0)
-					n = fwrite(buf, 1, n, mp);
-				fclose(mdstat);
-			}
-			pclose(mp);
+/* Let the helper deliver what it still holds, and wait for it */
+static void alert_helper_stop(struct alert_info *info)
+{
+	if (info->helper_fd < 0)
+		return;
+	close(info->helper_fd);
+	info->helper_fd = -1;
+	waitpid(info->helper, NULL, 0);
+}
+
+static void alert_json(char *event, char *dev, char *disc)
+{
+	printf("{\"time\": %ld, \"event\": ", (long)time(0));
+	json_print_string(event, strlen(event));
+	printf(", \"device\": ");
+	json_print_string(dev, strlen(dev));
+	if (disc && disc[0] == ' ') {
+		printf(", \"info\": ");
+		json_print_string(disc + 1, strlen(disc + 1));
+	} else if (disc) {
+		printf(", \"component\": ");
+		json_print_string(disc, strlen(disc));
+	}
+	printf("}\n");
+	fflush(stdout);
+}
+
+static void alert(char *event, char *dev, char *disc, struct alert_info *info)
+{
+	int priority;
+
+	if (info->json)
+		alert_json(event, dev, disc);
+	else if (!info->alert_cmd && !info->mailaddr && !info->dosyslog) {
+		time_t now = time(0);
+
+		printf("%1.15s: %s on %s %s\n", ctime(&now) + 4,
+		       event, dev, disc?disc:"unknown device");
+	}
+	if (info->alert_cmd || info->mailaddr) {
+		struct alert_event ev = {};
+
+		snprintf(ev.event, sizeof(ev.event), "%s", event);
+		snprintf(ev.dev, sizeof(ev.dev), "%s", dev);
+		if (disc) {
+			snprintf(ev.disc, sizeof(ev.disc), "%s", disc);
+			ev.has_disc = 1;
 		}
+		if (info->helper_fd < 0)
+			alert_helper_start(info);
+		if (info->helper_fd < 0 ||
+		    write(info->helper_fd, &ev, sizeof(ev)) != sizeof(ev))
+			deliver_alerts(info, &ev, 1);
 	}
 
 	/* log the event to syslog maybe */
@@ -857,46 +1100,6 @@ static int check_donor(struct state *from, struct state *to)
 	return 1;
 }
 
-static dev_t choose_spare(struct state *from, struct state *to,
-			  struct domainlist *domlist, struct spare_criteria *sc)
-{
-	int d;
-	dev_t dev = 0;
-
-	for (d = from->raid; !dev && d < MAX_DISKS; d++) {
-		if (from->devid[d] > 0 && from->devstate[d] == 0) {
-			struct dev_policy *pol;
-			unsigned long long dev_size;
-			unsigned int dev_sector_size;
-
-			if (to->metadata->ss->external &&
-			    test_partition_from_id(from->devid[d]))
-				continue;
-
-			if (sc->min_size &&
-			    dev_size_from_id(from->devid[d], &dev_size) &&
-			    dev_size < sc->min_size)
-				continue;
-
-			if (sc->sector_size &&
-			    dev_sector_size_from_id(from->devid[d],
-						    &dev_sector_size) &&
-			    sc->sector_size != dev_sector_size)
-				continue;
-
-			pol = devid_policy(from->devid[d]);
-			if (from->spare_group)
-				pol_add(&pol, pol_domain,
-					from->spare_group, NULL);
-			if (domain_test(domlist, pol,
-					to->metadata->ss->name) == 1)
-			    dev = from->devid[d];
-			dev_policy_free(pol);
-		}
-	}
-	return dev;
-}
-
 static dev_t container_choose_spare(struct state *from, struct state *to,
 				    struct domainlist *domlist,
 				    struct spare_criteria *sc, int active)
@@ -962,16 +1165,214 @@ static dev_t container_choose_spare(struct state *from, struct state *to,
 	return dev;
 }
 
-static void try_spare_migration(struct state *statelist, struct alert_info *info)
+/*
+ * Spares that could be moved, gathered once per try_spare_migration().
+ * Size and policy of each are looked up once, rather than for every
+ * degraded array, and a container donor's metadata is loaded once.
+ * A donor's spare-group is added to its spares' policy as a domain, so
+ * a spare can only suit an array whose domain list names that group:
+ * spares are kept in one bucket per group (donors without a group in
+ * the one with a NULL name) and only the buckets an array's domain list
+ * names are searched.
+ */
+struct spare_cand {
+	struct state *from;
+	int order;		/* of @from in the statelist */
+	dev_t devid;
+	int size_known, sector_size_known;
+	unsigned long long size;
+	unsigned int sector_size;
+	int partition;
+	struct dev_policy *pol;
+	int used;
+	struct spare_cand *next;
+};
+
+struct spare_bucket {
+	const char *group;
+	struct spare_cand *cands, **tail;
+	struct spare_bucket *next;
+};
+
+static struct spare_bucket *spare_bucket(struct spare_bucket **index,
+					 const char *group, int create)
+{
+	struct spare_bucket *b;
+
+	for (b = *index; b; b = b->next)
+		if (group ? b->group && strcmp(b->group, group) == 0 :
+		    !b->group)
+			return b;
+	if (!create)
+		return NULL;
+	b = xcalloc(1, sizeof(*b));
+	b->group = group;
+	b->tail = &b->cands;
+	b->next = *index;
+	*index = b;
+	return b;
+}
+
+static void spare_index_add(struct spare_bucket **index, struct state *from,
+			    int order, dev_t devid)
+{
+	struct spare_bucket *b = spare_bucket(index, from->spare_group, 1);
+	struct spare_cand *c = xcalloc(1, sizeof(*c));
+
+	c->from = from;
+	c->order = order;
+	c->devid = devid;
+	c->size_known = dev_size_from_id(devid, &c->size);
+	c->sector_size_known = dev_sector_size_from_id(devid,
+						       &c->sector_size);
+	c->partition = test_partition_from_id(devid);
+	c->pol = devid_policy(devid);
+	if (from->spare_group)
+		pol_add(&c->pol, pol_domain, from->spare_group, NULL);
+	*b->tail = c;
+	b->tail = &c->next;
+}
+
+/* spares of a container, as container_choose_spares() sees them */
+static void spare_index_add_container(struct spare_bucket **index,
+				      struct state *from, int order)
 {
+	struct supertype *st = from->metadata;
+	struct mdinfo *list, *d;
+	int fd;
+
+	if (!st->ss->getinfo_super_disks)
+		return;
+	fd = open(from->devname, O_RDONLY);
+	if (fd < 0)
+		return;
+	if (st->ss->load_container(st, fd, NULL)) {
+		close(fd);
+		return;
+	}
+	close(fd);
+	list = st->ss->getinfo_super_disks(st);
+	for (d = list ? list->devs : NULL; d; d = d->next)
+		if (d->disk.state == 0)
+			spare_index_add(index, from, order,
+					makedev(d->disk.major, d->disk.minor));
+	sysfs_free(list);
+	st->ss->free_super(st);
+}
+
+static struct spare_bucket *spare_index_build(struct state *statelist)
+{
+	struct spare_bucket *index = NULL;
 	struct state *from;
+	int order = 0;
+
+	for (from = statelist; from; from = from->next, order++) {
+		int d;
+
+		if (!check_donor(from, NULL))
+			continue;
+		if (from->metadata->ss->external) {
+			spare_index_add_container(&index, from, order);
+			continue;
+		}
+		for (d = from->raid; d < MAX_DISKS; d++)
+			if (from->devid[d] > 0 && from->devstate[d] == 0)
+				spare_index_add(&index, from, order,
+						from->devid[d]);
+	}
+	return index;
+}
+
+static void spare_index_free(struct spare_bucket *index)
+{
+	while (index) {
+		struct spare_bucket *b = index;
+
+		index = b->next;
+		while (b->cands) {
+			struct spare_cand *c = b->cands;
+
+			b->cands = c->next;
+			dev_policy_free(c->pol);
+			free(c);
+		}
+		free(b);
+	}
+}
+
+static int spare_suits(struct spare_cand *c, struct state *to,
+		       struct domainlist *domlist, struct spare_criteria *sc)
+{
+	if (c->used || c->from == to)
+		return 0;
+	if (c->from->metadata->ss->external) {
+		/* as container_choose_spares() */
+		if (sc->min_size &&
+		    (!c->size_known || c->size < sc->min_size))
+			return 0;
+		if (sc->sector_size && (!c->sector_size_known ||
+					c->sector_size != sc->sector_size))
+			return 0;
+	} else {
+		/* as choose_spare() */
+		if (to->metadata->ss->external && c->partition)
+			return 0;
+		if (sc->min_size && c->size_known && c->size < sc->min_size)
+			return 0;
+		if (sc->sector_size && c->sector_size_known &&
+		    c->sector_size != sc->sector_size)
+			return 0;
+	}
+	return domain_test(domlist, c->pol, to->metadata->ss->name) == 1;
+}
+
+/* First suitable spare in @b, unless @found comes earlier in statelist */
+static struct spare_cand *spare_bucket_find(struct spare_bucket *b,
+					    struct state *to,
+					    struct domainlist *domlist,
+					    struct spare_criteria *sc,
+					    struct spare_cand *found)
+{
+	struct spare_cand *c;
+
+	for (c = b ? b->cands : NULL; c; c = c->next) {
+		if (found && found->order <= c->order)
+			break;
+		if (spare_suits(c, to, domlist, sc))
+			return c;
+	}
+	return found;
+}
+
+/* The spare a walk through statelist would have found first, or NULL */
+static struct spare_cand *spare_index_find(struct spare_bucket *index,
+					   struct state *to,
+					   struct domainlist *domlist,
+					   struct spare_criteria *sc)
+{
+	struct spare_cand *found;
+	struct domainlist *dl;
+
+	found = spare_bucket_find(spare_bucket(&index, NULL, 0),
+				  to, domlist, sc, NULL);
+	for (dl = domlist; dl; dl = dl->next)
+		found = spare_bucket_find(spare_bucket(&index, dl->dom, 0),
+					  to, domlist, sc, found);
+	return found;
+}
+
+static void try_spare_migration(struct state *statelist, struct alert_info *info)
+{
 	struct state *st;
 	struct spare_criteria sc;
+	struct spare_bucket *index = NULL;
+	int indexed = 0;
 
 	link_containers_with_subarrays(statelist);
 	for (st = statelist; st; st = st->next)
 		if (st->active < st->raid && st->spare == 0 && !st->err) {
 			struct domainlist *domlist = NULL;
+			struct spare_cand *c;
 			int d;
 			struct state *to = st;
 
@@ -1008,26 +1409,23 @@ static void try_spare_migration(struct state *statelist, struct alert_info *info
 			 */
 			if (!domlist)
 				continue;
-			for (from=statelist ; from ; from=from->next) {
-				dev_t devid;
-				if (!check_donor(from, to))
-					continue;
-				if (from->metadata->ss->external)
-					devid = container_choose_spare(
-						from, to, domlist, &sc, 0);
-				else
-					devid = choose_spare(from, to, domlist,
-							     &sc);
-				if (devid > 0 &&
-				    move_spare(from->devname, to->devname,
-					       devid)) {
+			if (!indexed) {
+				index = spare_index_build(statelist);
+				indexed = 1;
+			}
+			while ((c = spare_index_find(index, to, domlist,
+						     &sc)) != NULL) {
+				c->used = 1;
+				if (move_spare(c->from->devname, to->devname,
+					       c->devid)) {
 					alert("MoveSpare", to->devname,
-					      from->devname, info);
+					      c->from->devname, info);
 					break;
 				}
 			}
 			domain_free(domlist);
 		}
+	spare_index_free(index);
 }
 
 /* search the statelist to connect external
@@ -1115,70 +1513,203 @@ out:
 #endif
 
 /* Not really Monitor but ... */
-int Wait(char *dev)
-{
+
+/* How long a frozen sync_action is taken for a pause before a sync */
+#define WAIT_FROZEN_MSEC 15000
+
+struct wait_array {
 	char devnm[32];
-	dev_t rdev;
-	char *tmp;
-	int rv = 1;
-	int frozen_remaining = 3;
+	int state_fd;		/* array_state */
+	int action_fd;		/* sync_action, if the array can resync */
+	unsigned long long frozen_until;	/* msec, 0 if not frozen */
+	int busy;		/* 0 - idle, 1 - busy, 2 - frozen */
+	int done;
+	int rv;
+};
+
+static unsigned long long wait_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static int wait_array_busy(struct wait_array *w)
+{
+	/* Is a resync, recovery or reshape running or pending?
+	 * Reading the attributes re-arms them for POLLPRI.
+	 * A frozen sync_action counts as busy for WAIT_FROZEN_MSEC only,
+	 * it may be the brief pause before something starts.
+	 */
+	char state[20], action[20], start[30] = "none\n";
+	unsigned long long now;
+	int fd;
 
-	if (!stat_is_blkdev(dev, &rdev))
-		return 2;
+	if (w->state_fd < 0 ||
+	    sysfs_fd_get_str(w->state_fd, state, sizeof(state)) <= 0)
+		return 0;
+	if (strncmp(state, "clear", 5) == 0 ||
+	    strncmp(state, "inactive", 8) == 0)
+		return 0;
+	if (w->action_fd < 0 ||
+	    sysfs_fd_get_str(w->action_fd, action, sizeof(action)) <= 0)
+		return 0;
 
-	tmp = devid2devnm(rdev);
-	if (!tmp) {
-		pr_err("Cannot get md device name.\n");
-		return 2;
+	fd = sysfs_open(w->devnm, NULL, "resync_start");
+	if (fd >= 0) {
+		sysfs_fd_get_str(fd, start, sizeof(start));
+		close(fd);
 	}
+	if (strcmp(start, "none\n") == 0 && strcmp(action, "frozen\n") == 0) {
+		now = wait_now();
+		if (!w->frozen_until)
+			w->frozen_until = now + WAIT_FROZEN_MSEC;
+		return now < w->frozen_until ? 2 : 0;
+	}
+	w->frozen_until = 0;
+	return strcmp(start, "none\n") != 0 || strcmp(action, "idle\n") != 0;
+}
 
-	strcpy(devnm, tmp);
+static void wait_array_finish(struct wait_array *w)
+{
+	char vers[64];
+	int fd;
 
-	while(1) {
-		struct mdstat_ent *ms = mdstat_read(1, 0);
-		struct mdstat_ent *e;
+	fd = sysfs_open(w->devnm, NULL, "metadata_version");
+	if (fd >= 0 && sysfs_fd_get_str(fd, vers, sizeof(vers)) > 0 &&
+	    strncmp(vers, "external:", 9) == 0) {
+		vers[strcspn(vers, "\n")] = 0;
+		if (is_subarray(&vers[9]))
+			ping_monitor(&vers[9]);
+		else
+			ping_monitor(w->devnm);
+	}
+	if (fd >= 0)
+		close(fd);
+	if (w->state_fd >= 0)
+		close(w->state_fd);
+	if (w->action_fd >= 0)
+		close(w->action_fd);
+	w->done = 1;
+}
 
-		for (e = ms; e; e = e->next)
-			if (strcmp(e->devnm, devnm) == 0)
-				break;
+/**
+ * Wait_devices() - Wait for resync, recovery and reshape to finish.
+ * @devs: Arrays to wait for.
+ * @cnt: Number of @devs.
+ *
+ * Rather than re-reading /proc/mdstat, block on POLLPRI of each array's
+ * array_state and sync_action, which the kernel notifies when a sync
+ * starts or stops, and only look again at the arrays that were woken,
+ * or whose sync_action has been frozen for longer than WAIT_FROZEN_MSEC.
+ *
+ * Return: OR of, for each array, 0 if there was something to wait for,
+ * 1 if there was not, 2 on error.
+ */
+int Wait_devices(char **devs, int cnt)
+{
+	struct wait_array *arrays = xcalloc(cnt, sizeof(*arrays));
+	struct pollfd *pfds = xcalloc(2 * cnt, sizeof(*pfds));
+	int *owner = xcalloc(2 * cnt, sizeof(*owner));
+	int rv = 0;
+	int i, j, n;
+
+	for (i = 0; i < cnt; i++) {
+		struct wait_array *w = &arrays[i];
+		dev_t rdev;
+		char *tmp;
+
+		w->state_fd = w->action_fd = -1;
+		w->rv = 1;
+		if (!stat_is_blkdev(devs[i], &rdev)) {
+			w->rv = 2;
+			w->done = 1;
+			continue;
+		}
+		tmp = devid2devnm(rdev);
+		if (!tmp) {
+			pr_err("Cannot get md device name.\n");
+			w->rv = 2;
+			w->done = 1;
+			continue;
+		}
+		snprintf(w->devnm, sizeof(w->devnm), "%s", tmp);
+		w->state_fd = sysfs_open(w->devnm, NULL, "array_state");
+		w->action_fd = sysfs_open(w->devnm, NULL, "sync_action");
+		w->busy = wait_array_busy(w);
+	}
 
-		if (e && e->percent == RESYNC_NONE) {
-			/* We could be in the brief pause before something
-			 * starts. /proc/mdstat doesn't show that, but
-			 * sync_action does.
-			 */
-			struct mdinfo mdi;
-			char buf[21];
-
-			if (sysfs_init(&mdi, -1, devnm))
-				return 2;
-			if (sysfs_get_str(&mdi, NULL, "sync_action",
-					  buf, 20) > 0 &&
-			    strcmp(buf,"idle\n") != 0) {
-				e->percent = RESYNC_UNKNOWN;
-				if (strcmp(buf, "frozen\n") == 0) {
-					if (frozen_remaining == 0)
-						e->percent = RESYNC_NONE;
-					else
-						frozen_remaining -= 1;
-				}
+	while (1) {
+		unsigned long long now = wait_now();
+		int timeout = -1;
+
+		for (i = 0, n = 0; i < cnt; i++) {
+			struct wait_array *w = &arrays[i];
+
+			if (w->done)
+				continue;
+			if (!w->busy) {
+				wait_array_finish(w);
+				continue;
 			}
-		}
-		if (!e || e->percent == RESYNC_NONE) {
-			if (e && e->metadata_version &&
-			    strncmp(e->metadata_version, "external:", 9) == 0) {
-				if (is_subarray(&e->metadata_version[9]))
-					ping_monitor(&e->metadata_version[9]);
-				else
-					ping_monitor(devnm);
+			w->rv = 0;
+			if (w->busy == 2) {
+				int left = w->frozen_until > now ?
+					w->frozen_until - now : 0;
+
+				if (timeout < 0 || left < timeout)
+					timeout = left;
+			}
+			pfds[n].fd = w->state_fd;
+			pfds[n].events = POLLPRI;
+			owner[n++] = i;
+			if (w->action_fd >= 0) {
+				pfds[n].fd = w->action_fd;
+				pfds[n].events = POLLPRI;
+				owner[n++] = i;
 			}
-			free_mdstat(ms);
-			return rv;
 		}
-		free_mdstat(ms);
-		rv = 0;
-		mdstat_wait(5);
+		if (!n)
+			break;
+		j = poll(pfds, n, timeout);
+		if (j < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		/* Look at each woken array once, and at the frozen ones
+		 * that ran out of time, whatever woke the others.
+		 */
+		now = wait_now();
+		for (i = 0; i < n; i++) {
+			struct wait_array *w = &arrays[owner[i]];
+
+			if (w->busy < 0)
+				continue;
+			if (pfds[i].revents ||
+			    (w->busy == 2 && now >= w->frozen_until))
+				w->busy = -1;
+		}
+		for (i = 0; i < cnt; i++)
+			if (arrays[i].busy < 0)
+				arrays[i].busy = wait_array_busy(&arrays[i]);
+	}
+
+	for (i = 0; i < cnt; i++) {
+		if (!arrays[i].done)
+			wait_array_finish(&arrays[i]);
+		rv |= arrays[i].rv;
 	}
+	free(owner);
+	free(pfds);
+	free(arrays);
+	return rv;
+}
+
+int Wait(char *dev)
+{
+	return Wait_devices(&dev, 1);
 }
 
 /* The state "broken" is used only for RAID0/LINEAR - it's the same as
@@ -1187,28 +1718,63 @@ int Wait(char *dev)
 static char *clean_states[] = {
 	"clear", "inactive", "readonly", "read-auto", "clean", "broken", NULL };
 
-int WaitClean(char *dev, int verbose)
-{
+struct wait_clean {
+	char *dev;
 	int fd;
 	struct mdinfo *mdi;
-	int rv = 1;
+	int state_fd;
+	int waiting;
+	int rv;
+};
+
+static void wait_clean_finish(struct wait_clean *w, int verbose)
+{
+	if (w->rv == 0) {
+		if (ping_monitor(w->mdi->text_version) != 0) {
+			/* we need to ping to close the window between array
+			 * state transitioning to clean and the metadata being
+			 * marked clean
+			 */
+			w->rv = 1;
+			pr_err("Error connecting monitor with %s\n", w->dev);
+		}
+	}
+	if (w->rv && verbose)
+		pr_err("Error waiting for %s to be clean\n", w->dev);
+
+	/* restore the original safe_mode_delay */
+	sysfs_set_safemode(w->mdi, w->mdi->safe_mode_delay);
+	close(w->state_fd);
+	w->waiting = 0;
+}
+
+static int wait_clean_start(struct wait_clean *w, int verbose)
+{
+	/* Returns 1 if @w needs to be waited for */
+	struct mdinfo *mdi;
 	char devnm[32];
+	int rv = 1;
 
-	if (!stat_is_blkdev(dev, NULL))
-		return 2;
-	fd = open(dev, O_RDONLY);
-	if (fd < 0) {
+	w->fd = -1;
+	w->rv = 2;
+	if (!stat_is_blkdev(w->dev, NULL))
+		return 0;
+	w->fd = open(w->dev, O_RDONLY);
+	if (w->fd < 0) {
 		if (verbose)
-			pr_err("Couldn't open %s: %s\n", dev, strerror(errno));
-		return 1;
+			pr_err("Couldn't open %s: %s\n", w->dev, strerror(errno));
+		w->rv = 1;
+		return 0;
 	}
 
-	strcpy(devnm, fd2devnm(fd));
-	mdi = sysfs_read(fd, devnm, GET_VERSION|GET_LEVEL|GET_SAFEMODE);
+	strcpy(devnm, fd2devnm(w->fd));
+	mdi = sysfs_read(w->fd, devnm, GET_VERSION|GET_LEVEL|GET_SAFEMODE);
+	w->mdi = mdi;
+	w->rv = 0;
 	if (!mdi) {
 		if (verbose)
-			pr_err("Failed to read sysfs attributes for %s\n", dev);
-		close(fd);
+			pr_err("Failed to read sysfs attributes for %s\n",
+			       w->dev);
 		return 0;
 	}
 
@@ -1230,51 +1796,99 @@ int WaitClean(char *dev, int verbose)
 	if (mdi->safe_mode_delay == 0)
 		rv = 0;
 
-	if (rv) {
-		int state_fd = sysfs_open(fd2devnm(fd), NULL, "array_state");
-		char buf[20];
-		int delay = 5000;
+	if (!rv)
+		return 0;
 
-		/* minimize the safe_mode_delay and prepare to wait up to 5s
-		 * for writes to quiesce
-		 */
-		sysfs_set_safemode(mdi, 1);
+	w->state_fd = sysfs_open(devnm, NULL, "array_state");
+	/* minimize the safe_mode_delay so writes quiesce quickly */
+	sysfs_set_safemode(mdi, 1);
+	w->waiting = 1;
+	return 1;
+}
 
-		/* wait for array_state to be clean */
-		while (1) {
-			rv = read(state_fd, buf, sizeof(buf));
-			if (rv < 0)
-				break;
-			if (sysfs_match_word(buf, clean_states) <
-			    (int)ARRAY_SIZE(clean_states) - 1)
-				break;
-			rv = sysfs_wait(state_fd, &delay);
-			if (rv < 0 && errno != EINTR)
-				break;
-			lseek(state_fd, 0, SEEK_SET);
+/**
+ * WaitClean_devices() - Wait for arrays with external metadata to be clean.
+ * @devs: Arrays to wait for.
+ * @cnt: Number of @devs.
+ * @verbose: Verbosity.
+ *
+ * All arrays are waited for at once, blocking on POLLPRI of their
+ * array_state, and only the arrays that were woken are looked at again.
+ *
+ * Return: OR of the results for each array, 0 for clean.
+ */
+int WaitClean_devices(char **devs, int cnt, int verbose)
+{
+	struct wait_clean *arrays = xcalloc(cnt, sizeof(*arrays));
+	struct pollfd *pfds = xcalloc(cnt, sizeof(*pfds));
+	int *owner = xcalloc(cnt, sizeof(*owner));
+	int rv = 0;
+	int i, j, n;
+
+	for (i = 0; i < cnt; i++) {
+		arrays[i].dev = devs[i];
+		arrays[i].waiting = wait_clean_start(&arrays[i], verbose);
+	}
+
+	/* wait for array_state to be clean */
+	for (i = 0; i < cnt; i++)
+		owner[i] = i;
+	n = cnt;
+	while (n) {
+		int m = 0;
+
+		for (i = 0; i < n; i++) {
+			struct wait_clean *w = &arrays[owner[i]];
+			char buf[20];
+
+			if (!w->waiting)
+				continue;
+			if (sysfs_fd_get_str(w->state_fd, buf, sizeof(buf)) < 0) {
+				w->rv = 1;
+				wait_clean_finish(w, verbose);
+			} else if (sysfs_match_word(buf, clean_states) <
+				   (int)ARRAY_SIZE(clean_states) - 1)
+				wait_clean_finish(w, verbose);
 		}
-		if (rv < 0)
-			rv = 1;
-		else if (ping_monitor(mdi->text_version) == 0) {
-			/* we need to ping to close the window between array
-			 * state transitioning to clean and the metadata being
-			 * marked clean
-			 */
-			rv = 0;
-		} else {
-			rv = 1;
-			pr_err("Error connecting monitor with %s\n", dev);
+		for (i = 0; i < cnt; i++) {
+			if (!arrays[i].waiting)
+				continue;
+			pfds[m].fd = arrays[i].state_fd;
+			pfds[m].events = POLLPRI;
+			pfds[m].revents = 0;
+			owner[m++] = i;
 		}
-		if (rv && verbose)
-			pr_err("Error waiting for %s to be clean\n", dev);
-
-		/* restore the original safe_mode_delay */
-		sysfs_set_safemode(mdi, mdi->safe_mode_delay);
-		close(state_fd);
+		if (!m)
+			break;
+		j = poll(pfds, m, -1);
+		if (j < 0 && errno != EINTR) {
+			for (i = 0; i < m; i++) {
+				arrays[owner[i]].rv = 1;
+				wait_clean_finish(&arrays[owner[i]], verbose);
+			}
+			break;
+		}
+		/* only look again at the woken arrays, or at all of them
+		 * if poll() was interrupted and reported none
+		 */
+		for (i = 0, n = 0; i < m; i++)
+			if (j < 0 || pfds[i].revents)
+				owner[n++] = owner[i];
 	}
 
-	sysfs_free(mdi);
-	close(fd);
-
+	for (i = 0; i < cnt; i++) {
+		sysfs_free(arrays[i].mdi);
+		if (arrays[i].fd >= 0)
+			close(arrays[i].fd);
+		rv |= arrays[i].rv;
+	}
+	free(owner);
+	free(pfds);
+	free(arrays);
 	return rv;
 }
+
+int WaitClean(char *dev, int verbose)
+{
+	return WaitClean_devices(&dev, 1, verbose);
+}
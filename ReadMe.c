@@ -186,6 +186,7 @@ struct option long_options[] = {
     {"brief",	  0, 0, Brief},
     {"no-devices",0, 0, NoDevices},
     {"export",	  0, 0, 'Y'},
+    {"json",	  0, 0, Json},
     {"sparc2.2",  0, 0, Sparc22},
     {"test",      0, 0, 't'},
     {"prefer",    1, 0, Prefer},
@@ -202,6 +203,7 @@ struct option long_options[] = {
     {"pid-file",  1, 0, 'i'},
     {"syslog",    0, 0, 'y'},
     {"no-sharing", 0, 0, NoSharing},
+    {"alert-window", 1, 0, AlertWindow},
 
     /* For Grow */
     {"backup-file", 1,0, BackupFile},
@@ -212,6 +214,7 @@ struct option long_options[] = {
     /* For Incremental */
     {"rebuild-map", 0, 0, RebuildMapOpt},
     {"path", 1, 0, IncrementalPath},
+    {"listen", 0, 0, Listen},
 
     {0, 0, 0, 0}
 };
@@ -270,6 +273,8 @@ char OptionHelp[] =
 "  --brief       -b   : Be less verbose, more brief\n"
 "  --export      -Y   : With --detail, --detail-platform or --examine use\n"
 "                       key=value format for easy import into environment\n"
+"  --json             : With --detail --scan or --examine, scan devices in\n"
+"                       parallel and report them as a JSON document\n"
 "  --force       -f   : Override normal checks and be more forceful\n"
 "\n"
 "  --assemble    -A   : Assemble an array\n"
@@ -553,6 +558,9 @@ char Help_monitor[] =
 "  --pid-file=   -i   : In daemon mode write pid to specified file instead of stdout\n"
 "  --oneshot     -1   : Check for degraded arrays, then exit\n"
 "  --test        -t   : Generate a TestMessage event against each array at startup\n"
+"  --alert-window=     : seconds to collect an array's events for before running\n"
+"                      : the program or sending one mail about all of them\n"
+"  --json              : Write each event to stdout as a line of JSON\n"
 ;
 
 char Help_grow[] =
@@ -610,6 +618,8 @@ char Help_incr[] =
 "                   : required number of devices, but are not yet started.\n"
 "  --fail        -f : First fail (if needed) and then remove device from\n"
 "                   : any array that it is a member of.\n"
+"  --listen         : Keep running, and assemble arrays from devices handed\n"
+"                   : over by other 'mdadm --incremental' commands.\n"
 ;
 
 char Help_config[] =
@@ -0,0 +1,234 @@
+/*
+ * mdadm - manage Linux "md" devices aka RAID arrays.
+ *
+ * Batched I/O to several devices at once.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Metadata is usually written to every member of an array, one device
+ * after another.  When the writes are independent they can all be in
+ * flight at the same time, so the total cost is that of the slowest
+ * device rather than the sum over all of them.
+ *
+ * io_batch() submits a set of requests with the kernel's native AIO
+ * interface and waits for all of them.  The metadata fds are normally
+ * opened O_DIRECT so the requests really do run concurrently.  If AIO
+ * is not available, or a request is refused, it is done synchronously
+ * instead, so callers never need a fallback of their own.
+ *
+ * The AIO context is shared and not locked: only one thread of a
+ * process may use io_batch() (in mdmon that is the monitor thread).
+ */
+
+#include	"mdadm.h"
+#include	<linux/aio_abi.h>
+#include	<sys/syscall.h>
+
+/* Minimum number of requests the AIO context is set up for */
+#define IO_BATCH_MIN 64
+
+static aio_context_t io_ctx;
+static int io_ctx_nr;	/* size of io_ctx, -1 if AIO is unusable */
+
+static int io_batch_setup(int nr)
+{
+	if (io_ctx_nr < 0)
+		return -1;
+	if (io_ctx && io_ctx_nr >= nr)
+		return 0;
+	if (io_ctx) {
+		syscall(__NR_io_destroy, io_ctx);
+		io_ctx = 0;
+		io_ctx_nr = 0;
+	}
+	if (nr < IO_BATCH_MIN)
+		nr = IO_BATCH_MIN;
+	if (syscall(__NR_io_setup, nr, &io_ctx) < 0) {
+		io_ctx = 0;
+		if (errno == ENOSYS)
+			io_ctx_nr = -1;
+		return -1;
+	}
+	io_ctx_nr = nr;
+	return 0;
+}
+
+static void io_req_sync(struct io_req *req)
+{
+	switch (req->op) {
+	case IO_READ:
+		req->ret = pread(req->fd, req->buf, req->len, req->offset);
+		break;
+	case IO_WRITE:
+		req->ret = pwrite(req->fd, req->buf, req->len, req->offset);
+		break;
+	case IO_SYNC:
+		req->ret = fdatasync(req->fd);
+		break;
+	}
+	if (req->ret < 0)
+		req->ret = -errno;
+}
+
+static int io_req_failed(struct io_req *req)
+{
+	if (req->op == IO_SYNC)
+		return req->ret != 0;
+	return req->ret != (ssize_t)req->len;
+}
+
+/**
+ * io_batch() - Run a set of independent I/O requests concurrently.
+ * @reqs: Requests; on return each has its result in @ret.
+ * @nr: Number of requests.
+ *
+ * All requests are submitted before any is waited for, and the call
+ * returns once all have finished, which makes it a single completion
+ * barrier.  Requests must not depend on each other's ordering.  A
+ * %IO_SYNC request flushes its fd; a batch of those, one per device,
+ * makes earlier writes durable on all devices in one round trip.
+ *
+ * Return: number of requests that failed or transferred short.
+ */
+int io_batch(struct io_req *reqs, int nr)
+{
+	struct iocb *iocbs = NULL, **iocbp = NULL;
+	struct io_event *events = NULL;
+	int submitted = 0, done = 0;
+	int failed = 0;
+	int i;
+
+	if (nr <= 0)
+		return 0;
+	for (i = 0; i < nr; i++)
+		reqs[i].ret = -EINPROGRESS;
+
+	if (nr > 1 && io_batch_setup(nr) == 0) {
+		iocbs = xcalloc(nr, sizeof(*iocbs));
+		iocbp = xcalloc(nr, sizeof(*iocbp));
+		events = xcalloc(nr, sizeof(*events));
+		for (i = 0; i < nr; i++) {
+			struct iocb *cb = &iocbs[i];
+
+			cb->aio_data = i;
+			cb->aio_fildes = reqs[i].fd;
+			switch (reqs[i].op) {
+			case IO_READ:
+				cb->aio_lio_opcode = IOCB_CMD_PREAD;
+				break;
+			case IO_WRITE:
+				cb->aio_lio_opcode = IOCB_CMD_PWRITE;
+				break;
+			case IO_SYNC:
+				cb->aio_lio_opcode = IOCB_CMD_FDSYNC;
+				break;
+			}
+			cb->aio_buf = (unsigned long)reqs[i].buf;
+			cb->aio_nbytes = reqs[i].len;
+			cb->aio_offset = reqs[i].offset;
+			iocbp[i] = cb;
+		}
+		while (submitted < nr) {
+			int n = syscall(__NR_io_submit, io_ctx, nr - submitted,
+					iocbp + submitted);
+			if (n <= 0)
+				break;
+			submitted += n;
+		}
+		while (done < submitted) {
+			int n = syscall(__NR_io_getevents, io_ctx,
+					1, submitted - done, events, NULL);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				/* should not happen; the slots are now
+				 * unusable, so start again next time.
+				 */
+				break;
+			for (i = 0; i < n; i++)
+				reqs[events[i].data].ret = events[i].res;
+			done += n;
+		}
+		if (done < submitted) {
+			syscall(__NR_io_destroy, io_ctx);
+			io_ctx = 0;
+			io_ctx_nr = 0;
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		/* Anything not submitted, or that AIO cannot do on this
+		 * file (e.g. fdatasync on older kernels), is done here.
+		 */
+		if (reqs[i].ret == -EINPROGRESS || reqs[i].ret == -EINVAL)
+			io_req_sync(&reqs[i]);
+		if (io_req_failed(&reqs[i]))
+			failed++;
+	}
+	free(iocbs);
+	free(iocbp);
+	free(events);
+	return failed;
+}
+
+/**
+ * io_hist_add() - Account a latency in a log2 histogram.
+ * @hist: Histogram.
+ * @start: Time the operation started.
+ *
+ * Bucket n counts latencies from 2^(n-1) up to 2^n microseconds; the
+ * last bucket also takes everything longer.
+ */
+void io_hist_add(struct io_hist *hist, struct timespec *start)
+{
+	struct timespec now;
+	unsigned long long usec;
+	int b = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = (now.tv_sec - start->tv_sec) * 1000000ULL +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+	while (b < IO_HIST_BUCKETS - 1 && (usec >> b))
+		b++;
+	hist->count[b]++;
+	hist->total++;
+	hist->sum_usec += usec;
+	if (usec > hist->max_usec)
+		hist->max_usec = usec;
+}
+
+/**
+ * io_hist_print() - Print a histogram as "key=value" lines.
+ * @f: Where to print.
+ * @name: Prefix for the keys.
+ * @hist: Histogram.
+ */
+void io_hist_print(FILE *f, char *name, struct io_hist *hist)
+{
+	int b;
+
+	fprintf(f, "%s_count=%llu\n", name, hist->total);
+	fprintf(f, "%s_usec_total=%llu\n", name, hist->sum_usec);
+	fprintf(f, "%s_usec_max=%llu\n", name, hist->max_usec);
+	for (b = 0; b < IO_HIST_BUCKETS - 1; b++)
+		if (hist->count[b])
+			fprintf(f, "%s_usec_lt_%llu=%llu\n", name,
+				1ULL << b, hist->count[b]);
+	if (hist->count[b])
+		fprintf(f, "%s_usec_ge_%llu=%llu\n", name,
+			1ULL << (b - 1), hist->count[b]);
+}
@@ -126,10 +126,37 @@ struct conf_dev {
 
 struct mddev_dev *load_partitions(void)
 {
-	FILE *f = fopen("/proc/partitions", "r");
+	FILE *f;
 	char buf[1024];
 	struct mddev_dev *rv = NULL;
+	struct blkdev_info *blkdevs, *bd;
+
+	/* A single walk of /sys/class/block usually gives us names
+	 * for everything without having to search /dev.  md devices
+	 * still go through map_dev() so /dev/md/ names are preferred.
+	 */
+	blkdevs = sysfs_scan_blkdevs();
+	if (blkdevs) {
+		for (bd = blkdevs; bd; bd = bd->next) {
+			struct mddev_dev *d;
+			char *name = bd->devname;
+			int major = major(bd->devid);
+
+			if (!name || major == MD_MAJOR ||
+			    major == get_mdp_major())
+				name = map_dev(major, minor(bd->devid), 1);
+			if (!name)
+				continue;
+			d = xcalloc(1, sizeof(*d));
+			d->devname = xstrdup(name);
+			d->next = rv;
+			rv = d;
+		}
+		free_blkdevs(blkdevs);
+		return rv;
+	}
 
+	f = fopen("/proc/partitions", "r");
 	if (f == NULL) {
 		pr_err("cannot open /proc/partitions\n");
 		return NULL;
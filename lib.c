@@ -26,6 +26,7 @@
 #include	"dlink.h"
 #include	<ctype.h>
 #include	<limits.h>
+#include	<dirent.h>
 
 bool is_dev_alive(char *path)
 {
@@ -217,15 +218,120 @@ void udev_unblock(void)
 
 /*
  * convert a major/minor pair for a block device into a name in /dev, if possible.
- * On the first call, walk /dev collecting name.
- * Put them in a simple linked listfor now.
+ * Names are looked up for each device when it is first asked for: the
+ * kernel name from sysfs, the links udev recorded for it, and for md
+ * arrays the entries in /dev/md/.  Only if none of those exist is /dev
+ * walked, and then only once.  The names are kept in a hash by device.
  */
 struct devmap {
 	int major, minor;
-	char *name;
+	int nnames;
+	char **names;
 	struct devmap *next;
-} *devlist = NULL;
-int devlist_ready = 0;
+};
+#define DEVMAP_HASH 256
+static struct devmap *devmap_hash[DEVMAP_HASH];
+static int devmap_walked;
+
+static struct devmap **devmap_slot(int major, int minor)
+{
+	return &devmap_hash[(major * 31 + minor) % DEVMAP_HASH];
+}
+
+static struct devmap *devmap_find(int major, int minor)
+{
+	struct devmap *dm;
+
+	for (dm = *devmap_slot(major, minor); dm; dm = dm->next)
+		if (dm->major == major && dm->minor == minor)
+			return dm;
+	return NULL;
+}
+
+static void devmap_add(int major, int minor, const char *name)
+{
+	struct devmap *dm = devmap_find(major, minor);
+	int i;
+
+	if (!dm) {
+		struct devmap **slot = devmap_slot(major, minor);
+
+		dm = xcalloc(1, sizeof(*dm));
+		dm->major = major;
+		dm->minor = minor;
+		dm->next = *slot;
+		*slot = dm;
+	}
+	for (i = 0; i < dm->nnames; i++)
+		if (strcmp(dm->names[i], name) == 0)
+			return;
+	dm->names = xrealloc(dm->names, (dm->nnames + 1) * sizeof(char *));
+	dm->names[dm->nnames++] = xstrdup(name);
+}
+
+/* Record 'name' if it is a node for major:minor */
+static int devmap_try(int major, int minor, const char *name)
+{
+	struct stat stb;
+
+	if (stat(name, &stb) != 0 || !S_ISBLK(stb.st_mode) ||
+	    major(stb.st_rdev) != (unsigned)major ||
+	    minor(stb.st_rdev) != (unsigned)minor)
+		return 0;
+	devmap_add(major, minor, name);
+	return 1;
+}
+
+static struct devmap *devmap_lookup(int major, int minor)
+{
+	char path[PATH_MAX];
+	char *kname;
+	FILE *f;
+	DIR *dir;
+
+	kname = devid2kname(makedev(major, minor));
+	if (kname) {
+		char *c;
+
+		/* e.g. cciss!c0d0 is /dev/cciss/c0d0 */
+		snprintf(path, sizeof(path), "/dev/%s", kname);
+		for (c = path; *c; c++)
+			if (*c == '!')
+				*c = '/';
+		devmap_try(major, minor, path);
+	}
+
+	snprintf(path, sizeof(path), "/run/udev/data/b%d:%d", major, minor);
+	f = fopen(path, "r");
+	if (f) {
+		char line[PATH_MAX - 16];
+
+		while (fgets(line, sizeof(line), f)) {
+			if ((line[0] != 'S' && line[0] != 'N') ||
+			    line[1] != ':')
+				continue;
+			line[strcspn(line, "\n")] = 0;
+			snprintf(path, sizeof(path), "/dev/%s", line + 2);
+			devmap_try(major, minor, path);
+		}
+		fclose(f);
+	}
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/md", major, minor);
+	if (access(path, F_OK) == 0 && (dir = opendir("/dev/md")) != NULL) {
+		struct dirent *de;
+
+		while ((de = readdir(dir)) != NULL) {
+			if (de->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof(path), "/dev/md/%s", de->d_name);
+			devmap_try(major, minor, path);
+		}
+		closedir(dir);
+	}
+
+	return devmap_find(major, minor);
+}
 
 int add_dev(const char *name, const struct stat *stb, int flag, struct FTW *s)
 {
@@ -239,16 +345,11 @@ int add_dev(const char *name, const struct stat *stb, int flag, struct FTW *s)
 
 	if ((stb->st_mode&S_IFMT)== S_IFBLK) {
 		char *n = xstrdup(name);
-		struct devmap *dm = xmalloc(sizeof(*dm));
+
 		if (strncmp(n, "/dev/./", 7) == 0)
 			strcpy(n + 4, name + 6);
-		if (dm) {
-			dm->major = major(stb->st_rdev);
-			dm->minor = minor(stb->st_rdev);
-			dm->name = n;
-			dm->next = devlist;
-			devlist = dm;
-		}
+		devmap_add(major(stb->st_rdev), minor(stb->st_rdev), n);
+		free(n);
 	}
 
 	return 0;
@@ -287,46 +388,41 @@ int nftw(const char *path,
 char *map_dev_preferred(int major, int minor, int create,
 			char *prefer)
 {
-	struct devmap *p;
+	struct devmap *dm;
 	char *regular = NULL, *preferred=NULL;
-	int did_check = 0;
+	int i;
 
 	if (major == 0 && minor == 0)
 		return NULL;
 
- retry:
-	if (!devlist_ready) {
+	dm = devmap_find(major, minor);
+	if (!dm)
+		dm = devmap_lookup(major, minor);
+	if (!dm && !devmap_walked) {
+		/* no sysfs or udev names - fall back to searching /dev */
 		char *dev = "/dev";
 		struct stat stb;
-		while(devlist) {
-			struct devmap *d = devlist;
-			devlist = d->next;
-			free(d->name);
-			free(d);
-		}
+
 		if (lstat(dev, &stb) == 0 && S_ISLNK(stb.st_mode))
 			dev = "/dev/.";
 		nftw(dev, add_dev, 10, FTW_PHYS);
-		devlist_ready=1;
-		did_check = 1;
+		devmap_walked = 1;
+		dm = devmap_find(major, minor);
 	}
 
-	for (p = devlist; p; p = p->next)
-		if (p->major == major && p->minor == minor) {
-			if (strncmp(p->name, "/dev/md/",8) == 0 ||
-			    (prefer && strstr(p->name, prefer))) {
-				if (preferred == NULL ||
-				    strlen(p->name) < strlen(preferred))
-					preferred = p->name;
-			} else {
-				if (regular == NULL ||
-				    strlen(p->name) < strlen(regular))
-					regular = p->name;
-			}
+	for (i = 0; dm && i < dm->nnames; i++) {
+		char *name = dm->names[i];
+
+		if (strncmp(name, "/dev/md/", 8) == 0 ||
+		    (prefer && strstr(name, prefer))) {
+			if (preferred == NULL ||
+			    strlen(name) < strlen(preferred))
+				preferred = name;
+		} else {
+			if (regular == NULL ||
+			    strlen(name) < strlen(regular))
+				regular = name;
 		}
-	if (!regular && !preferred && !did_check) {
-		devlist_ready = 0;
-		goto retry;
 	}
 	if (create && !regular && !preferred) {
 		static char buf[30];
@@ -337,6 +433,26 @@ char *map_dev_preferred(int major, int minor, int create,
 	return preferred ? preferred : regular;
 }
 
+/* Forget all names found by map_dev_preferred(), they may be stale now.
+ * Strings it returned earlier are freed.
+ */
+void map_dev_flush(void)
+{
+	int h, i;
+
+	for (h = 0; h < DEVMAP_HASH; h++)
+		while (devmap_hash[h]) {
+			struct devmap *dm = devmap_hash[h];
+
+			devmap_hash[h] = dm->next;
+			for (i = 0; i < dm->nnames; i++)
+				free(dm->names[i]);
+			free(dm->names);
+			free(dm);
+		}
+	devmap_walked = 0;
+}
+
 /* conf_word gets one word from the conf file.
  * if "allow_key", then accept words at the start of a line,
  * otherwise stop when such a word is found.
@@ -106,6 +106,8 @@
 #include	"mdmon.h"
 #include	<sys/syscall.h>
 #include	<sys/socket.h>
+#include	<sys/eventfd.h>
+#include	<poll.h>
 
 static void close_aa(struct active_array *aa)
 {
@@ -175,11 +177,45 @@ static struct active_array *duplicate_aa(struct active_array *aa)
 	return newa;
 }
 
+int mon_wake_fd = -1, mgr_wake_fd = -1;
+int mgr_waiting;
+
+void wake_thread(int efd)
+{
+	eventfd_write(efd, 1);
+}
+
+void drain_wake(int efd)
+{
+	eventfd_t cnt;
+
+	eventfd_read(efd, &cnt);
+}
+
 static void wakeup_monitor(void)
 {
-	/* tgkill(getpid(), mon_tid, SIGUSR1); */
-	int pid = getpid();
-	syscall(SYS_tgkill, pid, mon_tid, SIGUSR1);
+	wake_thread(mon_wake_fd);
+}
+
+static void wait_for_monitor(int (*done)(void))
+{
+	/* Sleep until the monitor makes 'done' true.  While
+	 * 'mgr_waiting' is set the monitor wakes us after every
+	 * pass; the timeout is only a safety net.
+	 */
+	struct pollfd pfd = { .fd = mgr_wake_fd, .events = POLLIN };
+
+	__atomic_store_n(&mgr_waiting, 1, __ATOMIC_SEQ_CST);
+	while (!done()) {
+		poll(&pfd, 1, 1000);
+		drain_wake(mgr_wake_fd);
+	}
+	__atomic_store_n(&mgr_waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+static int have_discard(void)
+{
+	return discard_this != NULL;
 }
 
 static void remove_old(void)
@@ -206,8 +242,7 @@ static void replace_array(struct supertype *container,
 	 */
 	remove_old();
 	while (pending_discard) {
-		while (discard_this == NULL)
-			sleep_for(1, 0, true);
+		wait_for_monitor(have_discard);
 		remove_old();
 	}
 	pending_discard = old;
@@ -217,9 +252,7 @@ static void replace_array(struct supertype *container,
 	wakeup_monitor();
 }
 
-struct metadata_update *update_queue = NULL;
-struct metadata_update *update_queue_handled = NULL;
-struct metadata_update *update_queue_pending = NULL;
+struct update_ring update_ring;
 
 static void free_updates(struct metadata_update **update)
 {
@@ -239,33 +272,70 @@ static void free_updates(struct metadata_update **update)
 	}
 }
 
-void check_update_queue(struct supertype *container)
+static int updates_pending(void)
 {
-	free_updates(&update_queue_handled);
+	return __atomic_load_n(&update_ring.tail, __ATOMIC_ACQUIRE) !=
+		update_ring.head;
+}
 
-	if (update_queue == NULL &&
-	    update_queue_pending) {
-		update_queue = update_queue_pending;
-		update_queue_pending = NULL;
-		wakeup_monitor();
+static int updates_done(void)
+{
+	return !updates_pending();
+}
+
+static int update_ring_room(void)
+{
+	return UPDATE_RING_SIZE - (update_ring.head - update_ring.freed);
+}
+
+void check_update_queue(struct supertype *container)
+{
+	/* free whatever the monitor has finished with */
+	unsigned int tail = __atomic_load_n(&update_ring.tail,
+					    __ATOMIC_ACQUIRE);
+
+	while (update_ring.freed != tail) {
+		free_updates(&update_ring.slot[update_ring.freed %
+					       UPDATE_RING_SIZE]);
+		update_ring.freed++;
 	}
 }
 
 static void queue_metadata_update(struct metadata_update *mu)
 {
-	struct metadata_update **qp;
-
-	qp = &update_queue_pending;
-	while (*qp)
-		qp = & ((*qp)->next);
-	*qp = mu;
+	/* A list of updates is made visible to the monitor in one
+	 * go, so it is processed in a single pass - unless it is
+	 * too long for the ring.
+	 */
+	struct metadata_update *u;
+	int n = 0;
+
+	for (u = mu; u; u = u->next)
+		n++;
+	while (mu) {
+		unsigned int head = update_ring.head;
+		int room;
+
+		check_update_queue(NULL);
+		if (update_ring_room() < min(n, UPDATE_RING_SIZE)) {
+			wait_for_monitor(updates_done);
+			check_update_queue(NULL);
+		}
+		for (room = update_ring_room(); mu && room; room--, n--) {
+			u = mu;
+			mu = mu->next;
+			u->next = NULL;
+			update_ring.slot[head++ % UPDATE_RING_SIZE] = u;
+		}
+		__atomic_store_n(&update_ring.head, head, __ATOMIC_RELEASE);
+		wakeup_monitor();
+	}
 }
 
 static void add_disk_to_container(struct supertype *st, struct mdinfo *sd)
 {
 	int dfd;
 	char nm[20];
-	struct metadata_update *update = NULL;
 	mdu_disk_info_t dk = {
 		.number = -1,
 		.major = sd->disk.major,
@@ -284,11 +354,9 @@ static void add_disk_to_container(struct supertype *st, struct mdinfo *sd)
 	if (dfd < 0)
 		return;
 
-	st->update_tail = &update;
+	/* the update goes to the list at st->update_tail */
 	st->ss->add_to_super(st, &dk, dfd, NULL, INVALID_SECTORS);
 	st->ss->write_init_super(st);
-	queue_metadata_update(update);
-	st->update_tail = NULL;
 }
 
 /*
@@ -298,7 +366,6 @@ static void add_disk_to_container(struct supertype *st, struct mdinfo *sd)
  */
 static void remove_disk_from_container(struct supertype *st, struct mdinfo *sd)
 {
-	struct metadata_update *update = NULL;
 	mdu_disk_info_t dk = {
 		.number = -1,
 		.major = sd->disk.major,
@@ -309,15 +376,13 @@ static void remove_disk_from_container(struct supertype *st, struct mdinfo *sd)
 	dprintf("remove %d:%d from container\n",
 		sd->disk.major, sd->disk.minor);
 
-	st->update_tail = &update;
+	/* the update goes to the list at st->update_tail */
 	st->ss->remove_from_super(st, &dk);
 	/* FIXME this write_init_super shouldn't be here.
 	 * We have it after add_to_super to write to new device,
 	 * but with 'remove' we don't ant to write to that device!
 	 */
 	st->ss->write_init_super(st);
-	queue_metadata_update(update);
-	st->update_tail = NULL;
 }
 
 static void manage_container(struct mdstat_ent *mdstat,
@@ -330,9 +395,13 @@ static void manage_container(struct mdstat_ent *mdstat,
 	 *   remove it from the device list and update the metadata.
 	 * FIXME should we look for compatible metadata and take hints
 	 * about spare assignment.... probably not.
+	 *
+	 * All changes found are queued to the monitor together, so
+	 * that they are committed with a single metadata write.
 	 */
 	if (mdstat->devcnt != container->devcnt) {
 		struct mdinfo **cdp, *cd, *di, *mdi;
+		struct metadata_update *updates = NULL;
 		int found;
 
 		/* read /sys/block/NAME/md/dev-??/block/dev to find out
@@ -347,6 +416,8 @@ static void manage_container(struct mdstat_ent *mdstat,
 			return;
 		}
 
+		container->update_tail = &updates;
+
 		/* check for removals */
 		for (cdp = &container->devs; *cdp; ) {
 			found = 0;
@@ -378,6 +449,8 @@ static void manage_container(struct mdstat_ent *mdstat,
 				add_disk_to_container(container, newd);
 			}
 		}
+		container->update_tail = NULL;
+		queue_metadata_update(updates);
 		sysfs_free(mdi);
 		container->devcnt = mdstat->devcnt;
 	}
@@ -527,8 +600,7 @@ static void manage_member(struct mdstat_ent *mdstat,
 	 * might container a change (such as a spare assignment) which
 	 * could affect our decisions.
 	 */
-	if (a->check_degraded && !frozen &&
-	    update_queue == NULL && update_queue_pending == NULL) {
+	if (a->check_degraded && !frozen && !updates_pending()) {
 		struct metadata_update *updates = NULL;
 		struct mdinfo *newdev = NULL;
 		struct active_array *newa;
@@ -566,10 +638,8 @@ static void manage_member(struct mdstat_ent *mdstat,
 		}
 		queue_metadata_update(updates);
 		updates = NULL;
-		while (update_queue_pending || update_queue) {
-			check_update_queue(container);
-			sleep_for(0, MSEC_TO_NSEC(15), true);
-		}
+		wait_for_monitor(updates_done);
+		check_update_queue(container);
 		replace_array(container, a, newa);
 		if (sysfs_set_str(&a->info, NULL,
 				  "sync_action", "recover") == 0)
@@ -784,6 +854,11 @@ error:
 		sysfs_free(mdi);
 }
 
+/* Number of clients between MSG_BATCH_BEGIN and MSG_BATCH_END */
+static int batch_holders;
+/* A batch has ended since the container was last reconciled */
+static int batch_ended;
+
 void manage(struct mdstat_ent *mdstat, struct supertype *container)
 {
 	/* We have just read mdstat and need to compare it with
@@ -794,6 +869,17 @@ void manage(struct mdstat_ent *mdstat, struct supertype *container)
 	for ( ; mdstat ; mdstat = mdstat->next) {
 		struct active_array *a;
 		if (strcmp(mdstat->devnm, container->devnm) == 0) {
+			/* leave membership changes until the batch
+			 * is complete
+			 */
+			if (batch_holders)
+				continue;
+			/* a remove and an add in one batch leave the
+			 * device count as it was, so compare the devices
+			 */
+			if (batch_ended)
+				container->devcnt = -1;
+			batch_ended = 0;
 			manage_container(mdstat, container);
 			continue;
 		}
@@ -813,86 +899,322 @@ void manage(struct mdstat_ent *mdstat, struct supertype *container)
 	}
 }
 
-static void handle_message(struct supertype *container, struct metadata_update *msg)
+/*
+ * Clients of the control socket are served without blocking: all of
+ * them are watched together with mdstat and the monitor, and each
+ * may send several requests without waiting for the replies.
+ * Requests of one client are handled in order.  Metadata updates
+ * are prepared and queued to the monitor as soon as it is idle, the
+ * updates of all clients together, and acknowledged straight away.
+ * A ping waits until everything queued before it has been handled
+ * (and, for ping_monitor, the monitor has made another pass) without
+ * holding up other clients.
+ */
+#define CLIENT_TIMEOUT 3 /* hang up on a client idle this long */
+#define BATCH_TIMEOUT 30 /* ... or this long while holding a batch */
+
+enum client_wait {
+	CLIENT_READY,
+	CLIENT_WAIT_UPDATES,	/* ping waits for queued updates */
+	CLIENT_WAIT_MONITOR,	/* ping_monitor waits for monitor pass */
+};
+
+struct mdmon_client {
+	int fd;
+	char *in;
+	int in_len, in_size;
+	char *out;
+	int out_len, out_size;
+	time_t active;
+	int gone;
+	int batch;		/* between MSG_BATCH_BEGIN and _END */
+	enum client_wait wait;
+	int ping_len;		/* request being waited for */
+	__u32 ping_id;
+	int ping_target;	/* monitor_loop_cnt to wait for */
+	struct mdmon_client *next;
+};
+
+static struct mdmon_client *clients;
+
+static void client_reply(struct mdmon_client *c, struct metadata_update *msg,
+			 __u32 id)
+{
+	int len = format_message(NULL, msg, id);
+
+	if (c->out_len + len > c->out_size) {
+		c->out_size = c->out_len + len + 256;
+		c->out = xrealloc(c->out, c->out_size);
+	}
+	c->out_len += format_message(c->out + c->out_len, msg, id);
+}
+
+static void client_ack(struct mdmon_client *c, __u32 id)
+{
+	struct metadata_update msg = { .len = 0 };
+
+	client_reply(c, &msg, id);
+}
+
+static void accept_clients(struct supertype *container)
 {
-	/* queue this metadata update through to the monitor */
+	int fd;
+	long fl;
 
-	struct metadata_update *mu;
+	if (container->sock < 0)
+		return;
+	while ((fd = accept(container->sock, NULL, NULL)) >= 0) {
+		struct mdmon_client *c;
 
-	if (msg->len <= 0)
-		while (update_queue_pending || update_queue) {
-			check_update_queue(container);
-			sleep_for(0, MSEC_TO_NSEC(15), true);
+		if (fd >= FD_SETSIZE) {
+			close(fd);
+			continue;
 		}
+		fl = fcntl(fd, F_GETFL, 0);
+		fl |= O_NONBLOCK;
+		fcntl(fd, F_SETFL, fl);
+
+		c = xcalloc(1, sizeof(*c));
+		c->fd = fd;
+		c->active = time(NULL);
+		c->next = clients;
+		clients = c;
+	}
+}
 
-	if (msg->len == 0) { /* ping_monitor */
-		int cnt;
+static int client_read(struct mdmon_client *c)
+{
+	/* Returns -1 once the client has gone */
+	int n;
 
-		cnt = monitor_loop_cnt;
-		if (cnt & 1)
-			cnt += 2; /* wait until next pselect */
-		else
-			cnt += 3; /* wait for 2 pselects */
-		wakeup_monitor();
+	while (c->in_len <= MSG_MAX_LEN + 16) {
+		if (c->in_size - c->in_len < 4096) {
+			c->in_size = c->in_len + 65536;
+			c->in = xrealloc(c->in, c->in_size);
+		}
+		n = read(c->fd, c->in + c->in_len, c->in_size - c->in_len);
+		if (n == 0)
+			return -1;
+		if (n < 0)
+			return errno == EAGAIN || errno == EINTR ? 0 : -1;
+		c->in_len += n;
+		c->active = time(NULL);
+	}
+	return 0;
+}
 
-		while (monitor_loop_cnt - cnt < 0)
-			sleep_for(0, MSEC_TO_NSEC(10), true);
-	} else if (msg->len == -1) { /* ping_manager */
-		struct mdstat_ent *mdstat = mdstat_read(1, 0);
+static int client_write(struct mdmon_client *c)
+{
+	int n;
+
+	while (c->out_len) {
+		n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+		if (n < 0)
+			return errno == EAGAIN || errno == EINTR ? 0 : -1;
+		memmove(c->out, c->out + n, c->out_len - n);
+		c->out_len -= n;
+		c->active = time(NULL);
+	}
+	return 0;
+}
 
-		manage(mdstat, container);
-		free_mdstat(mdstat);
-	} else if (!sigterm) {
+static int client_requests(struct supertype *container,
+			   struct mdmon_client *c,
+			   struct metadata_update ***batch)
+{
+	/* Handle the requests that 'c' has sent, until one of them
+	 * has to wait.  Updates are added to 'batch'.
+	 * Returns the number handled, or -1 for a bad request.
+	 */
+	struct metadata_update msg, *mu;
+	int handled = 0;
+	__u32 id;
+	int n;
+
+	while (c->wait == CLIENT_READY) {
+		n = parse_message(c->in, c->in_len, &msg, &id);
+		if (n <= 0)
+			return n < 0 ? -1 : handled;
+		memmove(c->in, c->in + n, c->in_len - n);
+		c->in_len -= n;
+		handled++;
+
+		if (msg.len <= 0) {
+			c->wait = CLIENT_WAIT_UPDATES;
+			c->ping_len = msg.len;
+			c->ping_id = id;
+			break;
+		}
+		if (sigterm) {
+			free(msg.buf);
+			client_ack(c, id);
+			continue;
+		}
 		mu = xmalloc(sizeof(*mu));
-		mu->len = msg->len;
-		mu->buf = msg->buf;
-		msg->buf = NULL;
+		mu->len = msg.len;
+		mu->buf = msg.buf;
 		mu->space = NULL;
 		mu->space_list = NULL;
 		mu->next = NULL;
-		if (container->ss->prepare_update)
-			if (!container->ss->prepare_update(container, mu))
-				free_updates(&mu);
-		queue_metadata_update(mu);
+		if (container->ss->prepare_update &&
+		    !container->ss->prepare_update(container, mu))
+			free_updates(&mu);
+		if (mu) {
+			**batch = mu;
+			*batch = &mu->next;
+		}
+		client_ack(c, id);
 	}
+	return handled;
 }
 
-void read_sock(struct supertype *container)
+static void batch_release(struct mdmon_client *c)
 {
-	int fd;
+	c->batch = 0;
+	batch_holders--;
+	batch_ended = 1;
+}
+
+static int client_ping(struct supertype *container, struct mdmon_client *c)
+{
+	/* Move a waiting ping along.  Returns 1 if it moved */
 	struct metadata_update msg;
-	int terminate = 0;
-	long fl;
-	int tmo = 3; /* 3 second timeout before hanging up the socket */
+	int cnt;
 
-	fd = accept(container->sock, NULL, NULL);
-	if (fd < 0)
-		return;
+	switch (c->wait) {
+	case CLIENT_WAIT_UPDATES:
+		if (updates_pending())
+			return 0;
+		check_update_queue(container);
+		if (c->ping_len == MSG_BATCH_BEGIN && !c->batch) {
+			c->batch = 1;
+			batch_holders++;
+		} else if (c->ping_len == MSG_BATCH_END && c->batch)
+			batch_release(c);
+		if (c->ping_len < 0) {
+			if (c->ping_len == -1 ||
+			    c->ping_len == MSG_BATCH_END) { /* ping_manager */
+				struct mdstat_ent *mdstat = mdstat_read(1, 0);
+
+				manage(mdstat, container);
+				free_mdstat(mdstat);
+			}
+			if (c->ping_len == MSG_BATCH_BEGIN) {
+				/* tell the client batches are supported */
+				msg.len = MSG_BATCH_BEGIN;
+				msg.buf = NULL;
+				client_reply(c, &msg, c->ping_id);
+			} else
+				client_ack(c, c->ping_id);
+			c->wait = CLIENT_READY;
+			return 1;
+		}
+		/* ping_monitor */
+		cnt = monitor_loop_cnt;
+		if (cnt & 1)
+			cnt += 2; /* wait until next pselect */
+		else
+			cnt += 3; /* wait for 2 pselects */
+		c->ping_target = cnt;
+		c->wait = CLIENT_WAIT_MONITOR;
+		wakeup_monitor();
+		return 1;
+	case CLIENT_WAIT_MONITOR:
+		if (__atomic_load_n(&monitor_loop_cnt, __ATOMIC_ACQUIRE) -
+		    c->ping_target < 0)
+			return 0;
+		/* ping reply with version */
+		msg.buf = Version;
+		msg.len = strlen(Version) + 1;
+		client_reply(c, &msg, c->ping_id);
+		c->wait = CLIENT_READY;
+		return 1;
+	default:
+		return 0;
+	}
+}
 
-	fl = fcntl(fd, F_GETFL, 0);
-	fl |= O_NONBLOCK;
-	fcntl(fd, F_SETFL, fl);
+static void free_client(struct mdmon_client *c)
+{
+	if (c->batch)
+		batch_release(c);
+	close(c->fd);
+	free(c->in);
+	free(c->out);
+	free(c);
+}
+
+static void serve_clients(struct supertype *container)
+{
+	struct metadata_update *batch, **btail;
+	struct mdmon_client *c, **cp;
+	int progress;
+
+	accept_clients(container);
 
 	do {
-		msg.buf = NULL;
-
-		/* read and validate the message */
-		if (receive_message(fd, &msg, tmo) == 0) {
-			handle_message(container, &msg);
-			if (msg.len == 0) {
-				/* ping reply with version */
-				msg.buf = Version;
-				msg.len = strlen(Version) + 1;
-				if (send_message(fd, &msg, tmo) < 0)
-					terminate = 1;
-			} else if (ack(fd, tmo) < 0)
-				terminate = 1;
-		} else
-			terminate = 1;
+		progress = 0;
+		batch = NULL;
+		btail = &batch;
+		for (c = clients; c; c = c->next) {
+			int n;
 
-	} while (!terminate);
+			if (c->gone)
+				continue;
+			if (client_read(c) < 0) {
+				c->gone = 1;
+				continue;
+			}
+			if (updates_pending())
+				continue;
+			n = client_requests(container, c, &btail);
+			if (n < 0)
+				c->gone = 1;
+			else if (n > 0)
+				progress = 1;
+		}
+		/* everything that arrived goes to the monitor together */
+		queue_metadata_update(batch);
+
+		for (c = clients; c; c = c->next)
+			if (!c->gone)
+				progress |= client_ping(container, c);
+	} while (progress);
+
+	for (cp = &clients; (c = *cp) != NULL; ) {
+		if (!c->gone && client_write(c) < 0)
+			c->gone = 1;
+		if (c->wait == CLIENT_READY && !c->out_len &&
+		    time(NULL) - c->active >=
+		    (c->batch ? BATCH_TIMEOUT : CLIENT_TIMEOUT))
+			c->gone = 1;
+		if (c->gone) {
+			*cp = c->next;
+			free_client(c);
+		} else
+			cp = &c->next;
+	}
+}
 
-	close(fd);
+static int client_fds(fd_set *rfds, fd_set *wfds, int maxfd)
+{
+	/* Add the fds to wait for, and say whether a ping waits on
+	 * the monitor
+	 */
+	struct mdmon_client *c;
+	int waiting = 0;
+
+	for (c = clients; c; c = c->next) {
+		if (c->in_len <= MSG_MAX_LEN + 16)
+			FD_SET(c->fd, rfds);
+		if (c->out_len)
+			FD_SET(c->fd, wfds);
+		if (c->wait != CLIENT_READY)
+			waiting = 1;
+		maxfd = max(maxfd, c->fd);
+	}
+	__atomic_store_n(&mgr_waiting, waiting, __ATOMIC_SEQ_CST);
+	return maxfd;
 }
 
 int exit_now = 0;
@@ -907,36 +1229,55 @@ void do_manager(struct supertype *container)
 	sigdelset(&set, SIGTERM);
 
 	do {
+		fd_set rfds, wfds;
+		struct timespec tmo = { CLIENT_TIMEOUT, 0 };
+		int maxfd;
 
 		if (exit_now)
 			exit(0);
 
 		/* Can only 'manage' things if 'monitor' is not making
 		 * structural changes to metadata, so need to check
-		 * update_queue
+		 * update_ring
 		 */
-		if (update_queue == NULL) {
+		if (!updates_pending()) {
 			mdstat = mdstat_read(1, 0);
 
 			manage(mdstat, container);
 
-			read_sock(container);
-
 			free_mdstat(mdstat);
 		}
+
+		serve_clients(container);
+
 		remove_old();
 
 		check_update_queue(container);
 
+		write_stats(container->devnm);
+
 		manager_ready = 1;
 
 		if (sigterm)
 			wakeup_monitor();
 
-		if (update_queue == NULL)
-			mdstat_wait_fd(container->sock, &set);
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_SET(mgr_wake_fd, &rfds);
+		maxfd = mgr_wake_fd;
+		if (container->sock >= 0) {
+			FD_SET(container->sock, &rfds);
+			maxfd = max(maxfd, container->sock);
+		}
+		maxfd = client_fds(&rfds, &wfds, maxfd);
+
+		if (!updates_pending())
+			mdstat_wait_fds(&rfds, &wfds, maxfd,
+					clients ? &tmo : NULL, &set);
 		else
-			/* If an update is happening, just wait for signal */
-			pselect(0, NULL, NULL, NULL, NULL, &set);
+			/* If an update is happening, don't look at mdstat */
+			pselect(maxfd + 1, &rfds, &wfds, NULL,
+				clients ? &tmo : NULL, &set);
+		drain_wake(mgr_wake_fd);
 	} while(1);
 }
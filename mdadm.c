@@ -95,6 +95,8 @@ int main(int argc, char *argv[])
 	char *shortopt = short_options;
 	int dosyslog = 0;
 	int rebuild_map = 0;
+	int listen = 0;
+	int alert_window = 0;
 	char *remove_path = NULL;
 	char *udev_filename = NULL;
 	char *dump_directory = NULL;
@@ -874,6 +876,11 @@ int main(int argc, char *argv[])
 			c.scan = 1;
 			continue;
 
+		case O(MISC, Json):
+		case O(MONITOR, Json):
+			c.json = 1;
+			continue;
+
 		case O(MONITOR,'m'): /* mail address */
 		case O(MONITOR,EMail):
 			if (mailaddr)
@@ -937,6 +944,13 @@ int main(int argc, char *argv[])
 		case O(MONITOR, NoSharing):
 			spare_sharing = 0;
 			continue;
+		case O(MONITOR, AlertWindow):
+			if (parse_num(&alert_window, optarg) != 0 ||
+			    alert_window < 0) {
+				pr_err("invalid alert window: %s\n", optarg);
+				exit(2);
+			}
+			continue;
 
 			/* now the general management options.  Some are applicable
 			 * to other modes. None have arguments.
@@ -1208,6 +1222,9 @@ int main(int argc, char *argv[])
 		case O(INCREMENTAL, IncrementalPath):
 			remove_path = optarg;
 			continue;
+		case O(INCREMENTAL, Listen):
+			listen = 1;
+			continue;
 		case O(CREATE, WriteJournal):
 			if (s.journaldisks) {
 				pr_err("Please specify only one journal device for the array.\n");
@@ -1606,6 +1623,25 @@ int main(int argc, char *argv[])
 			rv = Detail_Platform(ss ? ss->ss : NULL, ss ? c.scan : 1,
 					     c.verbose, c.export,
 					     devlist ? devlist->devname : NULL);
+		} else if (c.json && (devmode != 'D' || devlist || !c.scan)) {
+			pr_err("--json is only supported with --examine or --detail --scan\n");
+			rv = 2;
+		} else if (devmode == Dump && (devlist || c.scan)) {
+			/* Dump all the devices concurrently, or every
+			 * device we can find with --scan.
+			 */
+			for (dv = devlist; dv; dv = dv->next)
+				if (dv->disposition != Dump)
+					break;
+			if (dv)
+				rv = misc_list(devlist, &ident, dump_directory,
+					       ss, &c);
+			else if (devlist)
+				rv = Dump_devices(devlist, dump_directory,
+						  &c, ss, 0);
+			else
+				rv = Dump_devices(conf_get_devs(),
+						  dump_directory, &c, ss, 1);
 		} else if (devlist == NULL) {
 			if (devmode == 'S' && c.scan)
 				rv = stop_scan(c.verbose);
@@ -1640,7 +1676,7 @@ int main(int argc, char *argv[])
 		rv = Monitor(devlist, mailaddr, program,
 			     &c, daemonise, oneshot,
 			     dosyslog, pidfile, increments,
-			     spare_sharing);
+			     alert_window, spare_sharing);
 		break;
 
 	case GROW:
@@ -1717,6 +1753,15 @@ int main(int argc, char *argv[])
 		if (rebuild_map) {
 			RebuildMap();
 		}
+		if (listen) {
+			if (devlist || c.scan || devmode == 'f') {
+				pr_err("--incremental --listen does not take devices, --scan or --fail.\n");
+				rv = 1;
+				break;
+			}
+			rv = IncrementalListen(&c);
+			break;
+		}
 		if (c.scan) {
 			rv = 1;
 			if (devlist) {
@@ -1748,6 +1793,12 @@ int main(int argc, char *argv[])
 			}
 			rv = IncrementalRemove(devlist->devname, remove_path,
 					       c.verbose);
+		} else if (c.runstop == 0 && !ss && !c.export &&
+			   IncrementalHandoff(devlist->devname) == 0) {
+			/* a running --listen will add it, the caller
+			 * gets nothing to --export
+			 */
+			rv = 0;
 		} else
 			rv = Incremental(devlist, &c, ss);
 		break;
@@ -1841,10 +1892,16 @@ static int scan_assemble(struct supertype *ss,
 		pr_err("No arrays found in config file\n");
 		rv = 1;
 	}
+	assemble_cache_flush();
 	map_unlock(&map);
 	return rv;
 }
 
+static int detail_json(char *devname, struct context *c, void *arg)
+{
+	return Detail(devname, c);
+}
+
 static int misc_scan(char devmode, struct context *c)
 {
 	/* apply --detail or --wait-clean to
@@ -1853,7 +1910,9 @@ static int misc_scan(char devmode, struct context *c)
 	struct mdstat_ent *ms = mdstat_read(0, 1);
 	struct mdstat_ent *e;
 	struct map_ent *map = NULL;
+	char **names = NULL;
 	int members;
+	int cnt = 0;
 	int rv = 0;
 
 	for (members = 0; members <= 1; members++) {
@@ -1877,16 +1936,33 @@ static int misc_scan(char devmode, struct context *c)
 					e->devnm);
 				continue;
 			}
-			if (devmode == 'D')
+			if (c->json || devmode != 'D') {
+				/* collect them all, then handle them together */
+				names = xrealloc(names, (cnt + 1) * sizeof(*names));
+				names[cnt++] = xstrdup(name);
+			} else {
 				rv |= Detail(name, c);
-			else
-				rv |= WaitClean(name, c->verbose);
-			put_md_name(name);
+				put_md_name(name);
+			}
 			map_free(map);
 			map = NULL;
 		}
 	}
 	free_mdstat(ms);
+	if (cnt) {
+		if (c->json) {
+			c->brief = 0;
+			rv = json_scan("arrays", names, cnt, detail_json, c,
+				       NULL, 0);
+		} else {
+			rv = WaitClean_devices(names, cnt, c->verbose);
+		}
+		while (cnt--) {
+			put_md_name(names[cnt]);
+			free(names[cnt]);
+		}
+		free(names);
+	}
 	return rv;
 }
 
@@ -1932,32 +2008,50 @@ static int stop_scan(int verbose)
 	return rv;
 }
 
+static char **misc_devs(struct mddev_dev **dvp, int *cnt)
+{
+	/* Collect the names of *dvp and the devices following it with
+	 * the same disposition, so they can be handled together.
+	 * *dvp is left at the last of them.
+	 */
+	struct mddev_dev *dv = *dvp;
+	char **devs = NULL;
+
+	*cnt = 0;
+	while (1) {
+		devs = xrealloc(devs, (*cnt + 1) * sizeof(*devs));
+		devs[(*cnt)++] = dv->devname;
+		if (!dv->next || dv->next->disposition != dv->disposition)
+			break;
+		dv = dv->next;
+	}
+	*dvp = dv;
+	return devs;
+}
+
 static int misc_list(struct mddev_dev *devlist,
 		     struct mddev_ident *ident,
 		     char *dump_directory,
 		     struct supertype *ss, struct context *c)
 {
 	struct mddev_dev *dv;
+	int verified = 0;
 	int rv = 0;
 
 	for (dv = devlist; dv; dv = (rv & 16) ? NULL : dv->next) {
 		int mdfd = -1;
+		struct stat stb;
+		char **devs;
+		int cnt;
 
 		switch(dv->disposition) {
 		case 'D':
 			rv |= Detail(dv->devname, c);
 			continue;
 		case KillOpt: /* Zero superblock */
-			if (ss)
-				rv |= Kill(dv->devname, ss, c->force, c->verbose,0);
-			else {
-				int v = c->verbose;
-				do {
-					rv |= Kill(dv->devname, NULL, c->force, v, 0);
-					v = -1;
-				} while (rv == 0);
-				rv &= ~4;
-			}
+			devs = misc_devs(&dv, &cnt);
+			rv |= Kill_devices(devs, cnt, ss, c->force, c->verbose);
+			free(devs);
 			continue;
 		case 'Q':
 			rv |= Query(dv->devname);
@@ -1970,10 +2064,14 @@ static int misc_list(struct mddev_dev *devlist,
 			continue;
 		case 'W':
 		case WaitOpt:
-			rv |= Wait(dv->devname);
+			devs = misc_devs(&dv, &cnt);
+			rv |= Wait_devices(devs, cnt);
+			free(devs);
 			continue;
 		case Waitclean:
-			rv |= WaitClean(dv->devname, c->verbose);
+			devs = misc_devs(&dv, &cnt);
+			rv |= WaitClean_devices(devs, cnt, c->verbose);
+			free(devs);
 			continue;
 		case KillSubarray:
 			rv |= Kill_subarray(dv->devname, c->subarray, c->verbose);
@@ -1991,6 +2089,16 @@ static int misc_list(struct mddev_dev *devlist,
 			rv |= Dump_metadata(dv->devname, dump_directory, c, ss);
 			continue;
 		case Restore:
+			/* Check the whole dump before restoring anything */
+			if (!verified++ &&
+			    stat(dump_directory, &stb) == 0 &&
+			    S_ISDIR(stb.st_mode) &&
+			    Dump_verify(dump_directory, c->verbose) != 0) {
+				pr_err("%s is damaged, not restoring.\n",
+				       dump_directory);
+				rv |= 17;
+				continue;
+			}
 			rv |= Restore_metadata(dv->devname, dump_directory, c, ss,
 					       (dv == devlist && dv->next == NULL));
 			continue;
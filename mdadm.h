@@ -92,6 +92,9 @@ struct dlm_lksb {
 #ifndef BLKGETSIZE64
 #define BLKGETSIZE64 _IOR(0x12,114,size_t) /* return device size in bytes (u64 *arg) */
 #endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12,127) /* zero a range of sectors, uint64_t range[2] */
+#endif
 
 #define DEFAULT_CHUNK 512
 #define DEFAULT_BITMAP_CHUNK 4096
@@ -493,6 +496,9 @@ enum special_options {
 	ClusterConfirm,
 	WriteJournal,
 	ConsistencyPolicy,
+	Json,
+	Listen,
+	AlertWindow,
 };
 
 enum prefix_standard {
@@ -567,6 +573,7 @@ struct context {
 	int	require_homehost;
 	char	*prefer;
 	int	export;
+	int	json;
 	int	test;
 	char	*subarray;
 	char	*update;
@@ -639,7 +646,8 @@ extern struct mdstat_ent *mdstat_read(int hold, int start);
 extern void mdstat_close(void);
 extern void free_mdstat(struct mdstat_ent *ms);
 extern int mdstat_wait(int seconds);
-extern void mdstat_wait_fd(int fd, const sigset_t *sigmask);
+extern int mdstat_wait_fds(fd_set *rfds, fd_set *wfds, int maxfd,
+			   const struct timespec *tmo, const sigset_t *sigmask);
 extern int mddev_busy(char *devnm);
 extern struct mdstat_ent *mdstat_by_component(char *name);
 extern struct mdstat_ent *mdstat_by_subdev(char *subdev, char *container);
@@ -726,8 +734,50 @@ extern int sysfs_set_array(struct mdinfo *info, int vers);
 extern int sysfs_add_disk(struct mdinfo *sra, struct mdinfo *sd, int resume);
 extern int sysfs_disk_to_scsi_id(int fd, __u32 *id);
 extern int sysfs_unique_holder(char *devnm, long rdev);
+
+/**
+ * struct blkdev_info - Block device found by sysfs_scan_blkdevs().
+ * @devid: Device number.
+ * @devname: /dev node named after the kernel name, or NULL if there
+ * isn't one.
+ */
+struct blkdev_info {
+	dev_t devid;
+	char *devname;
+	struct blkdev_info *next;
+};
+extern struct blkdev_info *sysfs_scan_blkdevs(void);
+extern void free_blkdevs(struct blkdev_info *list);
 extern int sysfs_freeze_array(struct mdinfo *sra);
 extern int sysfs_wait(int fd, int *msec);
+
+/* Waits for a reshape that is let forward in steps through sync_max.
+ * Both sync_completed and sync_action are watched for notifications,
+ * so the waiter wakes as soon as either changes.  Time between two
+ * looks at sync_completed counts as busy if it moved, else as idle;
+ * step_* covers the last reshape_wait_step(), busy/idle all steps.
+ */
+struct reshape_wait {
+	int completed_fd;		/* sync_completed */
+	int action_fd;			/* sync_action */
+	unsigned long long completed;	/* last number read */
+	char action[20];		/* last sync_action read */
+	struct timespec seen;		/* when completed was read */
+	int steps;
+	unsigned long step_busy, step_idle;	/* msec */
+	unsigned long long busy, idle;		/* msec */
+};
+enum reshape_wait_result {
+	RESHAPE_WAIT_ERROR = -1,	/* sync_completed unreadable */
+	RESHAPE_WAIT_REACHED = 0,	/* completed >= target */
+	RESHAPE_WAIT_STOPPED,		/* sync_action is not "reshape" */
+	RESHAPE_WAIT_NONE,		/* sync_completed is "none" */
+	RESHAPE_WAIT_TIMEOUT,
+};
+extern int reshape_wait_open(struct reshape_wait *rw, struct mdinfo *sra);
+extern int reshape_wait_step(struct reshape_wait *rw,
+			     unsigned long long target, int msec);
+extern void reshape_wait_close(struct reshape_wait *rw, char *devnm);
 extern int load_sys(char *path, char *buf, int len);
 extern int zero_disk_range(int fd, unsigned long long sector, size_t count);
 extern int reshape_prepare_fdlist(char *devname,
@@ -764,6 +814,39 @@ extern int restore_stripes(int *dest, unsigned long long *offsets,
 			   int source, unsigned long long read_offset,
 			   unsigned long long start, unsigned long long length,
 			   char *src_buf);
+extern int write_stripes(int *dest, unsigned long long *offsets,
+			 int raid_disks, int chunk_size, int level, int layout,
+			 unsigned long long start, unsigned long long length,
+			 char *src_buf);
+
+/* geo_map() for one period of a layout, as every layout repeats after
+ * at most raid_disks stripes.  ->disk has the disk of each block of a
+ * stripe, P (-1) and Q (-2) first, ->block the inverse with -3 for a
+ * disk that holds no block.
+ */
+struct geo_table {
+	int raid_disks;
+	int data_disks;
+	int period;
+	short *disk;	/* [period][data_disks + 2] */
+	short *block;	/* [period][raid_disks] */
+};
+extern int geo_table_init(struct geo_table *gt, int raid_disks,
+			  int level, int layout);
+extern void geo_table_free(struct geo_table *gt);
+
+static inline int geo_disk(struct geo_table *gt, int block,
+			   unsigned long long stripe)
+{
+	return gt->disk[(stripe % gt->period) * (gt->data_disks + 2) +
+			block + 2];
+}
+
+static inline int geo_block(struct geo_table *gt, int disk,
+			    unsigned long long stripe)
+{
+	return gt->block[(stripe % gt->period) * gt->raid_disks + disk];
+}
 
 #ifndef Sendmail
 #define Sendmail "/usr/lib/sendmail -t"
@@ -779,6 +862,7 @@ extern mapping_t consistency_policies[], sysfs_array_states[];
 
 extern char *map_dev_preferred(int major, int minor, int create,
 			       char *prefer);
+extern void map_dev_flush(void);
 static inline char *map_dev(int major, int minor, int create)
 {
 	return map_dev_preferred(major, minor, create, NULL);
@@ -1034,6 +1118,14 @@ extern struct superswitch {
 	 */
 	int (*get_spare_criteria)(struct supertype *st,
 				  struct spare_criteria *sc);
+	/* Report the parts of the device, other than the superblock
+	 * itself, that hold metadata described by the loaded superblock:
+	 * bitmap, PPL, bad block log or the whole journal.  Each area is
+	 * stored as { offset, length } in bytes, and --zero-superblock
+	 * clears them.  Returns the number of areas stored (up to @max).
+	 */
+	int (*metadata_areas)(struct supertype *st,
+			      unsigned long long (*areas)[2], int max);
 	/* Find somewhere to put a bitmap - possibly auto-size it - and
 	 * update the metadata to record this.  The array may be newly
 	 * created, in which case data_size may be updated, or it might
@@ -1454,6 +1546,7 @@ extern int Assemble(struct supertype *st, char *mddev,
 		    struct mddev_ident *ident,
 		    struct mddev_dev *devlist,
 		    struct context *c);
+extern void assemble_cache_flush(void);
 
 extern int Build(char *mddev, struct mddev_dev *devlist,
 		 struct shape *s, struct context *c);
@@ -1475,13 +1568,17 @@ extern int Monitor(struct mddev_dev *devlist,
 		   struct context *c,
 		   int daemonise, int oneshot,
 		   int dosyslog, char *pidfile, int increments,
-		   int share);
+		   int alert_window, int share);
 
 extern int Kill(char *dev, struct supertype *st, int force, int verbose, int noexcl);
+extern int Kill_devices(char **devs, int cnt, struct supertype *st,
+			int force, int verbose);
 extern int Kill_subarray(char *dev, char *subarray, int verbose);
 extern int Update_subarray(char *dev, char *subarray, char *update, struct mddev_ident *ident, int quiet);
 extern int Wait(char *dev);
 extern int WaitClean(char *dev, int verbose);
+extern int Wait_devices(char **devs, int cnt);
+extern int WaitClean_devices(char **devs, int cnt, int verbose);
 extern int SetAction(char *dev, char *action);
 
 extern int Incremental(struct mddev_dev *devlist, struct context *c,
@@ -1489,6 +1586,8 @@ extern int Incremental(struct mddev_dev *devlist, struct context *c,
 extern void RebuildMap(void);
 extern int IncrementalScan(struct context *c, char *devnm);
 extern int IncrementalRemove(char *devname, char *path, int verbose);
+extern int IncrementalHandoff(char *devname);
+extern int IncrementalListen(struct context *c);
 extern int CreateBitmap(char *filename, int force, char uuid[16],
 			unsigned long chunksize, unsigned long daemon_sleep,
 			unsigned long write_behind,
@@ -1508,6 +1607,10 @@ bitmap_bits(unsigned long long array_size, unsigned long chunksize)
 
 extern int Dump_metadata(char *dev, char *dir, struct context *c,
 			 struct supertype *st);
+extern int Dump_devices(struct mddev_dev *devlist, char *dir,
+			struct context *c, struct supertype *st,
+			int quiet_missing);
+extern int Dump_verify(char *dir, int verbose);
 extern int Restore_metadata(char *dev, char *dir, struct context *c,
 			    struct supertype *st, int only);
 
@@ -1660,6 +1763,8 @@ extern int mdmon_pid(char *devnm);
 extern int check_env(char *name);
 extern __u32 random32(void);
 extern void random_uuid(__u8 *buf);
+extern unsigned long crc32(unsigned long crc, const unsigned char *buf,
+			   unsigned len);
 extern int start_mdmon(char *devnm);
 
 extern int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
@@ -1722,6 +1827,45 @@ extern void set_dlm_hooks(void);
 #define MSEC_TO_NSEC(msec) ((msec) * 1000000)
 #define USEC_TO_NSEC(usec) ((usec) * 1000)
 extern void sleep_for(unsigned int sec, long nsec, bool wake_after_interrupt);
+enum io_op {
+	IO_READ,
+	IO_WRITE,
+	IO_SYNC,
+};
+
+/**
+ * struct io_req - One request for io_batch().
+ * @op: What to do.
+ * @fd: File descriptor.
+ * @buf: Buffer, must be suitably aligned for O_DIRECT fds.
+ * @len: Length in bytes, unused for %IO_SYNC.
+ * @offset: Byte offset, unused for %IO_SYNC.
+ * @ret: Set to bytes transferred (0 for %IO_SYNC) or -errno.
+ */
+struct io_req {
+	enum io_op op;
+	int fd;
+	void *buf;
+	size_t len;
+	unsigned long long offset;
+	ssize_t ret;
+};
+extern int io_batch(struct io_req *reqs, int nr);
+
+#define IO_HIST_BUCKETS 24
+struct io_hist {
+	unsigned long long count[IO_HIST_BUCKETS];
+	unsigned long long total;
+	unsigned long long sum_usec;
+	unsigned long long max_usec;
+};
+extern void io_hist_add(struct io_hist *hist, struct timespec *start);
+extern void io_hist_print(FILE *f, char *name, struct io_hist *hist);
+
+extern void json_print_string(const char *str, size_t len);
+extern int json_scan(char *key, char **names, int cnt,
+		     int (*fn)(char *name, struct context *c, void *arg),
+		     struct context *c, void *arg, int skip_empty);
 
 #define _ROUND_UP(val, base)	(((val) + (base) - 1) & ~(base - 1))
 #define ROUND_UP(val, base)	_ROUND_UP(val, (typeof(val))(base))
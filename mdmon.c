@@ -57,6 +57,7 @@
 #include	<string.h>
 #include	<fcntl.h>
 #include	<dirent.h>
+#include	<sys/eventfd.h>
 #ifdef USE_PTHREADS
 #include	<pthread.h>
 #else
@@ -221,6 +222,36 @@ void remove_pidfile(char *devname)
 	unlink(buf);
 	sprintf(buf, "%s/%s.sock", MDMON_DIR, devname);
 	unlink(buf);
+	sprintf(buf, "%s/%s.stats", MDMON_DIR, devname);
+	unlink(buf);
+}
+
+void write_stats(char *devname)
+{
+	/* Rewrite the stats file by renaming a new copy over it,
+	 * so readers never see a partial file.
+	 */
+	static unsigned long written;
+	unsigned long seq = mdmon_stats.seq;
+	char path[100], tmp[110];
+	FILE *f;
+
+	if (seq == written)
+		return;
+	sprintf(path, "%s/%s.stats", MDMON_DIR, devname);
+	sprintf(tmp, "%s.new", path);
+	f = fopen(tmp, "w");
+	if (!f)
+		return;
+	io_hist_print(f, "commit", &mdmon_stats.commit);
+	fprintf(f, "clean_held=%llu\n", mdmon_stats.clean_held);
+	fprintf(f, "clean_expired=%llu\n", mdmon_stats.clean_expired);
+	fprintf(f, "saved_writes=%llu\n", mdmon_stats.saved_writes);
+	if (fclose(f) != 0 || rename(tmp, path) != 0) {
+		unlink(tmp);
+		return;
+	}
+	written = seq;
 }
 
 static int make_control_sock(char *devname)
@@ -558,6 +589,13 @@ static int mdmon(char *devnm, int must_fork, int takeover)
 
 	mlockall(MCL_CURRENT | MCL_FUTURE);
 
+	mon_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	mgr_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (mon_wake_fd < 0 || mgr_wake_fd < 0) {
+		pr_err("failed to create eventfd: %s\n", strerror(errno));
+		exit(2);
+	}
+
 	if (clone_monitor(container) < 0) {
 		pr_err("failed to start monitor process: %s\n",
 			strerror(errno));
@@ -602,6 +640,14 @@ int restore_stripes(int *dest, unsigned long long *offsets,
 	return 1;
 }
 
+int write_stripes(int *dest, unsigned long long *offsets,
+		  int raid_disks, int chunk_size, int level, int layout,
+		  unsigned long long start, unsigned long long length,
+		  char *src_buf)
+{
+	return 1;
+}
+
 int save_stripes(int *source, unsigned long long *offsets,
 		 int raid_disks, int chunk_size, int level, int layout,
 		 int nwrites, int *dest,
@@ -50,6 +50,15 @@ struct active_array {
 
 	int check_degraded; /* flag set by mon, read by manage */
 	int check_reshape; /* flag set by mon, read by manage */
+
+	/* Marking the metadata clean is held back for clean_hold msecs
+	 * after the kernel reports 'clean', so that a burst of writes
+	 * arriving within that time does not cost a clean and a dirty
+	 * metadata update.  See hold_clean() in monitor.c.
+	 */
+	struct timespec clean_since;
+	unsigned int clean_hold;
+	int clean_pending; /* kernel is clean, metadata still dirty */
 };
 
 /*
@@ -62,8 +71,29 @@ struct active_array {
  * Updates are created and processed by code under the
  * superswitch.  All common code sees them as opaque
  * blobs.
+ *
+ * The queue is a ring with a single producer and a single
+ * consumer, so needs no locking: the manager fills slots and
+ * advances 'head', the monitor processes slots up to 'head' and
+ * advances 'tail', and the manager frees processed slots up to
+ * 'tail'.
+ */
+#define UPDATE_RING_SIZE 64
+struct update_ring {
+	struct metadata_update *slot[UPDATE_RING_SIZE];
+	unsigned int head;	/* next slot to fill, set by manager */
+	unsigned int tail;	/* next slot to process, set by monitor */
+	unsigned int freed;	/* next slot to free, manager only */
+};
+extern struct update_ring update_ring;
+
+/* Each thread sleeps on its own eventfd, and the other
+ * thread wakes it up by writing to it.
  */
-extern struct metadata_update *update_queue, *update_queue_handled;
+extern int mon_wake_fd, mgr_wake_fd;
+extern int mgr_waiting;
+void wake_thread(int efd);
+void drain_wake(int efd);
 
 #define MD_MAJOR 9
 
@@ -72,7 +102,23 @@ extern struct active_array *discard_this;
 extern struct active_array *pending_discard;
 extern struct md_generic_cmd *active_cmd;
 
+/*
+ * Statistics kept by the monitor thread and published by the manager
+ * in MDMON_DIR/<devnm>.stats.  Only the monitor updates them; 'seq'
+ * is bumped after every change so the manager knows when to rewrite
+ * the file.  A torn read only affects what is reported.
+ */
+struct mdmon_stats {
+	unsigned long seq;
+	struct io_hist commit;	/* latency of ->sync_metadata */
+	unsigned long long clean_held;	 /* clean marks held back */
+	unsigned long long clean_expired; /* ... and written after all */
+	unsigned long long saved_writes; /* metadata updates avoided */
+};
+extern struct mdmon_stats mdmon_stats;
+
 void remove_pidfile(char *devname);
+void write_stats(char *devname);
 void do_monitor(struct supertype *container);
 void do_manager(struct supertype *container);
 extern int sigterm;
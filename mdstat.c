@@ -336,37 +336,23 @@ int mdstat_wait(int seconds)
 	return select(maxfd + 1, NULL, NULL, &fds, &tm);
 }
 
-void mdstat_wait_fd(int fd, const sigset_t *sigmask)
+int mdstat_wait_fds(fd_set *rfds, fd_set *wfds, int maxfd,
+		    const struct timespec *tmo, const sigset_t *sigmask)
 {
-	fd_set fds, rfds;
-	int maxfd = 0;
+	/* Wait for a change in mdstat, for one of the fds in 'rfds'
+	 * to become readable or one in 'wfds' writable, or for 'tmo'.
+	 * The sets are updated to show which ones are ready.
+	 */
+	fd_set fds;
 
 	FD_ZERO(&fds);
-	FD_ZERO(&rfds);
 	if (mdstat_fd >= 0)
 		FD_SET(mdstat_fd, &fds);
-
-	if (fd >= 0) {
-		struct stat stb;
-		fstat(fd, &stb);
-		if ((stb.st_mode & S_IFMT) == S_IFREG)
-			/* Must be a /proc or /sys fd, so expect
-			 * POLLPRI
-			 * i.e. an 'exceptional' event.
-			 */
-			FD_SET(fd, &fds);
-		else
-			FD_SET(fd, &rfds);
-
-		if (fd > maxfd)
-			maxfd = fd;
-
-	}
 	if (mdstat_fd > maxfd)
 		maxfd = mdstat_fd;
 
-	pselect(maxfd + 1, &rfds, NULL, &fds,
-		NULL, sigmask);
+	return pselect(maxfd + 1, rfds, wfds, &fds,
+		       tmo, sigmask);
 }
 
 int mddev_busy(char *devnm)
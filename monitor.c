@@ -30,11 +30,6 @@ static char *sync_actions[] = {
 	"idle", "reshape", "resync", "recover", "check", "repair", NULL
 };
 
-enum bb_action {
-	RECORD_BB = 1,
-	COMPARE_BB,
-};
-
 static int write_attr(char *attr, int fd)
 {
 	return write(fd, attr, strlen(attr));
@@ -163,17 +158,19 @@ int read_dev_state(int fd)
 }
 
 int process_ubb(struct active_array *a, struct mdinfo *mdi, const unsigned long
-		long sector, const int length, const char *buf,
-		const int buf_len)
+		long sector, const int length)
 {
 	struct superswitch *ss = a->container->ss;
+	char buf[50];
+	int len;
 
 	/*
 	 * record bad block in metadata first, then acknowledge it to the driver
 	 * via sysfs file
 	 */
+	len = snprintf(buf, sizeof(buf), "%llu %d\n", sector, length);
 	if ((ss->record_bad_block(a, mdi->disk.raid_disk, sector, length)) &&
-	    (write(mdi->bb_fd, buf, buf_len) == buf_len))
+	    (write(mdi->bb_fd, buf, len) == len))
 		return 1;
 
 	/*
@@ -184,131 +181,121 @@ int process_ubb(struct active_array *a, struct mdinfo *mdi, const unsigned long
 	return -1;
 }
 
-int compare_bb(struct active_array *a, struct mdinfo *mdi, const unsigned long
-	       long sector, const unsigned int length, void *arg)
+static int cmp_bb_entry(const void *a, const void *b)
 {
-	struct superswitch *ss = a->container->ss;
-	struct md_bb *bb = (struct md_bb *) arg;
-	int record = 1;
-	int i;
+	const struct md_bb_entry *x = a, *y = b;
 
-	for (i = 0; i < bb->count; i++) {
-		unsigned long long start = bb->entries[i].sector;
-		unsigned long long len = bb->entries[i].length;
+	return x->sector < y->sector ? -1 : x->sector > y->sector;
+}
 
-		/*
-		 * bad block in metadata exactly matches bad block in kernel
-		 * list, just remove it from a list
-		 */
-		if ((start == sector) && (len == length)) {
-			if (i < bb->count - 1)
-				bb->entries[i] = bb->entries[bb->count - 1];
-			bb->count -= 1;
-			record = 0;
-			break;
-		}
-		/*
-		 * bad block in metadata spans bad block in kernel list,
-		 * clear it and record new bad block
-		 */
-		if ((sector >= start) && (sector + length <= start + len)) {
-			ss->clear_bad_block(a, mdi->disk.raid_disk, start, len);
-			break;
-		}
-	}
+/* Index of the last entry starting at or before 'sector', or -1 */
+static int find_bb(struct md_bb *bb, unsigned long long sector)
+{
+	int lo = 0, hi = bb->count - 1, found = -1;
 
-	/* record all bad blocks not in metadata list */
-	if (record && (ss->record_bad_block(a, mdi->disk.raid_disk, sector,
-					     length) <= 0)) {
-		sysfs_set_str(&a->info, mdi, "state", "-external_bbl");
-		return -1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+
+		if (bb->entries[mid].sector <= sector) {
+			found = mid;
+			lo = mid + 1;
+		} else
+			hi = mid - 1;
 	}
+	return found;
+}
 
-	return 1;
+/*
+ * Read a kernel bad block list ("sector length\n" per entry) into 'bb'.
+ * sysfs builds the whole file on the first read, so it is read in one
+ * go and parsed afterwards, rather than an entry at a time.
+ * The kernel stops printing once a page is nearly full, so a list that
+ * long may have more entries: '*more' is set then.
+ * 'bb->entries' must be freed by the caller.
+ */
+static int read_bb_file(int fd, struct md_bb *bb, int *more)
+{
+	int page = sysconf(_SC_PAGESIZE);
+	int size = page;
+	char *buf = xmalloc(size + 1);
+	char *cp, *ep;
+	int n = 0, r, max;
+
+	bb->count = 0;
+	bb->entries = NULL;
+	if (lseek(fd, 0, SEEK_SET) == (off_t) -1)
+		goto bad;
+	while ((r = read(fd, buf + n, size - n)) > 0) {
+		n += r;
+		if (n == size) {
+			size *= 2;
+			buf = xrealloc(buf, size + 1);
+		}
+	}
+	if (r < 0)
+		goto bad;
+	buf[n] = '\0';
+	/* room for less than one more "sector length\n" line */
+	*more = n > page - 32;
+
+	/* every entry takes at least 4 characters */
+	max = n / 4 + 1;
+	bb->entries = xmalloc(max * sizeof(bb->entries[0]));
+	for (cp = buf; *cp && bb->count < max; cp = ep + 1) {
+		struct md_bb_entry *e = &bb->entries[bb->count];
+
+		e->sector = strtoull(cp, &ep, 10);
+		if (ep == cp || *ep != ' ')
+			goto bad;
+		cp = ep + 1;
+		e->length = strtol(cp, &ep, 10);
+		if (ep == cp || *ep != '\n' || e->length <= 0)
+			goto bad;
+		bb->count++;
+	}
+	free(buf);
+	return bb->count;
+bad:
+	free(buf);
+	free(bb->entries);
+	bb->entries = NULL;
+	return -1;
 }
 
-static int read_bb_file(int fd, struct active_array *a, struct mdinfo *mdi,
-			enum bb_action action, void *arg)
+static int process_dev_ubb(struct active_array *a, struct mdinfo *mdi)
 {
-	char buf[30];
-	int n = 0;
+	struct md_bb ubb;
 	int ret = 0;
-	int read_again = 0;
-	int off = 0;
-	int pos = 0;
-	int preserve_pos = (action == RECORD_BB ? 0 : 1);
-
-	if (lseek(fd, 0, SEEK_SET) == (off_t) -1)
-		return -1;
+	int more;
+	int i;
 
+	/* Acknowledged entries leave the list, so if it filled the page,
+	 * read it again for the rest.
+	 */
 	do {
-		read_again = 0;
-		n = read(fd, buf + pos, sizeof(buf) - 1 - pos);
-		if (n < 0)
-			return -1;
-		n += pos;
-
-		buf[n] = '\0';
-		off = 0;
-
-		while (off < n) {
-			unsigned long long sector;
-			int length;
-			char newline;
-			int consumed;
-			int matched;
-			int rc;
-
-			/* kernel sysfs file format: "sector length\n" */
-			matched = sscanf(buf + off, "%llu %d%c%n", &sector,
-					 &length, &newline, &consumed);
-			if ((matched != 3) && (off > 0)) {
-				/* truncated entry, read again */
-				if (preserve_pos) {
-					pos = sizeof(buf) - off - 1;
-					memmove(buf, buf + off, pos);
-				} else {
-					if (lseek(fd, 0, SEEK_SET) ==
-					    (off_t) -1)
-						return -1;
-				}
-				read_again = 1;
-				break;
-			}
-			if (matched != 3)
+		if (read_bb_file(mdi->ubb_fd, &ubb, &more) < 0)
+			return ret ? ret : -1;
+		for (i = 0; i < ubb.count; i++) {
+			if (process_ubb(a, mdi, ubb.entries[i].sector,
+					ubb.entries[i].length) < 0) {
+				free(ubb.entries);
 				return -1;
-			if (newline != '\n')
-				return -1;
-			if (length <= 0)
-				return -1;
-
-			if (action == RECORD_BB)
-				rc = process_ubb(a, mdi, sector, length,
-						  buf + off, consumed);
-			else if (action == COMPARE_BB)
-				rc = compare_bb(a, mdi, sector, length, arg);
-			else
-				rc = -1;
-
-			if (rc < 0)
-				return rc;
-			ret += rc;
-			off += consumed;
+			}
+			ret++;
 		}
-	} while (read_again);
-
+		free(ubb.entries);
+	} while (more && ubb.count);
 	return ret;
 }
 
-static int process_dev_ubb(struct active_array *a, struct mdinfo *mdi)
-{
-	return read_bb_file(mdi->ubb_fd, a, mdi, RECORD_BB, NULL);
-}
-
 static int check_for_cleared_bb(struct active_array *a, struct mdinfo *mdi)
 {
 	struct superswitch *ss = a->container->ss;
-	struct md_bb *bb;
+	int slot = mdi->disk.raid_disk;
+	struct md_bb *bb, kbb;
+	unsigned long long limit = ~0ULL;
+	char *done;
+	int more;
 	int i;
 
 	if (!ss->get_bad_blocks)
@@ -319,28 +306,163 @@ static int check_for_cleared_bb(struct active_array *a, struct mdinfo *mdi)
 	 * acknowledged bad blocks from kernel and compare it against metadata
 	 * list, clear all bad blocks remaining in metadata list
 	 */
-	bb = ss->get_bad_blocks(a, mdi->disk.raid_disk);
+	bb = ss->get_bad_blocks(a, slot);
 	if (!bb)
 		return -1;
 
-	if (read_bb_file(mdi->bb_fd, a, mdi, COMPARE_BB, bb) < 0)
+	if (read_bb_file(mdi->bb_fd, &kbb, &more) < 0)
 		return -1;
-
-	for (i = 0; i < bb->count; i++) {
-		unsigned long long sector = bb->entries[i].sector;
-		int length = bb->entries[i].length;
-
-		ss->clear_bad_block(a, mdi->disk.raid_disk, sector, length);
+	/* entries past the end of a cut short list are not known to
+	 * be cleared, leave them
+	 */
+	if (more && kbb.count)
+		limit = kbb.entries[kbb.count - 1].sector;
+
+	/* sort the metadata list so each kernel entry is a binary search */
+	qsort(bb->entries, bb->count, sizeof(bb->entries[0]), cmp_bb_entry);
+	done = xcalloc(bb->count + 1, 1);
+	for (i = 0; i < kbb.count; i++) {
+		unsigned long long sector = kbb.entries[i].sector;
+		int length = kbb.entries[i].length;
+		int m = find_bb(bb, sector);
+
+		if (m >= 0 && !done[m]) {
+			unsigned long long start = bb->entries[m].sector;
+			unsigned long long len = bb->entries[m].length;
+
+			/*
+			 * bad block in metadata exactly matches bad block in
+			 * kernel list, nothing to do
+			 */
+			if (start == sector && len == (unsigned)length) {
+				done[m] = 1;
+				continue;
+			}
+			/*
+			 * bad block in metadata spans bad block in kernel
+			 * list, clear it and record new bad block
+			 */
+			if (sector + length <= start + len) {
+				ss->clear_bad_block(a, slot, start, len);
+				done[m] = 1;
+			}
+		}
+		/* record all bad blocks not in metadata list */
+		if (ss->record_bad_block(a, slot, sector, length) <= 0) {
+			sysfs_set_str(&a->info, mdi, "state", "-external_bbl");
+			free(done);
+			free(kbb.entries);
+			return -1;
+		}
 	}
 
+	for (i = 0; i < bb->count; i++)
+		if (!done[i] && bb->entries[i].sector <= limit)
+			ss->clear_bad_block(a, slot, bb->entries[i].sector,
+					    bb->entries[i].length);
+
+	free(done);
+	free(kbb.entries);
 	return 0;
 }
 
 static void signal_manager(void)
 {
-	/* tgkill(getpid(), mon_tid, SIGUSR1); */
-	int pid = getpid();
-	syscall(SYS_tgkill, pid, mgr_tid, SIGUSR1);
+	wake_thread(mgr_wake_fd);
+}
+
+struct mdmon_stats mdmon_stats;
+
+/* Upper limit for active_array->clean_hold, in msecs */
+#define CLEAN_HOLD_MAX 10000L
+
+static long msecs_since(struct timespec *since, struct timespec *now)
+{
+	return (now->tv_sec - since->tv_sec) * 1000 +
+		(now->tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static int set_array_state(struct active_array *a, int consistent)
+{
+	if (consistent == 1)
+		a->clean_pending = 0;
+	return a->container->ss->set_array_state(a, consistent);
+}
+
+/*
+ * The kernel reports 'clean' once the array has seen no writes for
+ * safe_mode_delay, and we then mark the metadata clean, only to mark
+ * it dirty again on the next write.  With a bursty workload that is
+ * two metadata updates per burst.  So learn how long the array tends
+ * to stay clean: when it becomes dirty again after less than
+ * CLEAN_HOLD_MAX, hold back the clean mark for twice that gap in
+ * future; when it stayed clean for longer, halve the hold.  A dirty
+ * mark while the clean mark is still held back costs nothing.
+ *
+ * Holding back only ever leaves the metadata dirty for longer, and
+ * never while shutting down or while a sync action is running.
+ */
+static void note_dirty(struct active_array *a)
+{
+	struct timespec now;
+	long gap;
+
+	if (a->prev_state != clean)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	gap = msecs_since(&a->clean_since, &now);
+	if (a->clean_pending) {
+		mdmon_stats.saved_writes += 2;
+		mdmon_stats.seq++;
+		a->clean_pending = 0;
+	} else if (gap < CLEAN_HOLD_MAX)
+		a->clean_hold = min(2 * gap, CLEAN_HOLD_MAX);
+	else
+		a->clean_hold /= 2;
+}
+
+/* Returns 1 if the metadata should not be marked clean yet */
+static int hold_clean(struct active_array *a)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (a->prev_state != clean)
+		a->clean_since = now;
+	if (sigterm || a->clean_hold == 0 || a->curr_action != idle)
+		return 0;
+	if (msecs_since(&a->clean_since, &now) >= a->clean_hold) {
+		if (a->clean_pending) {
+			mdmon_stats.clean_expired++;
+			mdmon_stats.seq++;
+		}
+		return 0;
+	}
+	if (!a->clean_pending) {
+		mdmon_stats.clean_held++;
+		mdmon_stats.seq++;
+		a->clean_pending = 1;
+	}
+	return 1;
+}
+
+/* How long until a held back clean mark is due, in msecs */
+static long clean_hold_left(struct active_array *a)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return max(a->clean_hold - msecs_since(&a->clean_since, &now), 1L);
+}
+
+static void sync_metadata(struct supertype *container)
+{
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	container->ss->sync_metadata(container);
+	io_hist_add(&mdmon_stats.commit, &start);
+	mdmon_stats.seq++;
 }
 
 /* Monitor a set of active md arrays - all of which share the
@@ -462,12 +584,13 @@ static int read_and_act(struct active_array *a, fd_set *fds)
 	if ((a->curr_state == bad_word || a->curr_state <= inactive) &&
 	    a->prev_state > inactive) {
 		/* array has been stopped */
-		a->container->ss->set_array_state(a, 1);
+		set_array_state(a, 1);
 		a->next_state = clear;
 		deactivate = 1;
 	}
 	if (a->curr_state == write_pending) {
-		a->container->ss->set_array_state(a, 0);
+		note_dirty(a);
+		set_array_state(a, 0);
 		a->next_state = active;
 		ret |= ARRAY_DIRTY;
 	}
@@ -478,9 +601,9 @@ static int read_and_act(struct active_array *a, fd_set *fds)
 		a->next_state = clean;
 		ret |= ARRAY_DIRTY;
 	}
-	if ((a->curr_state == clean) || (a->curr_state == broken)) {
-		a->container->ss->set_array_state(a, 1);
-	}
+	if (a->curr_state == broken ||
+	    (a->curr_state == clean && !hold_clean(a)))
+		set_array_state(a, 1);
 	if (a->curr_state == active ||
 	    a->curr_state == suspended)
 		ret |= ARRAY_DIRTY;
@@ -494,7 +617,7 @@ static int read_and_act(struct active_array *a, fd_set *fds)
 			/* explicit request for readonly array.  Leave it alone */
 			;
 		} else {
-			if (a->container->ss->set_array_state(a, 2))
+			if (set_array_state(a, 2))
 				a->next_state = read_auto; /* array is clean */
 			else {
 				a->next_state = active; /* Now active for recovery etc */
@@ -511,7 +634,7 @@ static int read_and_act(struct active_array *a, fd_set *fds)
 		 * until the array goes inactive or readonly though.
 		 * Just check if we need to fiddle spares.
 		 */
-		a->container->ss->set_array_state(a, a->curr_state <= clean);
+		set_array_state(a, a->curr_state <= clean);
 		check_degraded = 1;
 	}
 
@@ -556,7 +679,7 @@ static int read_and_act(struct active_array *a, fd_set *fds)
 			if (mdi->curr_state & DS_BLOCKED)
 				mdi->next_state |= DS_UNBLOCK;
 			if (a->curr_state == read_auto) {
-				a->container->ss->set_array_state(a, 0);
+				set_array_state(a, 0);
 				a->next_state = active;
 			}
 			if (a->curr_state > readonly)
@@ -576,7 +699,7 @@ static int read_and_act(struct active_array *a, fd_set *fds)
 		 * Record the updated position in the metadata
 		 */
 		a->last_checkpoint = sync_completed;
-		a->container->ss->set_array_state(a, a->curr_state <= clean);
+		set_array_state(a, a->curr_state <= clean);
 	} else if ((a->curr_action == idle && a->prev_action == reshape) ||
 		   (a->curr_action == reshape &&
 		    sync_completed > a->last_checkpoint)) {
@@ -603,7 +726,7 @@ static int read_and_act(struct active_array *a, fd_set *fds)
 			     strncmp(buf, "none", 4) == 0)
 				a->last_checkpoint = a->info.component_size;
 		}
-		a->container->ss->set_array_state(a, a->curr_state <= clean);
+		set_array_state(a, a->curr_state <= clean);
 		a->last_checkpoint = sync_completed;
 	}
 
@@ -613,7 +736,7 @@ static int read_and_act(struct active_array *a, fd_set *fds)
 	if (sync_completed >= a->info.component_size)
 		a->last_checkpoint = 0;
 
-	a->container->ss->sync_metadata(a->container);
+	sync_metadata(a->container);
 	dprintf("(%d): state:%s action:%s next(", a->info.container_member,
 		array_states[a->curr_state], sync_actions[a->curr_action]);
 
@@ -745,12 +868,13 @@ int monitor_loop_cnt;
 
 static int wait_and_act(struct supertype *container, int nowait)
 {
-	fd_set rfds;
+	fd_set rfds, wake_fds;
 	int maxfd = 0;
 	struct active_array **aap = &container->arrays;
 	struct active_array *a, **ap;
 	int rv;
 	struct mdinfo *mdi;
+	unsigned int head;
 	static unsigned int dirty_arrays = ~0; /* start at some non-zero value */
 
 	FD_ZERO(&rfds);
@@ -824,10 +948,27 @@ static int wait_and_act(struct supertype *container, int nowait)
 			ts.tv_sec = 0;
 			ts.tv_nsec = 20000000ULL;
 		}
+		for (a = *aap; a ; a = a->next) {
+			long left;
+
+			if (!a->clean_pending)
+				continue;
+			left = clean_hold_left(a);
+			if (left < ts.tv_sec * 1000 + ts.tv_nsec / 1000000) {
+				ts.tv_sec = left / 1000;
+				ts.tv_nsec = (left % 1000) * 1000000;
+			}
+		}
 		sigprocmask(SIG_UNBLOCK, NULL, &set);
 		sigdelset(&set, SIGUSR1);
-		monitor_loop_cnt |= 1;
-		rv = pselect(maxfd+1, NULL, NULL, &rfds, &ts, &set);
+		FD_ZERO(&wake_fds);
+		FD_SET(mon_wake_fd, &wake_fds);
+		__atomic_store_n(&monitor_loop_cnt, monitor_loop_cnt | 1,
+				 __ATOMIC_RELEASE);
+		if (__atomic_load_n(&mgr_waiting, __ATOMIC_SEQ_CST))
+			signal_manager();
+		rv = pselect(max(maxfd, mon_wake_fd) + 1, &wake_fds, NULL,
+			     &rfds, &ts, &set);
 		monitor_loop_cnt += 1;
 		if (rv == -1) {
 			if (errno == EINTR) {
@@ -837,7 +978,8 @@ static int wait_and_act(struct supertype *container, int nowait)
 			} else
 				dprintf("monitor: error %d in pselect\n",
 					errno);
-		}
+		} else if (FD_ISSET(mon_wake_fd, &wake_fds))
+			drain_wake(mon_wake_fd);
 		#ifdef DEBUG
 		else
 			dprint_wake_reasons(&rfds);
@@ -845,16 +987,17 @@ static int wait_and_act(struct supertype *container, int nowait)
 		container->retry_soon = 0;
 	}
 
-	if (update_queue) {
-		struct metadata_update *this;
+	head = __atomic_load_n(&update_ring.head, __ATOMIC_ACQUIRE);
+	if (update_ring.tail != head) {
+		unsigned int i;
 
-		for (this = update_queue; this ; this = this->next)
-			container->ss->process_update(container, this);
+		for (i = update_ring.tail; i != head; i++)
+			container->ss->process_update(container,
+				update_ring.slot[i % UPDATE_RING_SIZE]);
 
-		update_queue_handled = update_queue;
-		update_queue = NULL;
+		__atomic_store_n(&update_ring.tail, head, __ATOMIC_RELEASE);
 		signal_manager();
-		container->ss->sync_metadata(container);
+		sync_metadata(container);
 	}
 
 	rv = 0;
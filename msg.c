@@ -32,6 +32,7 @@
 #include "mdmon.h"
 
 static const __u32 start_magic = 0x5a5aa5a5;
+static const __u32 start_magic_id = 0x5a5aa5a6; /* followed by a request ID */
 static const __u32 end_magic = 0xa5a55a5a;
 
 static int send_buf(int fd, const void* buf, int len, int tmo)
@@ -47,7 +48,7 @@ static int send_buf(int fd, const void* buf, int len, int tmo)
 		rv = select(fd+1, NULL, &set, NULL, ptmo);
 		if (rv <= 0)
 			return -1;
-		rv = write(fd, buf, len);
+		rv = send(fd, buf, len, MSG_NOSIGNAL);
 		if (rv <= 0)
 			return -1;
 		len -= rv;
@@ -78,28 +79,51 @@ static int recv_buf(int fd, void* buf, int len, int tmo)
 	return 0;
 }
 
-int send_message(int fd, struct metadata_update *msg, int tmo)
+/*
+ * A message is framed as
+ *	start magic, [request ID,] length, data, end magic
+ * The request ID is only present when the start magic is
+ * start_magic_id.  mdmon answers a request in the framing it was
+ * sent in, so clients may pipeline requests and match the replies
+ * by ID, while older clients see no difference.  ID 0 selects the
+ * framing without an ID.
+ */
+int send_message_id(int fd, struct metadata_update *msg, __u32 id, int tmo)
 {
 	__s32 len = msg->len;
 	int rv;
 
-	rv = send_buf(fd, &start_magic, 4, tmo);
+	if (id) {
+		rv = send_buf(fd, &start_magic_id, 4, tmo);
+		rv = rv ?: send_buf(fd, &id, 4, tmo);
+	} else
+		rv = send_buf(fd, &start_magic, 4, tmo);
 	rv = rv ?: send_buf(fd, &len, 4, tmo);
 	if (len > 0)
 		rv = rv ?: send_buf(fd, msg->buf, msg->len, tmo);
-	rv = send_buf(fd, &end_magic, 4, tmo);
+	rv = rv ?: send_buf(fd, &end_magic, 4, tmo);
 
 	return rv;
 }
 
-int receive_message(int fd, struct metadata_update *msg, int tmo)
+int send_message(int fd, struct metadata_update *msg, int tmo)
+{
+	return send_message_id(fd, msg, 0, tmo);
+}
+
+int receive_message_id(int fd, struct metadata_update *msg, __u32 *id,
+		       int tmo)
 {
 	__u32 magic;
 	__s32 len;
 	int rv;
 
+	*id = 0;
 	rv = recv_buf(fd, &magic, 4, tmo);
-	if (rv < 0 || magic != start_magic)
+	if (rv < 0 || (magic != start_magic && magic != start_magic_id))
+		return -1;
+	if (magic == start_magic_id &&
+	    (recv_buf(fd, id, 4, tmo) < 0 || *id == 0))
 		return -1;
 	rv = recv_buf(fd, &len, 4, tmo);
 	if (rv < 0 || len > MSG_MAX_LEN)
@@ -122,6 +146,133 @@ int receive_message(int fd, struct metadata_update *msg, int tmo)
 	return 0;
 }
 
+int receive_message(int fd, struct metadata_update *msg, int tmo)
+{
+	__u32 id;
+
+	return receive_message_id(fd, msg, &id, tmo);
+}
+
+/**
+ * parse_message() - Take one message from a receive buffer.
+ * @buf: Data received so far.
+ * @len: Amount of data in @buf.
+ * @msg: Filled in with the message; msg->buf is allocated.
+ * @id: Filled in with the request ID, or 0.
+ *
+ * For servers which do their own non-blocking reads.
+ *
+ * Return: number of bytes used from @buf, 0 if @buf does not yet
+ * hold a whole message, or -1 if it does not hold a valid one.
+ */
+int parse_message(char *buf, int len, struct metadata_update *msg, __u32 *id)
+{
+	int hdr = 8;
+	__u32 magic;
+	__s32 mlen;
+
+	if (len < 4)
+		return 0;
+	memcpy(&magic, buf, 4);
+	if (magic == start_magic_id)
+		hdr = 12;
+	else if (magic != start_magic)
+		return -1;
+	if (len < hdr)
+		return 0;
+	*id = 0;
+	if (hdr == 12) {
+		memcpy(id, buf + 4, 4);
+		if (*id == 0)
+			return -1;
+	}
+	memcpy(&mlen, buf + hdr - 4, 4);
+	if (mlen > MSG_MAX_LEN)
+		return -1;
+	if (len < hdr + max(mlen, 0) + 4)
+		return 0;
+	memcpy(&magic, buf + hdr + max(mlen, 0), 4);
+	if (magic != end_magic)
+		return -1;
+	msg->len = mlen;
+	msg->buf = NULL;
+	if (mlen > 0) {
+		msg->buf = xmalloc(mlen);
+		memcpy(msg->buf, buf + hdr, mlen);
+	}
+	return hdr + max(mlen, 0) + 4;
+}
+
+/**
+ * format_message() - Frame a message into a buffer.
+ * @buf: Where to put it, or NULL to just return the size.
+ * @msg: Message to send.
+ * @id: Request ID, or 0.
+ *
+ * Return: number of bytes the framed message takes.
+ */
+int format_message(char *buf, struct metadata_update *msg, __u32 id)
+{
+	int len = max(msg->len, 0);
+	int hdr = id ? 12 : 8;
+
+	if (buf) {
+		memcpy(buf, id ? &start_magic_id : &start_magic, 4);
+		if (id)
+			memcpy(buf + 4, &id, 4);
+		memcpy(buf + hdr - 4, &msg->len, 4);
+		if (len)
+			memcpy(buf + hdr, msg->buf, len);
+		memcpy(buf + hdr + len, &end_magic, 4);
+	}
+	return hdr + len + 4;
+}
+
+/**
+ * send_updates() - Send a list of metadata updates to mdmon.
+ * @fd: Socket connected to mdmon.
+ * @updates: Updates to send.
+ * @tmo: Timeout in seconds, or 0.
+ *
+ * All updates and a final ping are sent before any reply is read,
+ * each with its own request ID, so mdmon can queue them to the
+ * monitor together.
+ *
+ * Return: 0 if every update and the ping were acknowledged, in order.
+ * -1 if the first one was not (e.g. because mdmon predates request IDs),
+ * so nothing was done and the updates may be sent again another way.
+ * -2 if only some were acknowledged: the others may or may not have
+ * been applied, and must not be sent again.
+ */
+int send_updates(int fd, struct metadata_update *updates, int tmo)
+{
+	struct metadata_update *mu, msg = { .len = 0 };
+	__u32 sent = 0, rid, id;
+
+	for (mu = updates; mu; mu = mu->next) {
+		if (send_message_id(fd, mu, sent + 1, tmo) < 0)
+			break;
+		sent++;
+	}
+	if (!mu && send_message_id(fd, &msg, sent + 1, tmo) == 0)
+		sent++;
+
+	/* replies come back in order */
+	for (rid = 1; rid <= sent; rid++) {
+		if (receive_message_id(fd, &msg, &id, tmo) != 0)
+			break;
+		if (msg.len > 0)
+			free(msg.buf);
+		if (id != rid)
+			break;
+	}
+	if (rid == 1)
+		return -1;
+	if (rid <= sent || mu)
+		return -2;
+	return 0;
+}
+
 int ack(int fd, int tmo)
 {
 	struct metadata_update msg = { .len = 0 };
@@ -215,6 +366,57 @@ int ping_monitor(char *devname)
 	return err;
 }
 
+/**
+ * begin_container_batch() - Have mdmon hold back container changes.
+ * @container: Container name.
+ *
+ * Until end_container_batch(), mdmon does not act on devices being
+ * added to or removed from @container, so that they all go into a
+ * single metadata update.
+ *
+ * Return: socket to pass to end_container_batch(), or -1 if mdmon
+ * did not confirm the batch (e.g. because it predates batches).
+ */
+int begin_container_batch(char *container)
+{
+	struct metadata_update msg = { .len = MSG_BATCH_BEGIN };
+	int sfd = connect_monitor(container);
+
+	if (sfd < 0)
+		return -1;
+	if (send_message(sfd, &msg, 20) != 0 ||
+	    receive_message(sfd, &msg, 20) != 0) {
+		close(sfd);
+		return -1;
+	}
+	if (msg.len > 0)
+		free(msg.buf);
+	if (msg.len != MSG_BATCH_BEGIN) {
+		close(sfd);
+		return -1;
+	}
+	return sfd;
+}
+
+/**
+ * end_container_batch() - Let mdmon record the changes of a batch.
+ * @sfd: Socket from begin_container_batch().
+ * @container: Container name.
+ *
+ * Returns once the metadata update has been committed.
+ */
+void end_container_batch(int sfd, char *container)
+{
+	struct metadata_update msg = { .len = MSG_BATCH_END };
+
+	if (sfd < 0)
+		return;
+	if (send_message(sfd, &msg, 20) == 0)
+		wait_reply(sfd, 20);
+	close(sfd);
+	ping_monitor(container);
+}
+
 static char *ping_monitor_version(char *devname)
 {
 	int sfd = connect_monitor(devname);
@@ -22,6 +22,14 @@ struct metadata_update;
 
 extern int receive_message(int fd, struct metadata_update *msg, int tmo);
 extern int send_message(int fd, struct metadata_update *msg, int tmo);
+extern int receive_message_id(int fd, struct metadata_update *msg, __u32 *id,
+			      int tmo);
+extern int send_message_id(int fd, struct metadata_update *msg, __u32 id,
+			   int tmo);
+extern int parse_message(char *buf, int len, struct metadata_update *msg,
+			 __u32 *id);
+extern int format_message(char *buf, struct metadata_update *msg, __u32 id);
+extern int send_updates(int fd, struct metadata_update *updates, int tmo);
 extern int ack(int fd, int tmo);
 extern int wait_reply(int fd, int tmo);
 extern int connect_monitor(char *devname);
@@ -33,5 +41,17 @@ extern void unblock_monitor(char *container, const int unfreeze);
 extern int fping_monitor(int sock);
 extern int ping_manager(char *devname);
 extern void flush_mdmon(char *container);
+extern int begin_container_batch(char *container);
+extern void end_container_batch(int sfd, char *container);
 
 #define MSG_MAX_LEN (4*1024*1024)
+
+/* Messages without data: length 0 pings the monitor, -1 the manager.
+ * Between MSG_BATCH_BEGIN and MSG_BATCH_END on one connection mdmon
+ * leaves changes to the container's members alone, and then records
+ * all of them in one metadata update.  mdmon confirms MSG_BATCH_BEGIN
+ * with a reply of that length.  Older mdmon drop these messages and
+ * just acknowledge them with length 0, so there is no batch then.
+ */
+#define MSG_BATCH_BEGIN (-2)
+#define MSG_BATCH_END (-3)
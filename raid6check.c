@@ -349,6 +349,7 @@ int check_stripes(struct mdinfo *info, int *source, unsigned long long *offsets,
 	int i, j;
 	int diskP, diskQ, diskD;
 	int err = 0;
+	struct geo_table gt = { .disk = NULL, .block = NULL };
 
 	extern int tables_ready;
 
@@ -361,6 +362,12 @@ int check_stripes(struct mdinfo *info, int *source, unsigned long long *offsets,
 	blocks += 2;
 	blocks_page += 2;
 
+	if (geo_table_init(&gt, raid_disks, level, layout) != 0) {
+		fprintf(stderr, "Unknown layout %d\n", layout);
+		err = -1;
+		goto exitCheck;
+	}
+
 	memset(zero, 0, chunk_size);
 	for ( i = 0 ; i < raid_disks ; i++)
 		stripes[i] = stripe_buf + i * chunk_size;
@@ -396,11 +403,11 @@ int check_stripes(struct mdinfo *info, int *source, unsigned long long *offsets,
 			}
 		}
 
-		diskP = geo_map(-1, start, raid_disks, level, layout);
+		diskP = geo_disk(&gt, -1, start);
 		block_index_for_slot[-1] = diskP;
 		blocks[-1] = stripes[diskP];
 
-		diskQ = geo_map(-2, start, raid_disks, level, layout);
+		diskQ = geo_disk(&gt, -2, start);
 		block_index_for_slot[-2] = diskQ;
 		blocks[-2] = stripes[diskQ];
 
@@ -495,6 +502,7 @@ int check_stripes(struct mdinfo *info, int *source, unsigned long long *offsets,
 
 exitCheck:
 
+	geo_table_free(&gt);
 	free(stripe_buf);
 	free(stripes);
 	free(blocks-2);
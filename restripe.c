@@ -24,6 +24,8 @@
 
 #include "mdadm.h"
 #include <stdint.h>
+#include <limits.h>
+#include <sys/uio.h>
 
 /* To restripe, we read from old geometry to a buffer, and
  * read from buffer to new geometry.
@@ -215,6 +217,60 @@ int geo_map(int block, unsigned long long stripe, int raid_disks,
 	return -1;
 }
 
+/**
+ * geo_table_init() - tabulate geo_map() for a layout.
+ * @gt: table to fill in, release with geo_table_free().
+ *
+ * Return: 0, or -1 if the layout is not known to geo_map().
+ */
+int geo_table_init(struct geo_table *gt, int raid_disks, int level, int layout)
+{
+	int parity = level == 0 ? 0 : level <= 5 ? 1 : 2;
+	int stride;
+	int s, b;
+
+	gt->raid_disks = raid_disks;
+	gt->data_disks = raid_disks - parity;
+	gt->period = raid_disks;
+	/* the '_6' layouts rotate over all but the Q disk */
+	if (level == 6 && layout >= ALGORITHM_LEFT_ASYMMETRIC_6 &&
+	    layout <= ALGORITHM_RIGHT_SYMMETRIC_6)
+		gt->period = raid_disks - 1;
+	stride = gt->data_disks + 2;
+	gt->disk = xmalloc(gt->period * stride * sizeof(*gt->disk));
+	gt->block = xmalloc(gt->period * raid_disks * sizeof(*gt->block));
+
+	for (s = 0; s < gt->period; s++) {
+		short *disk = gt->disk + s * stride;
+		short *block = gt->block + s * raid_disks;
+
+		for (b = 0; b < raid_disks; b++)
+			block[b] = -3;
+		for (b = -2; b < gt->data_disks; b++) {
+			int d = -1;
+
+			if (b >= -parity) {
+				d = geo_map(b, s, raid_disks, level, layout);
+				if (d < 0 || d >= raid_disks) {
+					geo_table_free(gt);
+					return -1;
+				}
+				block[d] = b;
+			}
+			disk[b + 2] = d;
+		}
+	}
+	return 0;
+}
+
+void geo_table_free(struct geo_table *gt)
+{
+	free(gt->disk);
+	free(gt->block);
+	gt->disk = NULL;
+	gt->block = NULL;
+}
+
 int is_ddf(int layout)
 {
 	switch (layout)
@@ -260,6 +316,21 @@ void qsyndrome(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int size)
 	}
 }
 
+/* Order the data blocks of a stripe the way md feeds them to the
+ * RAID6 syndrome: in device order from the one after 'q', leaving out
+ * 'p', which need not sit right before 'q' (e.g. the *_6 layouts).
+ */
+static void syndrome_order(char **blocks, char **stripes, int raid_disks,
+			   int pdisk, int qdisk)
+{
+	int d = qdisk;
+	int i = 0;
+
+	while ((d = (d + 1) % raid_disks) != qdisk)
+		if (d != pdisk)
+			blocks[i++] = stripes[d];
+}
+
 /*
  * The following was taken from linux/drivers/md/mktables.c, and modified
  * to create in-memory tables rather than C code
@@ -550,6 +621,8 @@ int save_stripes(int *source, unsigned long long *offsets,
 	int disk;
 	int i;
 	unsigned long long length_test;
+	struct geo_table gt;
+	int rv = -1;
 
 	if (!tables_ready)
 		make_tables();
@@ -567,19 +640,21 @@ int save_stripes(int *source, unsigned long long *offsets,
 			length_test);
 		abort();
 	}
+	if (geo_table_init(&gt, raid_disks, level, layout))
+		abort();
 
 	while (length > 0) {
 		int failed = 0;
 		int fdisk[3], fblock[3];
+		unsigned long long stripe = start/chunk_size/data_disks;
+
 		for (disk = 0; disk < raid_disks ; disk++) {
 			unsigned long long offset;
 			int dnum;
 
-			offset = (start/chunk_size/data_disks)*chunk_size;
-			dnum = geo_map(disk < data_disks ? disk : data_disks - disk - 1,
-				       start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			if (dnum < 0) abort();
+			offset = stripe * chunk_size;
+			dnum = geo_disk(&gt, disk < data_disks ? disk : data_disks - disk - 1,
+					stripe);
 			if (source[dnum] < 0 ||
 			    lseek64(source[dnum],
 				    offsets[dnum] + offset, 0) < 0 ||
@@ -608,16 +683,14 @@ int save_stripes(int *source, unsigned long long *offsets,
 				   bufs, data_disks, chunk_size);
 		} else if (failed > 2 || level != 6)
 			/* too much failure */
-			return -1;
+			goto out;
 		else {
 			/* RAID6 computations needed. */
 			uint8_t *bufs[data_disks+4];
 			int qdisk;
 			int syndrome_disks;
-			disk = geo_map(-1, start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			qdisk = geo_map(-2, start/chunk_size/data_disks,
-				       raid_disks, level, layout);
+			disk = geo_disk(&gt, -1, stripe);
+			qdisk = geo_disk(&gt, -2, stripe);
 			if (is_ddf(layout)) {
 				/* q over 'raid_disks' blocks, in device order.
 				 * 'p' and 'q' get to be all zero
@@ -625,9 +698,7 @@ int save_stripes(int *source, unsigned long long *offsets,
 				for (i = 0; i < raid_disks; i++)
 					bufs[i] = zero;
 				for (i = 0; i < data_disks; i++) {
-					int dnum = geo_map(i,
-							   start/chunk_size/data_disks,
-							   raid_disks, level, layout);
+					int dnum = geo_disk(&gt, i, stripe);
 					int snum;
 					/* i is the logical block number, so is index to 'buf'.
 					 * dnum is physical disk number
@@ -649,11 +720,7 @@ int save_stripes(int *source, unsigned long long *offsets,
 					int dnum = (qdisk + 1 + j) % raid_disks;
 					if (dnum == disk || dnum == qdisk)
 						continue;
-					for (i = 0; i < data_disks; i++)
-						if (geo_map(i,
-							    start/chunk_size/data_disks,
-							    raid_disks, level, layout) == dnum)
-							break;
+					i = geo_block(&gt, dnum, stripe);
 					/* i is the logical block number, so is index to 'buf'.
 					 * dnum is physical disk number
 					 * snum is syndrome disk for which 0 is immediately after Q
@@ -687,7 +754,7 @@ int save_stripes(int *source, unsigned long long *offsets,
 		if (dest) {
 			for (i = 0; i < nwrites; i++)
 				if (write(dest[i], buf, len) != len)
-					return -1;
+					goto out;
 		} else {
 			/* build next stripe in buffer */
 			buf += len;
@@ -695,7 +762,10 @@ int save_stripes(int *source, unsigned long long *offsets,
 		length -= len;
 		start += len;
 	}
-	return 0;
+	rv = 0;
+out:
+	geo_table_free(&gt);
+	return rv;
 }
 
 /* Restore data:
@@ -718,6 +788,7 @@ int restore_stripes(int *dest, unsigned long long *offsets,
 	char *stripe_buf;
 	char **stripes = xmalloc(raid_disks * sizeof(char*));
 	char **blocks = xmalloc(raid_disks * sizeof(char*));
+	struct geo_table gt = { .disk = NULL, .block = NULL };
 	int i;
 	int rv;
 
@@ -738,10 +809,15 @@ int restore_stripes(int *dest, unsigned long long *offsets,
 		rv = -2;
 		goto abort;
 	}
+	if (geo_table_init(&gt, raid_disks, level, layout)) {
+		rv = -2;
+		goto abort;
+	}
 	for (i = 0; i < raid_disks; i++)
 		stripes[i] = stripe_buf + i * chunk_size;
 	while (length > 0) {
 		unsigned int len = data_disks * chunk_size;
+		unsigned long long stripe = start/chunk_size/data_disks;
 		unsigned long long offset;
 		int disk, qdisk;
 		int syndrome_disks;
@@ -750,8 +826,7 @@ int restore_stripes(int *dest, unsigned long long *offsets,
 			goto abort;
 		}
 		for (i = 0; i < data_disks; i++) {
-			int disk = geo_map(i, start/chunk_size/data_disks,
-					   raid_disks, level, layout);
+			int disk = geo_disk(&gt, i, stripe);
 			if (src_buf == NULL) {
 				/* read from file */
 				if (lseek64(source, read_offset, 0) !=
@@ -774,21 +849,18 @@ int restore_stripes(int *dest, unsigned long long *offsets,
 			read_offset += chunk_size;
 		}
 		/* We have the data, now do the parity */
-		offset = (start/chunk_size/data_disks) * chunk_size;
+		offset = stripe * chunk_size;
 		switch (level) {
 		case 4:
 		case 5:
-			disk = geo_map(-1, start/chunk_size/data_disks,
-					   raid_disks, level, layout);
+			disk = geo_disk(&gt, -1, stripe);
 			for (i = 0; i < data_disks; i++)
 				blocks[i] = stripes[(disk+1+i) % raid_disks];
 			xor_blocks(stripes[disk], blocks, data_disks, chunk_size);
 			break;
 		case 6:
-			disk = geo_map(-1, start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			qdisk = geo_map(-2, start/chunk_size/data_disks,
-				       raid_disks, level, layout);
+			disk = geo_disk(&gt, -1, stripe);
+			qdisk = geo_disk(&gt, -2, stripe);
 			if (is_ddf(layout)) {
 				/* q over 'raid_disks' blocks, in device order.
 				 * 'p' and 'q' get to be all zero
@@ -801,10 +873,11 @@ int restore_stripes(int *dest, unsigned long long *offsets,
 				syndrome_disks = raid_disks;
 			} else {
 				/* for md, q is over 'data_disks' blocks,
-				 * starting immediately after 'q'
+				 * starting immediately after 'q' and
+				 * skipping 'p'
 				 */
-				for (i = 0; i < data_disks; i++)
-					blocks[i] = stripes[(qdisk+1+i) % raid_disks];
+				syndrome_order(blocks, stripes, raid_disks,
+					       disk, qdisk);
 
 				syndrome_disks = data_disks;
 			}
@@ -833,12 +906,145 @@ int restore_stripes(int *dest, unsigned long long *offsets,
 	rv = 0;
 
 abort:
+	geo_table_free(&gt);
 	free(stripe_buf);
 	free(stripes);
 	free(blocks);
 	return rv;
 }
 
+/**
+ * write_stripes() - write a buffer out in a RAID geometry.
+ * @dest: member fds, negative ones are skipped.
+ * @offsets: byte offset of the data area on each member.
+ * @start: array byte offset of the first byte in @src_buf.
+ * @length: bytes to write, a multiple of the data stripe size.
+ * @src_buf: data in array order.
+ *
+ * Like restore_stripes() from a buffer, but the data chunks are written
+ * straight from @src_buf: the layout of each member is worked out once
+ * for the whole range and written with one pwritev() per member.  Only
+ * parity is computed into a separate buffer.  @src_buf and @chunk_size
+ * must suit O_DIRECT.
+ *
+ * Return: 0 on success, -1 on write error, -2 if out of memory,
+ * -3 if @length is not a whole number of stripes.
+ */
+int write_stripes(int *dest, unsigned long long *offsets,
+		  int raid_disks, int chunk_size, int level, int layout,
+		  unsigned long long start, unsigned long long length,
+		  char *src_buf)
+{
+	int data_disks = raid_disks - (level == 0 ? 0 : level <= 5 ? 1 : 2);
+	int parity_disks = raid_disks - data_disks;
+	unsigned long long stripe0 = start / chunk_size / data_disks;
+	unsigned long long rows = length / chunk_size / data_disks;
+	char **stripes = xmalloc(raid_disks * sizeof(char *));
+	char **blocks = xmalloc(raid_disks * sizeof(char *));
+	struct geo_table gt = { .disk = NULL, .block = NULL };
+	struct iovec *iov = NULL;
+	char *parity_buf = NULL;
+	unsigned long long r;
+	int i;
+	int rv = -2;
+
+	if (length % ((unsigned long long)data_disks * chunk_size)) {
+		rv = -3;
+		goto abort;
+	}
+	if (geo_table_init(&gt, raid_disks, level, layout))
+		goto abort;
+	if (parity_disks &&
+	    posix_memalign((void **)&parity_buf, 4096,
+			   rows * parity_disks * chunk_size))
+		goto abort;
+	iov = calloc(raid_disks * rows, sizeof(*iov));
+	if (!iov)
+		goto abort;
+	if (level == 6 && is_ddf(layout))
+		ensure_zero_has_size(chunk_size);
+
+	/* iov[disk * rows + r] is what goes to 'disk' in row 'r' */
+	for (r = 0; r < rows; r++) {
+		unsigned long long stripe = stripe0 + r;
+		char *parity = parity_buf ?
+			parity_buf + r * parity_disks * chunk_size : NULL;
+		int disk, qdisk;
+
+		for (i = 0; i < data_disks; i++) {
+			disk = geo_disk(&gt, i, stripe);
+			stripes[disk] = src_buf +
+				(r * data_disks + i) * chunk_size;
+		}
+		switch (level) {
+		case 4:
+		case 5:
+			disk = geo_disk(&gt, -1, stripe);
+			stripes[disk] = parity;
+			for (i = 0; i < data_disks; i++)
+				blocks[i] = stripes[(disk+1+i) % raid_disks];
+			xor_blocks(stripes[disk], blocks, data_disks,
+				   chunk_size);
+			break;
+		case 6:
+			disk = geo_disk(&gt, -1, stripe);
+			qdisk = geo_disk(&gt, -2, stripe);
+			stripes[disk] = parity;
+			stripes[qdisk] = parity + chunk_size;
+			if (is_ddf(layout)) {
+				for (i = 0; i < raid_disks; i++)
+					if (i == disk || i == qdisk)
+						blocks[i] = (char *)zero;
+					else
+						blocks[i] = stripes[i];
+				qsyndrome((uint8_t *)stripes[disk],
+					  (uint8_t *)stripes[qdisk],
+					  (uint8_t **)blocks,
+					  raid_disks, chunk_size);
+			} else {
+				syndrome_order(blocks, stripes, raid_disks,
+					       disk, qdisk);
+				qsyndrome((uint8_t *)stripes[disk],
+					  (uint8_t *)stripes[qdisk],
+					  (uint8_t **)blocks,
+					  data_disks, chunk_size);
+			}
+			break;
+		}
+		for (i = 0; i < raid_disks; i++) {
+			iov[i * rows + r].iov_base = stripes[i];
+			iov[i * rows + r].iov_len = chunk_size;
+		}
+	}
+
+	rv = 0;
+	for (i = 0; i < raid_disks && rv == 0; i++) {
+		unsigned long long offset = offsets[i] + stripe0 * chunk_size;
+
+		if (dest[i] < 0)
+			continue;
+		for (r = 0; r < rows; ) {
+			int cnt = min(rows - r, (unsigned long long)IOV_MAX);
+			ssize_t len = (ssize_t)cnt * chunk_size;
+
+			if (pwritev(dest[i], iov + i * rows + r, cnt,
+				    offset + r * chunk_size) != len) {
+				rv = -1;
+				break;
+			}
+			r += cnt;
+		}
+	}
+
+abort:
+	geo_table_free(&gt);
+	free(parity_buf);
+	free(iov);
+	free(stripes);
+	free(blocks);
+	return rv;
+}
+
 #ifdef MAIN
 
 int test_stripes(int *source, unsigned long long *offsets,
@@ -855,9 +1061,12 @@ int test_stripes(int *source, unsigned long long *offsets,
 	int i;
 	int diskP, diskQ;
 	int data_disks = raid_disks - (level == 5 ? 1: 2);
+	struct geo_table gt;
 
 	if (!tables_ready)
 		make_tables();
+	if (geo_table_init(&gt, raid_disks, level, layout))
+		return -1;
 
 	for ( i = 0 ; i < raid_disks ; i++)
 		stripes[i] = stripe_buf + i * chunk_size;
@@ -874,26 +1083,24 @@ int test_stripes(int *source, unsigned long long *offsets,
 				free(blocks);
 				free(stripes);
 				free(stripe_buf);
+				geo_table_free(&gt);
 				return -1;
 			}
 		}
 		for (i = 0 ; i < data_disks ; i++) {
-			int disk = geo_map(i, start/chunk_size, raid_disks,
-					   level, layout);
+			int disk = geo_disk(&gt, i, start/chunk_size);
 			blocks[i] = stripes[disk];
 			printf("%d->%d\n", i, disk);
 		}
 		switch(level) {
 		case 6:
 			qsyndrome(p, q, (uint8_t**)blocks, data_disks, chunk_size);
-			diskP = geo_map(-1, start/chunk_size, raid_disks,
-				       level, layout);
+			diskP = geo_disk(&gt, -1, start/chunk_size);
 			if (memcmp(p, stripes[diskP], chunk_size) != 0) {
 				printf("P(%d) wrong at %llu\n", diskP,
 				       start / chunk_size);
 			}
-			diskQ = geo_map(-2, start/chunk_size, raid_disks,
-				       level, layout);
+			diskQ = geo_disk(&gt, -2, start/chunk_size);
 			if (memcmp(q, stripes[diskQ], chunk_size) != 0) {
 				printf("Q(%d) wrong at %llu\n", diskQ,
 				       start / chunk_size);
@@ -912,9 +1119,175 @@ int test_stripes(int *source, unsigned long long *offsets,
 		length -= chunk_size;
 		start += chunk_size;
 	}
+	geo_table_free(&gt);
 	return 0;
 }
 
+static const int layouts5[] = {
+	ALGORITHM_LEFT_ASYMMETRIC, ALGORITHM_RIGHT_ASYMMETRIC,
+	ALGORITHM_LEFT_SYMMETRIC, ALGORITHM_RIGHT_SYMMETRIC,
+	ALGORITHM_PARITY_0, ALGORITHM_PARITY_N,
+};
+static const int layouts6[] = {
+	ALGORITHM_LEFT_ASYMMETRIC, ALGORITHM_RIGHT_ASYMMETRIC,
+	ALGORITHM_LEFT_SYMMETRIC, ALGORITHM_RIGHT_SYMMETRIC,
+	ALGORITHM_PARITY_0, ALGORITHM_PARITY_N,
+	ALGORITHM_ROTATING_ZERO_RESTART, ALGORITHM_ROTATING_N_RESTART,
+	ALGORITHM_ROTATING_N_CONTINUE,
+	ALGORITHM_LEFT_ASYMMETRIC_6, ALGORITHM_RIGHT_ASYMMETRIC_6,
+	ALGORITHM_LEFT_SYMMETRIC_6, ALGORITHM_RIGHT_SYMMETRIC_6,
+	ALGORITHM_PARITY_0_6,
+};
+static const int levels[] = { 0, 4, 5, 6 };
+
+static const int *level_layouts(int level, unsigned int *nlayouts)
+{
+	*nlayouts = level == 6 ? ARRAY_SIZE(layouts6) :
+		level == 5 ? ARRAY_SIZE(layouts5) : 1;
+	return level == 6 ? layouts6 : layouts5;
+}
+
+/* Check geo_table against geo_map() for every layout it knows */
+int test_geo_tables(void)
+{
+	int errors = 0;
+	unsigned int l, n;
+	int disks;
+
+	for (l = 0; l < ARRAY_SIZE(levels); l++) {
+		int level = levels[l];
+		int parity = level == 0 ? 0 : level <= 5 ? 1 : 2;
+		unsigned int nlayouts;
+		const int *layouts = level_layouts(level, &nlayouts);
+
+		for (n = 0; n < nlayouts; n++)
+		for (disks = parity + 2; disks <= 32; disks++) {
+			int layout = level == 0 || level == 4 ? 0 : layouts[n];
+			struct geo_table gt;
+			unsigned long long stripe;
+			int b;
+
+			if (geo_table_init(&gt, disks, level, layout) != 0) {
+				printf("level %d layout %d disks %d: no table\n",
+				       level, layout, disks);
+				errors++;
+				continue;
+			}
+			for (stripe = 0; stripe < 3ULL * disks * disks; stripe++)
+				for (b = -parity; b < disks - parity; b++) {
+					int d = geo_map(b, stripe, disks,
+							level, layout);
+
+					if (geo_disk(&gt, b, stripe) == d &&
+					    geo_block(&gt, d, stripe) == b)
+						continue;
+					printf("level %d layout %d disks %d stripe %llu block %d: %d/%d\n",
+					       level, layout, disks, stripe, b,
+					       geo_disk(&gt, b, stripe), d);
+					errors++;
+				}
+			geo_table_free(&gt);
+		}
+	}
+	return errors;
+}
+
+/* Read member 'fd' into 'buf', which holds 'size' bytes */
+static int read_member(int fd, char *buf, unsigned long long size)
+{
+	memset(buf, 0, size);
+	return pread(fd, buf, size, 0) < 0 ? -1 : 0;
+}
+
+/*
+ * Check write_stripes() against restore_stripes() for every layout:
+ * both write the same data to their own set of members, which then
+ * have to match byte for byte.
+ */
+int test_write_stripes(void)
+{
+	const int chunk_size = 4096;
+	const unsigned long long stripe0 = 5, rows = 7;
+	unsigned long long offsets[16];
+	int fds[2][16];
+	int errors = 0;
+	unsigned int l, n;
+	int disks, i, j;
+
+	for (i = 0; i < 16; i++) {
+		offsets[i] = i * 512;
+		for (j = 0; j < 2; j++) {
+			FILE *f = tmpfile();
+
+			if (!f) {
+				perror("tmpfile");
+				return -1;
+			}
+			fds[j][i] = dup(fileno(f));
+			fclose(f);
+		}
+	}
+
+	for (l = 0; l < ARRAY_SIZE(levels); l++) {
+		int level = levels[l];
+		int parity = level == 0 ? 0 : level <= 5 ? 1 : 2;
+		unsigned int nlayouts;
+		const int *layouts = level_layouts(level, &nlayouts);
+
+		for (n = 0; n < nlayouts; n++)
+		for (disks = parity + 2; disks <= 16; disks++) {
+			int layout = level == 0 || level == 4 ? 0 : layouts[n];
+			int data_disks = disks - parity;
+			unsigned long long length = rows * data_disks * chunk_size;
+			unsigned long long start = stripe0 * data_disks * chunk_size;
+			unsigned long long size = offsets[disks - 1] +
+				(stripe0 + rows) * chunk_size;
+			char *src, *a, *b;
+			int rv1, rv2;
+
+			if (posix_memalign((void **)&src, 4096, length))
+				return -1;
+			a = xmalloc(size);
+			b = xmalloc(size);
+			for (i = 0; i < (int)length; i++)
+				src[i] = random();
+			for (i = 0; i < disks; i++) {
+				if (ftruncate(fds[0][i], 0) ||
+				    ftruncate(fds[1][i], 0))
+					return -1;
+			}
+
+			rv1 = write_stripes(fds[0], offsets, disks, chunk_size,
+					    level, layout, start, length, src);
+			rv2 = restore_stripes(fds[1], offsets, disks,
+					      chunk_size, level, layout,
+					      -1, 0ULL, start, length, src);
+			if (rv1 || rv2) {
+				printf("level %d layout %d disks %d: write_stripes %d restore_stripes %d\n",
+				       level, layout, disks, rv1, rv2);
+				errors++;
+			} else for (i = 0; i < disks; i++) {
+				if (read_member(fds[0][i], a, size) ||
+				    read_member(fds[1][i], b, size))
+					return -1;
+				if (memcmp(a, b, size) == 0)
+					continue;
+				printf("level %d layout %d disks %d: member %d differs\n",
+				       level, layout, disks, i);
+				errors++;
+			}
+			free(src);
+			free(a);
+			free(b);
+		}
+	}
+	for (i = 0; i < 16; i++) {
+		close(fds[0][i]);
+		close(fds[1][i]);
+	}
+	return errors;
+}
+
 unsigned long long getnum(char *str, char **err)
 {
 	char *e;
@@ -942,8 +1315,32 @@ int main(int argc, char *argv[])
 	int i;
 
 	char *err = NULL;
+	if (argc == 2 && strcmp(argv[1], "geo") == 0) {
+		int errors = test_geo_tables();
+
+		if (errors) {
+			fprintf(stderr,
+				"test_stripe: %d mismatches with geo_map\n",
+				errors);
+			exit(1);
+		}
+		exit(0);
+	}
+	if (argc == 2 && strcmp(argv[1], "write") == 0) {
+		int errors = test_write_stripes();
+
+		if (errors) {
+			fprintf(stderr,
+				"test_stripe: %d mismatches between write_stripes and restore_stripes\n",
+				errors);
+			exit(1);
+		}
+		exit(0);
+	}
 	if (argc < 10) {
 		fprintf(stderr, "Usage: test_stripe save/restore file raid_disks chunk_size level layout start length devices...\n");
+		fprintf(stderr, "       test_stripe geo\n");
+		fprintf(stderr, "       test_stripe write\n");
 		exit(1);
 	}
 	if (strcmp(argv[1], "save")==0)
@@ -40,10 +40,6 @@ static char T10[] = "Linux-MD";
  * 10 years with 2 leap years.
  */
 #define DECADE (3600*24*(365*10+2))
-unsigned long crc32(
-	unsigned long crc,
-	const unsigned char *buf,
-	unsigned len);
 
 #define DDF_NOTFOUND (~0U)
 #define DDF_CONTAINER (DDF_NOTFOUND-1)
@@ -3001,15 +2997,41 @@ static int remove_from_super_ddf(struct supertype *st, mdu_disk_info_t *dk)
  * container.
  */
 
-static int __write_ddf_structure(struct dl *d, struct ddf_super *ddf, __u8 type)
+/*
+ * Everything _write_super_to_disk() writes to one disk, laid out so that
+ * each step is a single request: for the primary and then the secondary
+ * structure, the header marked open followed by controller, phys, virt,
+ * config records and disk record, then the header marked closed.
+ * Finally the anchor.
+ * Preparing all disks first lets each step be issued to all disks at
+ * once, while the order of steps on each disk stays the same.
+ */
+struct ddf_disk_write {
+	struct dl *d;
+	char *buf;
+	int ok;
+	int attempt;
+	int queued[2];
+	struct io_req body[2];
+	struct io_req close[2];
+	struct io_req anchor;
+};
+
+static unsigned int ddf_structure_size(struct ddf_super *ddf)
+{
+	/* header, controller, phys, virt, config records, disk, header */
+	return 512 + 512 + ddf->pdsize + ddf->vdsize +
+		ddf->conf_rec_len * 512 * (ddf->max_part + 1) + 512 + 512;
+}
+
+static int __queue_ddf_structure(struct dl *d, struct ddf_super *ddf,
+				 __u8 type, char *buf,
+				 struct io_req *body, struct io_req *close)
 {
 	unsigned long long sector;
 	struct ddf_header *header;
-	int fd, i, n_config, conf_size, buf_size;
-	int ret = 0;
-	char *conf;
-
-	fd = d->fd;
+	int i, n_config, conf_size;
+	char *p = buf;
 
 	switch (type) {
 	case DDF_HEADER_PRIMARY:
@@ -3029,32 +3051,23 @@ static int __write_ddf_structure(struct dl *d, struct ddf_super *ddf, __u8 type)
 	header->type = type;
 	header->openflag = 1;
 	header->crc = calc_crc(header, 512);
-
-	lseek64(fd, sector<<9, 0);
-	if (write(fd, header, 512) < 0)
-		goto out;
+	memcpy(p, header, 512);
+	p += 512;
 
 	ddf->controller.crc = calc_crc(&ddf->controller, 512);
-	if (write(fd, &ddf->controller, 512) < 0)
-		goto out;
+	memcpy(p, &ddf->controller, 512);
+	p += 512;
 
 	ddf->phys->crc = calc_crc(ddf->phys, ddf->pdsize);
-	if (write(fd, ddf->phys, ddf->pdsize) < 0)
-		goto out;
+	memcpy(p, ddf->phys, ddf->pdsize);
+	p += ddf->pdsize;
 	ddf->virt->crc = calc_crc(ddf->virt, ddf->vdsize);
-	if (write(fd, ddf->virt, ddf->vdsize) < 0)
-		goto out;
+	memcpy(p, ddf->virt, ddf->vdsize);
+	p += ddf->vdsize;
 
-	/* Now write lots of config records. */
+	/* Now lots of config records. */
 	n_config = ddf->max_part;
 	conf_size = ddf->conf_rec_len * 512;
-	conf = ddf->conf;
-	buf_size = conf_size * (n_config + 1);
-	if (!conf) {
-		if (posix_memalign((void**)&conf, 512, buf_size) != 0)
-			goto out;
-		ddf->conf = conf;
-	}
 	for (i = 0 ; i <= n_config ; i++) {
 		struct vcl *c;
 		struct vd_config *vdc = NULL;
@@ -3078,35 +3091,49 @@ static int __write_ddf_structure(struct dl *d, struct ddf_super *ddf, __u8 type)
 				guid_str(vdc->guid),
 				vdc->sec_elmnt_seq);
 			vdc->crc = calc_crc(vdc, conf_size);
-			memcpy(conf + i*conf_size, vdc, conf_size);
+			memcpy(p, vdc, conf_size);
 		} else
-			memset(conf + i*conf_size, 0xff, conf_size);
+			memset(p, 0xff, conf_size);
+		p += conf_size;
 	}
-	if (write(fd, conf, buf_size) != buf_size)
-		goto out;
 
 	d->disk.crc = calc_crc(&d->disk, 512);
-	if (write(fd, &d->disk, 512) < 0)
-		goto out;
+	memcpy(p, &d->disk, 512);
+	p += 512;
+
+	body->op = IO_WRITE;
+	body->fd = d->fd;
+	body->buf = buf;
+	body->len = p - buf;
+	body->offset = sector << 9;
 
-	ret = 1;
-out:
 	header->openflag = 0;
 	header->crc = calc_crc(header, 512);
+	memcpy(p, header, 512);
 
-	lseek64(fd, sector<<9, 0);
-	if (write(fd, header, 512) < 0)
-		ret = 0;
-
-	return ret;
+	close->op = IO_WRITE;
+	close->fd = d->fd;
+	close->buf = p;
+	close->len = 512;
+	close->offset = sector << 9;
+	return 1;
 }
 
-static int _write_super_to_disk(struct ddf_super *ddf, struct dl *d)
+static int _queue_super_to_disk(struct ddf_super *ddf, struct dl *d,
+				struct ddf_disk_write *w)
 {
 	unsigned long long size;
+	unsigned int ssize = ddf_structure_size(ddf);
 	int fd = d->fd;
+
+	memset(w, 0, sizeof(*w));
+	w->d = d;
 	if (fd < 0)
 		return 0;
+	if (posix_memalign((void **)&w->buf, 4096, 2 * ssize + 512) != 0) {
+		w->buf = NULL;
+		return 0;
+	}
 
 	/* We need to fill in the primary, (secondary) and workspace
 	 * lba's in the headers, set their checksums,
@@ -3141,22 +3168,89 @@ static int _write_super_to_disk(struct ddf_super *ddf, struct dl *d)
 	ddf->anchor.seq = cpu_to_be32(0xFFFFFFFF); /* no sequencing in anchor */
 	ddf->anchor.crc = calc_crc(&ddf->anchor, 512);
 
-	if (!__write_ddf_structure(d, ddf, DDF_HEADER_PRIMARY))
-		return 0;
+	w->queued[0] = __queue_ddf_structure(d, ddf, DDF_HEADER_PRIMARY,
+					     w->buf, &w->body[0],
+					     &w->close[0]);
+	w->queued[1] = __queue_ddf_structure(d, ddf, DDF_HEADER_SECONDARY,
+					     w->buf + ssize, &w->body[1],
+					     &w->close[1]);
+
+	memcpy(w->buf + 2 * ssize, &ddf->anchor, 512);
+	w->anchor.op = IO_WRITE;
+	w->anchor.fd = fd;
+	w->anchor.buf = w->buf + 2 * ssize;
+	w->anchor.len = 512;
+	w->anchor.offset = (size-1)*512;
+	w->ok = 1;
+	return 1;
+}
 
-	if (!__write_ddf_structure(d, ddf, DDF_HEADER_SECONDARY))
-		return 0;
+static void _write_ddf_step(struct ddf_disk_write *w, int n,
+			    struct io_req *reqs, int step, int s)
+{
+	/* Issue one step to every disk still taking part, and
+	 * drop those on which it failed.
+	 */
+	int i, nr = 0;
 
-	lseek64(fd, (size-1)*512, SEEK_SET);
-	if (write(fd, &ddf->anchor, 512) < 0)
-		return 0;
+	for (i = 0; i < n; i++)
+		if (w[i].attempt)
+			reqs[nr++] = step == 0 ? w[i].body[s] :
+				     step == 1 ? w[i].close[s] : w[i].anchor;
+	io_batch(reqs, nr);
+	for (nr = 0, i = 0; i < n; i++)
+		if (w[i].attempt) {
+			if (reqs[nr].ret != (ssize_t)reqs[nr].len)
+				w[i].ok = 0;
+			nr++;
+		}
+}
 
-	return 1;
+static int _write_super_to_disks(struct ddf_super *ddf,
+				 struct ddf_disk_write *w, int n)
+{
+	/* Write everything prepared by _queue_super_to_disk().
+	 * Returns the number of disks written successfully.
+	 */
+	struct io_req *reqs = xcalloc(n, sizeof(*reqs));
+	int successes = 0;
+	int i, s;
+
+	for (s = 0; s < 2; s++) {
+		for (i = 0; i < n; i++) {
+			if (!w[i].queued[s])
+				w[i].ok = 0;
+			w[i].attempt = w[i].ok;
+		}
+		_write_ddf_step(w, n, reqs, 0, s);
+		/* the header is closed again even if the rest failed */
+		_write_ddf_step(w, n, reqs, 1, s);
+	}
+	for (i = 0; i < n; i++)
+		w[i].attempt = w[i].ok;
+	_write_ddf_step(w, n, reqs, 2, 0);
+
+	for (i = 0; i < n; i++) {
+		successes += w[i].ok;
+		free(w[i].buf);
+	}
+	free(reqs);
+	return successes;
+}
+
+static int _write_super_to_disk(struct ddf_super *ddf, struct dl *d)
+{
+	struct ddf_disk_write w;
+
+	if (!_queue_super_to_disk(ddf, d, &w))
+		return 0;
+	return _write_super_to_disks(ddf, &w, 1);
 }
 
 static int __write_init_super_ddf(struct supertype *st)
 {
 	struct ddf_super *ddf = st->sb;
+	struct ddf_disk_write *w;
 	struct dl *d;
 	int attempts = 0;
 	int successes = 0;
@@ -3166,10 +3260,14 @@ static int __write_init_super_ddf(struct supertype *st)
 	/* try to write updated metadata,
 	 * if we catch a failure move on to the next disk
 	 */
-	for (d = ddf->dlist; d; d=d->next) {
+	for (d = ddf->dlist; d; d=d->next)
 		attempts++;
-		successes += _write_super_to_disk(ddf, d);
-	}
+	w = xcalloc(attempts ?: 1, sizeof(*w));
+	attempts = 0;
+	for (d = ddf->dlist; d; d=d->next)
+		_queue_super_to_disk(ddf, d, &w[attempts++]);
+	successes = _write_super_to_disks(ddf, w, attempts);
+	free(w);
 
 	return attempts != successes;
 }
@@ -26,6 +26,8 @@
 #include <scsi/sg.h>
 #include <ctype.h>
 #include <dirent.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 /* MPB == Metadata Parameter Block */
 #define MPB_SIGNATURE "Intel Raid ISM Cfg Sig. "
@@ -955,13 +957,88 @@ static __u32 get_imsm_bbm_log_size(struct bbm_log *log)
 		log->entry_count * sizeof(struct bbm_log_entry);
 }
 
+/*
+ * The in-memory copy of the bbm log is kept sorted by disk ordinal and then
+ * by start sector, so entries for one disk form a contiguous run that can be
+ * bisected instead of scanned.  The order of entries in the on-disk log has
+ * no meaning, so nothing else cares.
+ */
+static int cmp_bbm_entry(const __u8 idx, const unsigned long long sector,
+			 const struct bbm_log_entry *entry)
+{
+	unsigned long long start = __le48_to_cpu(&entry->defective_block_start);
+
+	if (idx != entry->disk_ordinal)
+		return idx < entry->disk_ordinal ? -1 : 1;
+	if (sector != start)
+		return sector < start ? -1 : 1;
+	return 0;
+}
+
+static int cmp_bbm_entries(const void *a, const void *b)
+{
+	const struct bbm_log_entry *ea = a;
+
+	return cmp_bbm_entry(ea->disk_ordinal,
+			     __le48_to_cpu(&ea->defective_block_start), b);
+}
+
+/* index of the first entry not below (idx, sector) */
+static __u32 bbm_lower_bound(const struct bbm_log *log, const __u8 idx,
+			     const unsigned long long sector)
+{
+	__u32 lo = 0, hi = log->entry_count;
+
+	while (lo < hi) {
+		__u32 mid = lo + (hi - lo) / 2;
+
+		if (cmp_bbm_entry(idx, sector,
+				  &log->marked_block_entries[mid]) > 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void sort_bbm_log(struct bbm_log *log)
+{
+	qsort(log->marked_block_entries, log->entry_count,
+	      sizeof(struct bbm_log_entry), cmp_bbm_entries);
+}
+
+static void bbm_remove_entries(struct bbm_log *log, __u32 pos, __u32 cnt)
+{
+	struct bbm_log_entry *entries = log->marked_block_entries;
+
+	memmove(&entries[pos], &entries[pos + cnt],
+		(log->entry_count - pos - cnt) * sizeof(*entries));
+	log->entry_count -= cnt;
+}
+
+static void bbm_insert_entry(struct bbm_log *log, const __u8 idx,
+			     const unsigned long long sector, const int cnt)
+{
+	struct bbm_log_entry *entries = log->marked_block_entries;
+	__u32 pos = bbm_lower_bound(log, idx, sector);
+
+	memmove(&entries[pos + 1], &entries[pos],
+		(log->entry_count - pos) * sizeof(*entries));
+	entries[pos].defective_block_start = __cpu_to_le48(sector);
+	entries[pos].marked_count = cnt - 1;
+	entries[pos].disk_ordinal = idx;
+	log->entry_count++;
+}
+
 /* check if bad block is not partially stored in bbm log */
 static int is_stored_in_bbm(struct bbm_log *log, const __u8 idx, const unsigned
 			    long long sector, const int length, __u32 *pos)
 {
-	__u32 i;
+	__u32 i = bbm_lower_bound(log, idx, sector);
 
-	for (i = *pos; i < log->entry_count; i++) {
+	if (i < *pos)
+		i = *pos;
+	for (; i < log->entry_count; i++) {
 		struct bbm_log_entry *entry = &log->marked_block_entries[i];
 		unsigned long long bb_start;
 		unsigned long long bb_end;
@@ -969,8 +1046,10 @@ static int is_stored_in_bbm(struct bbm_log *log, const __u8 idx, const unsigned
 		bb_start = __le48_to_cpu(&entry->defective_block_start);
 		bb_end = bb_start + (entry->marked_count + 1);
 
-		if ((entry->disk_ordinal == idx) && (bb_start >= sector) &&
-		    (bb_end <= sector + length)) {
+		if (entry->disk_ordinal != idx ||
+		    bb_start >= sector + length)
+			break;
+		if (bb_end <= sector + length) {
 			*pos = i;
 			return 1;
 		}
@@ -1003,8 +1082,10 @@ static int record_new_badblock(struct bbm_log *log, const __u8 idx, unsigned
 	if (entry) {
 		int cnt = (length <= BBM_LOG_MAX_LBA_ENTRY_VAL) ? length :
 			BBM_LOG_MAX_LBA_ENTRY_VAL;
-		entry->defective_block_start = __cpu_to_le48(sector);
-		entry->marked_count = cnt - 1;
+
+		/* moving the start down may step over overlapping entries */
+		bbm_remove_entries(log, pos, 1);
+		bbm_insert_entry(log, idx, sector, cnt);
 		if (cnt == length)
 			return 1;
 		sector += cnt;
@@ -1019,17 +1100,10 @@ static int record_new_badblock(struct bbm_log *log, const __u8 idx, unsigned
 	while (length > 0) {
 		int cnt = (length <= BBM_LOG_MAX_LBA_ENTRY_VAL) ? length :
 			BBM_LOG_MAX_LBA_ENTRY_VAL;
-		struct bbm_log_entry *entry =
-			&log->marked_block_entries[log->entry_count];
-
-		entry->defective_block_start = __cpu_to_le48(sector);
-		entry->marked_count = cnt - 1;
-		entry->disk_ordinal = idx;
 
+		bbm_insert_entry(log, idx, sector, cnt);
 		sector += cnt;
 		length -= cnt;
-
-		log->entry_count++;
 	}
 
 	return new_bb;
@@ -1038,38 +1112,29 @@ static int record_new_badblock(struct bbm_log *log, const __u8 idx, unsigned
 /* clear all bad blocks for given disk */
 static void clear_disk_badblocks(struct bbm_log *log, const __u8 idx)
 {
-	__u32 i = 0;
-
-	while (i < log->entry_count) {
-		struct bbm_log_entry *entries = log->marked_block_entries;
+	__u32 first = bbm_lower_bound(log, idx, 0);
+	__u32 last = first;
 
-		if (entries[i].disk_ordinal == idx) {
-			if (i < log->entry_count - 1)
-				entries[i] = entries[log->entry_count - 1];
-			log->entry_count--;
-		} else {
-			i++;
-		}
-	}
+	while (last < log->entry_count &&
+	       log->marked_block_entries[last].disk_ordinal == idx)
+		last++;
+	bbm_remove_entries(log, first, last - first);
 }
 
 /* clear given bad block */
 static int clear_badblock(struct bbm_log *log, const __u8 idx, const unsigned
 			  long long sector, const int length) {
-	__u32 i = 0;
+	__u32 i = bbm_lower_bound(log, idx, sector);
 
-	while (i < log->entry_count) {
-		struct bbm_log_entry *entries = log->marked_block_entries;
+	for (; i < log->entry_count; i++) {
+		struct bbm_log_entry *entry = &log->marked_block_entries[i];
 
-		if ((entries[i].disk_ordinal == idx) &&
-		    (__le48_to_cpu(&entries[i].defective_block_start) ==
-		     sector) && (entries[i].marked_count + 1 == length)) {
-			if (i < log->entry_count - 1)
-				entries[i] = entries[log->entry_count - 1];
-			log->entry_count--;
+		if (cmp_bbm_entry(idx, sector, entry) != 0)
+			break;
+		if (entry->marked_count + 1 == length) {
+			bbm_remove_entries(log, i, 1);
 			break;
 		}
-		i++;
 	}
 
 	return 1;
@@ -1106,6 +1171,7 @@ static int load_bbm_log(struct intel_super *super)
 			return 4;
 
 		memcpy(super->bbm_log, log, bbm_log_size);
+		sort_bbm_log(super->bbm_log);
 	} else {
 		super->bbm_log->signature = __cpu_to_le32(BBM_LOG_SIGNATURE);
 		super->bbm_log->entry_count = 0;
@@ -1141,13 +1207,21 @@ static void get_volume_badblocks(const struct bbm_log *log, const __u8 idx,
 	__u32 count = 0;
 	__u32 i;
 
-	for (i = 0; i < log->entry_count; i++) {
+	/* an entry covers at most BBM_LOG_MAX_LBA_ENTRY_VAL sectors, so
+	 * nothing starting further below the volume can reach into it
+	 */
+	i = bbm_lower_bound(log, idx, start_sector > BBM_LOG_MAX_LBA_ENTRY_VAL ?
+			    start_sector - BBM_LOG_MAX_LBA_ENTRY_VAL : 0);
+	for (; i < log->entry_count; i++) {
 		const struct bbm_log_entry *ent =
 			&log->marked_block_entries[i];
 		struct md_bb_entry *bb;
 
-		if ((ent->disk_ordinal == idx) &&
-		    is_bad_block_in_volume(ent, start_sector, size)) {
+		if (ent->disk_ordinal != idx ||
+		    __le48_to_cpu(&ent->defective_block_start) >=
+		    start_sector + size)
+			break;
+		if (is_bad_block_in_volume(ent, start_sector, size)) {
 
 			if (!bbs->entries) {
 				bbs->entries = xmalloc(BBM_LOG_MAX_ENTRIES *
@@ -3293,6 +3367,71 @@ static int imsm_create_metadata_checkpoint_update(
 static void imsm_update_metadata_locally(struct supertype *st,
 					 void *buf, int len);
 
+/*******************************************************************************
+ * Function:	write_migr_rec_buf
+ * Description:	Writes migr_rec_buf to the last sectors of the member disks.
+ *		All writes are issued together and then flushed together,
+ *		so the cost does not grow with the number of members.
+ * Parameters:
+ *	super	: imsm internal array info
+ *	map	: write to the first 2 slots of this map only,
+ *		  or to every working member if NULL
+ * Returns:
+ *	 0 : success
+ *	-1 : if fail
+ ******************************************************************************/
+static int write_migr_rec_buf(struct intel_super *super, struct imsm_map *map)
+{
+	unsigned int sector_size = super->sector_size;
+	struct io_req *reqs;
+	int nr = 0, i;
+	int retval = 0;
+	struct dl *sd;
+
+	for (sd = super->disks; sd; sd = sd->next)
+		nr++;
+	reqs = xcalloc(nr, sizeof(*reqs));
+	nr = 0;
+	for (sd = super->disks; sd; sd = sd->next) {
+		unsigned long long dsize;
+
+		/* skip failed and spare devices */
+		if (sd->index < 0)
+			continue;
+		if (map) {
+			int slot = get_imsm_disk_slot(map, sd->index);
+
+			if (slot > 1 || slot < 0)
+				continue;
+		} else if (is_failed(&sd->disk))
+			continue;
+
+		get_dev_size(sd->fd, NULL, &dsize);
+		reqs[nr].op = IO_WRITE;
+		reqs[nr].fd = sd->fd;
+		reqs[nr].buf = super->migr_rec_buf;
+		reqs[nr].len = MIGR_REC_BUF_SECTORS * sector_size;
+		reqs[nr].offset = dsize - MIGR_REC_SECTOR_POSITION * sector_size;
+		nr++;
+	}
+	io_batch(reqs, nr);
+	for (i = 0; i < nr; i++) {
+		if (reqs[i].ret == (ssize_t)reqs[i].len) {
+			reqs[i].op = IO_SYNC;
+			continue;
+		}
+		pr_err("Cannot write migr record block: %s\n",
+		       strerror(reqs[i].ret < 0 ? -reqs[i].ret : EIO));
+		retval = -1;
+	}
+	if (retval == 0 && io_batch(reqs, nr) != 0) {
+		pr_err("Cannot flush migr record block\n");
+		retval = -1;
+	}
+	free(reqs);
+	return retval;
+}
+
 /*******************************************************************************
  * Function:	write_imsm_migr_rec
  * Description:	Function writes imsm migration record
@@ -3307,9 +3446,7 @@ static int write_imsm_migr_rec(struct supertype *st)
 {
 	struct intel_super *super = st->sb;
 	unsigned int sector_size = super->sector_size;
-	unsigned long long dsize;
 	int retval = -1;
-	struct dl *sd;
 	int len;
 	struct imsm_update_general_migration_checkpoint *u;
 	struct imsm_dev *dev;
@@ -3328,34 +3465,9 @@ static int write_imsm_migr_rec(struct supertype *st)
 
 	if (sector_size == 4096)
 		convert_to_4k_imsm_migr_rec(super);
-	for (sd = super->disks ; sd ; sd = sd->next) {
-		int slot = -1;
-
-		/* skip failed and spare devices */
-		if (sd->index < 0)
-			continue;
-		/* write to 2 first slots only */
-		if (map)
-			slot = get_imsm_disk_slot(map, sd->index);
-		if (map == NULL || slot > 1 || slot < 0)
-			continue;
-
-		get_dev_size(sd->fd, NULL, &dsize);
-		if (lseek64(sd->fd, dsize - (MIGR_REC_SECTOR_POSITION *
-		    sector_size),
-		    SEEK_SET) < 0) {
-			pr_err("Cannot seek to anchor block: %s\n",
-			       strerror(errno));
-			goto out;
-		}
-		if ((unsigned int)write(sd->fd, super->migr_rec_buf,
-		    MIGR_REC_BUF_SECTORS*sector_size) !=
-		    MIGR_REC_BUF_SECTORS*sector_size) {
-			pr_err("Cannot write migr record block: %s\n",
-			       strerror(errno));
-			goto out;
-		}
-	}
+	/* write to 2 first slots only */
+	if (map && write_migr_rec_buf(super, map) != 0)
+		goto out;
 	if (sector_size == 4096)
 		convert_from_4k_imsm_migr_rec(super);
 	/* update checkpoint information in metadata */
@@ -6124,6 +6236,7 @@ static int remove_from_super_imsm(struct supertype *st, mdu_disk_info_t *dk)
 }
 
 static int store_imsm_mpb(int fd, struct imsm_super *mpb);
+static int queue_imsm_mpb(int fd, struct imsm_super *mpb, struct io_req *reqs);
 
 static union {
 	char buf[MAX_SECTOR_SIZE];
@@ -6202,11 +6315,13 @@ static int write_super_imsm(struct supertype *st, int doclose)
 	__u32 generation;
 	__u32 sum;
 	int spares = 0;
-	int i;
+	int i, j;
 	__u32 mpb_size = sizeof(struct imsm_super) - sizeof(struct imsm_disk);
 	int num_disks = 0;
 	int clear_migration_record = 1;
 	__u32 bbm_log_size;
+	struct io_req *reqs, *anchors;
+	int nr_reqs = 0, nr_anchors = 0;
 
 	/* 'generation' is incremented everytime the metadata is written */
 	generation = __le32_to_cpu(mpb->generation_num);
@@ -6276,8 +6391,20 @@ static int write_super_imsm(struct supertype *st, int doclose)
 	if (sector_size == 4096)
 		convert_to_4k(super);
 
-	/* write the mpb for disks that compose raid devices */
+	/* write the mpb for disks that compose raid devices.  The writes
+	 * to different disks are independent, so issue them to all disks
+	 * together: first the migration record and extended mpb, then,
+	 * once those are all done, the anchors.
+	 */
+	for (d = super->disks; d ; d = d->next)
+		if (d->index >= 0 && !is_failed(&d->disk))
+			nr_reqs += 3;
+	reqs = xcalloc(nr_reqs ?: 1, sizeof(*reqs));
+	anchors = xcalloc(nr_reqs ?: 1, sizeof(*anchors));
+	nr_reqs = 0;
 	for (d = super->disks; d ; d = d->next) {
+		int n;
+
 		if (d->index < 0 || is_failed(&d->disk))
 			continue;
 
@@ -6285,25 +6412,65 @@ static int write_super_imsm(struct supertype *st, int doclose)
 			unsigned long long dsize;
 
 			get_dev_size(d->fd, NULL, &dsize);
-			if (lseek64(d->fd, dsize - sector_size,
-			    SEEK_SET) >= 0) {
-				if ((unsigned int)write(d->fd,
-				    super->migr_rec_buf,
-				    MIGR_REC_BUF_SECTORS*sector_size) !=
-				    MIGR_REC_BUF_SECTORS*sector_size)
-					perror("Write migr_rec failed");
-			}
+			reqs[nr_reqs].op = IO_WRITE;
+			reqs[nr_reqs].fd = d->fd;
+			reqs[nr_reqs].buf = super->migr_rec_buf;
+			reqs[nr_reqs].len = MIGR_REC_BUF_SECTORS*sector_size;
+			reqs[nr_reqs].offset = dsize - sector_size;
+			nr_reqs++;
 		}
 
-		if (store_imsm_mpb(d->fd, mpb))
+		n = queue_imsm_mpb(d->fd, mpb, reqs + nr_reqs);
+		if (n < 0) {
 			fprintf(stderr,
 				"failed for device %d:%d (fd: %d)%s\n",
 				d->major, d->minor,
 				d->fd, strerror(errno));
+			continue;
+		}
+		/* the anchor is always the last one */
+		nr_reqs += n - 1;
+		anchors[nr_anchors++] = reqs[nr_reqs];
+	}
+	io_batch(reqs, nr_reqs);
+	/* no anchor without the rest of the mpb */
+	for (i = 0, j = 0; i < nr_anchors; i++) {
+		int k;
 
-		if (doclose)
-			close_fd(&d->fd);
+		for (k = 0; k < nr_reqs; k++)
+			if (reqs[k].fd == anchors[i].fd &&
+			    reqs[k].buf != super->migr_rec_buf &&
+			    reqs[k].ret != (ssize_t)reqs[k].len)
+				break;
+		if (k == nr_reqs)
+			anchors[j++] = anchors[i];
+	}
+	nr_anchors = j;
+	io_batch(anchors, nr_anchors);
+	memcpy(reqs + nr_reqs, anchors, nr_anchors * sizeof(*reqs));
+	nr_reqs += nr_anchors;
+	for (i = 0; i < nr_reqs; i++) {
+		if (reqs[i].ret == (ssize_t)reqs[i].len)
+			continue;
+		for (d = super->disks; d; d = d->next)
+			if (d->fd == reqs[i].fd)
+				break;
+		if (reqs[i].buf == super->migr_rec_buf)
+			pr_err("Write migr_rec failed: %s\n",
+			       strerror(reqs[i].ret < 0 ? -reqs[i].ret : EIO));
+		else if (d)
+			fprintf(stderr,
+				"failed for device %d:%d (fd: %d)%s\n",
+				d->major, d->minor, d->fd,
+				strerror(reqs[i].ret < 0 ? -reqs[i].ret : EIO));
 	}
+	free(reqs);
+	free(anchors);
+
+	if (doclose)
+		for (d = super->disks; d ; d = d->next)
+			if (d->index >= 0 && !is_failed(&d->disk))
+				close_fd(&d->fd);
 
 	if (spares)
 		return write_super_imsm_spares(super, doclose);
@@ -8953,16 +9120,20 @@ static void imsm_set_disk(struct active_array *a, int n, int state)
 	dprintf_cont("\n");
 }
 
-static int store_imsm_mpb(int fd, struct imsm_super *mpb)
+static int queue_imsm_mpb(int fd, struct imsm_super *mpb, struct io_req *reqs)
 {
+	/* Fill in (at most 2) requests that write 'mpb' to 'fd'.
+	 * Returns the number of requests, or -1 on error.
+	 */
 	void *buf = mpb;
 	__u32 mpb_size = __le32_to_cpu(mpb->mpb_size);
 	unsigned long long dsize;
 	unsigned long long sectors;
 	unsigned int sector_size;
+	int n = 0;
 
 	if (!get_dev_sector_size(fd, NULL, &sector_size))
-		return 1;
+		return -1;
 	get_dev_size(fd, NULL, &dsize);
 
 	if (mpb_size > sector_size) {
@@ -8970,22 +9141,37 @@ static int store_imsm_mpb(int fd, struct imsm_super *mpb)
 		sectors = mpb_sectors(mpb, sector_size) - 1;
 
 		/* write the extended mpb to the sectors preceeding the anchor */
-		if (lseek64(fd, dsize - (sector_size * (2 + sectors)),
-		   SEEK_SET) < 0)
-			return 1;
-
-		if ((unsigned long long)write(fd, buf + sector_size,
-		   sector_size * sectors) != sector_size * sectors)
-			return 1;
+		reqs[n].op = IO_WRITE;
+		reqs[n].fd = fd;
+		reqs[n].buf = buf + sector_size;
+		reqs[n].len = sector_size * sectors;
+		reqs[n].offset = dsize - (sector_size * (2 + sectors));
+		n++;
 	}
 
 	/* first block is stored on second to last sector of the disk */
-	if (lseek64(fd, dsize - (sector_size * 2), SEEK_SET) < 0)
-		return 1;
+	reqs[n].op = IO_WRITE;
+	reqs[n].fd = fd;
+	reqs[n].buf = buf;
+	reqs[n].len = sector_size;
+	reqs[n].offset = dsize - (sector_size * 2);
+	n++;
 
-	if ((unsigned int)write(fd, buf, sector_size) != sector_size)
-		return 1;
+	return n;
+}
+
+static int store_imsm_mpb(int fd, struct imsm_super *mpb)
+{
+	struct io_req reqs[2];
+	int n, i;
 
+	n = queue_imsm_mpb(fd, mpb, reqs);
+	if (n < 0)
+		return 1;
+	/* the extended mpb goes out before the anchor */
+	for (i = 0; i < n; i++)
+		if (io_batch(&reqs[i], 1) != 0)
+			return 1;
 	return 0;
 }
 
@@ -10611,6 +10797,10 @@ static void imsm_delete(struct intel_super *super, struct dl **dlp, unsigned ind
 			continue;
 		entry->disk_ordinal--;
 	}
+	/* entries left behind by the removed disk now share an ordinal
+	 * with the next one
+	 */
+	sort_bbm_log(log);
 
 	mpb->num_disks--;
 	super->updates_pending++;
@@ -10970,8 +11160,9 @@ void init_migr_record_imsm(struct supertype *st, struct imsm_dev *dev,
  * Function:	save_backup_imsm
  * Description:	Function saves critical data stripes to Migration Copy Area
  *		and updates the current migration unit status.
- *		Use restore_stripes() to form a destination stripe,
- *		and to write it to the Copy Area.
+ *		Use write_stripes() to write the data in destination
+ *		geometry to the Copy Area straight from the buffer, or
+ *		restore_stripes() if the buffer is not aligned for that.
  * Parameters:
  *	st		: supertype information
  *	dev		: imsm device that backup is saved for
@@ -11018,19 +11209,28 @@ int save_backup_imsm(struct supertype *st,
 	dest_layout = imsm_level_to_layout(map_dest->raid_level);
 	dest_chunk = __le16_to_cpu(map_dest->blocks_per_strip) * 512;
 
-	if (restore_stripes(targets, /* list of dest devices */
-			    target_offsets, /* migration record offsets */
-			    new_disks,
-			    dest_chunk,
-			    map_dest->raid_level,
-			    dest_layout,
-			    -1,    /* source backup file descriptor */
-			    0,     /* input buf offset
-				    * always 0 buf is already offseted */
-			    start,
-			    length,
-			    buf) != 0) {
+	/* write_stripes() hands buf to O_DIRECT writes as it is */
+	if ((unsigned long)buf % MAX_SECTOR_SIZE == 0 &&
+	    dest_chunk % MAX_SECTOR_SIZE == 0)
+		rv = write_stripes(targets, target_offsets, new_disks,
+				   dest_chunk, map_dest->raid_level,
+				   dest_layout, start, length, buf);
+	else
+		rv = restore_stripes(targets, /* list of dest devices */
+				     target_offsets, /* migration record offsets */
+				     new_disks,
+				     dest_chunk,
+				     map_dest->raid_level,
+				     dest_layout,
+				     -1,    /* source backup file descriptor */
+				     0,     /* input buf offset
+					     * always 0 buf is already offseted */
+				     start,
+				     length,
+				     buf);
+	if (rv != 0) {
 		pr_err("Error restoring stripes\n");
+		rv = -1;
 		goto abort;
 	}
 
@@ -12024,33 +12224,6 @@ exit_imsm_reshape_super:
 	return ret_val;
 }
 
-#define COMPLETED_OK		0
-#define COMPLETED_NONE		1
-#define COMPLETED_DELAYED	2
-
-static int read_completed(int fd, unsigned long long *val)
-{
-	int ret;
-	char buf[50];
-
-	ret = sysfs_fd_get_str(fd, buf, 50);
-	if (ret < 0)
-		return ret;
-
-	ret = COMPLETED_OK;
-	if (strncmp(buf, "none", 4) == 0) {
-		ret = COMPLETED_NONE;
-	} else if (strncmp(buf, "delayed", 7) == 0) {
-		ret = COMPLETED_DELAYED;
-	} else {
-		char *ep;
-		*val = strtoull(buf, &ep, 0);
-		if (ep == buf || (*ep != 0 && *ep != '\n' && *ep != ' '))
-			ret = -1;
-	}
-	return ret;
-}
-
 /*******************************************************************************
  * Function:	wait_for_reshape_imsm
  * Description:	Function writes new sync_max value and waits until
@@ -12058,14 +12231,16 @@ static int read_completed(int fd, unsigned long long *val)
  * Parameters:
  *	sra		: general array info
  *	ndata		: number of disks in new array's layout
+ *	rw		: waiter on the array's sync_completed
  * Returns:
  *	 0 : success,
  *	 1 : there is no reshape in progress,
  *	-1 : fail
  ******************************************************************************/
-int wait_for_reshape_imsm(struct mdinfo *sra, int ndata)
+int wait_for_reshape_imsm(struct mdinfo *sra, int ndata,
+			  struct reshape_wait *rw)
 {
-	int fd = sysfs_get_fd(sra, NULL, "sync_completed");
+	int fd = rw->completed_fd;
 	int retry = 3;
 	unsigned long long completed;
 	/* to_complete : new sync_max position */
@@ -12081,7 +12256,6 @@ int wait_for_reshape_imsm(struct mdinfo *sra, int ndata)
 		if (sysfs_fd_get_ll(fd, &completed) < 0) {
 			if (!retry) {
 				dprintf("cannot read reshape_position (no reshape in progres)\n");
-				close(fd);
 				return 1;
 			}
 			sleep_for(0, MSEC_TO_NSEC(30), true);
@@ -12092,7 +12266,6 @@ int wait_for_reshape_imsm(struct mdinfo *sra, int ndata)
 	if (completed > position_to_set) {
 		dprintf("wrong next position to set %llu (%llu)\n",
 			to_complete, position_to_set);
-		close(fd);
 		return -1;
 	}
 	dprintf("Position set: %llu\n", position_to_set);
@@ -12100,35 +12273,18 @@ int wait_for_reshape_imsm(struct mdinfo *sra, int ndata)
 			  position_to_set) != 0) {
 		dprintf("cannot set reshape position to %llu\n",
 			position_to_set);
-		close(fd);
 		return -1;
 	}
 
-	do {
-		int rc;
-		char action[20];
-		int timeout = 3000;
-
-		sysfs_wait(fd, &timeout);
-		if (sysfs_get_str(sra, NULL, "sync_action",
-				  action, 20) > 0 &&
-				strncmp(action, "reshape", 7) != 0) {
-			if (strncmp(action, "idle", 4) == 0)
-				break;
-			close(fd);
+	switch (reshape_wait_step(rw, position_to_set, -1)) {
+	case RESHAPE_WAIT_ERROR:
+		dprintf("cannot read reshape_position (in loop)\n");
+		return 1;
+	case RESHAPE_WAIT_STOPPED:
+		if (strncmp(rw->action, "idle", 4) != 0)
 			return -1;
-		}
-
-		rc = read_completed(fd, &completed);
-		if (rc < 0) {
-			dprintf("cannot read reshape_position (in loop)\n");
-			close(fd);
-			return 1;
-		} else if (rc == COMPLETED_NONE)
-			break;
-	} while (completed < position_to_set);
-
-	close(fd);
+		break;
+	}
 	return 0;
 }
 
@@ -12178,6 +12334,138 @@ int check_degradation_change(struct mdinfo *info,
 	return new_degraded;
 }
 
+/* Plan of one migration step in imsm_manage_reshape() */
+struct imsm_migr_step {
+	unsigned long long position;	/* start [blocks] */
+	unsigned long long step;	/* length [blocks] */
+	unsigned long long start_src;	/* read start, old stripe aligned [bytes] */
+	unsigned long long buf_shift;	/* start - start_src [bytes] */
+	unsigned long long read_len;	/* length to read [bytes] */
+	unsigned long long border;	/* distance source to target [blocks] */
+	int critical;			/* needs backup in copy area */
+};
+
+/* Aim for kernel steps of this many milliseconds outside the critical
+ * section, where the size of a step is not limited by the copy area.
+ */
+#define IMSM_STEP_TARGET_MS 1000
+
+static void imsm_plan_step(struct migr_record *migr_rec,
+			   unsigned long long position,
+			   unsigned long long max_position,
+			   int odata, int ndata,
+			   unsigned long long old_data_stripe_length,
+			   struct imsm_migr_step *ms)
+{
+	unsigned long long start = position * 512;
+	unsigned long long filler;
+
+	ms->position = position;
+	ms->step = __le32_to_cpu(migr_rec->blocks_per_unit);
+	if ((position + ms->step) > max_position)
+		ms->step = max_position - position;
+
+	/* align reading start to old geometry */
+	ms->buf_shift = start % old_data_stripe_length;
+	ms->start_src = start - ms->buf_shift;
+
+	ms->border = (ms->start_src / odata) - (start / ndata);
+	ms->border /= 512;
+	ms->critical = ms->border <=
+		__le32_to_cpu(migr_rec->dest_depth_per_unit);
+
+	/* allign copy area length to stripe in old geometry */
+	filler = (ms->step * 512 + ms->buf_shift) % old_data_stripe_length;
+	if (filler)
+		filler = old_data_stripe_length - filler;
+	ms->read_len = ms->step * 512 + filler + ms->buf_shift;
+}
+
+/*******************************************************************************
+ * Function:	imsm_checkpoint_due
+ * Description:	Tells whether the migration record has to be written after
+ *		a step that did not use the copy area.  The write can be
+ *		skipped while the last checkpoint is younger than the window
+ *		and restarting from it would only redo units whose source
+ *		data the kernel has not overwritten yet.  The caller keeps
+ *		the array suspended from the last checkpoint on, so nothing
+ *		else writes to the units that would be redone.
+ * Parameters:
+ *	ckpt		: plan of the step at the last written checkpoint
+ *	ckpt_time	: when it was written
+ *	window		: longest time a checkpoint may be skipped [ms]
+ *	progress	: current reshape position [blocks]
+ *	max_position	: array size [blocks]
+ *	ndata		: number of disks in new array's layout
+ * Returns:
+ *	1 : the checkpoint must be written now
+ *	0 : it can be skipped
+ ******************************************************************************/
+static int imsm_checkpoint_due(struct imsm_migr_step *ckpt,
+			       struct timespec *ckpt_time,
+			       unsigned long window,
+			       unsigned long long progress,
+			       unsigned long long max_position, int ndata)
+{
+	struct timespec now;
+	unsigned long long age;
+
+	if (progress >= max_position || ckpt->critical)
+		return 1;
+	/* the kernel has written the new layout up to progress / ndata
+	 * on each member, that must not reach the old data at ckpt
+	 */
+	if (progress - ckpt->position > ckpt->border * ndata)
+		return 1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	age = (now.tv_sec - ckpt_time->tv_sec) * 1000 +
+		(now.tv_nsec - ckpt_time->tv_nsec) / 1000000;
+	return age >= window;
+}
+
+/*******************************************************************************
+ * Function:	imsm_prefetch_step
+ * Description:	Reads the source stripes of a critical migration step in a
+ *		child process, so that it runs while the kernel reshapes the
+ *		previous step. The caller must have suspended the range.
+ * Parameters:
+ *	fds, offsets	: source devices, as for save_stripes()
+ *	map_src		: source map
+ *	chunk		: source chunk size [bytes]
+ *	ms		: step to read
+ *	buf		: shared buffer to read into
+ * Returns:
+ *	pid of the child, or -1 if the step must be read synchronously
+ ******************************************************************************/
+static pid_t imsm_prefetch_step(int *fds, unsigned long long *offsets,
+				struct imsm_map *map_src, int chunk,
+				struct imsm_migr_step *ms, char *buf)
+{
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		int rv = save_stripes(fds, offsets, map_src->num_members,
+				      chunk, map_src->raid_level,
+				      imsm_level_to_layout(map_src->raid_level),
+				      0, NULL, ms->start_src, ms->read_len,
+				      buf);
+		_exit(rv ? 1 : 0);
+	}
+	return pid;
+}
+
+static int imsm_prefetch_wait(pid_t pid)
+{
+	int status;
+
+	if (pid <= 0)
+		return 0;
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return 0;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
 /*******************************************************************************
  * Function:	imsm_manage_reshape
  * Description:	Function finds array under reshape and it manages reshape
@@ -12207,7 +12495,6 @@ static int imsm_manage_reshape(
 	int ret_val = 0;
 	struct intel_super *super = st->sb;
 	struct intel_dev *dv;
-	unsigned int sector_size = super->sector_size;
 	struct imsm_dev *dev = NULL;
 	struct imsm_map *map_src, *map_dest;
 	int migr_vol_qan = 0;
@@ -12219,9 +12506,15 @@ static int imsm_manage_reshape(
 	unsigned long long max_position; /* array size [bytes] */
 	unsigned long long next_step; /* [blocks]/[bytes] */
 	unsigned long long old_data_stripe_length;
-	unsigned long long start_src; /* [bytes] */
-	unsigned long long start; /* [bytes] */
-	unsigned long long start_buf_shift; /* [bytes] */
+	struct imsm_migr_step prefetched = { .step = 0 };
+	int prefetch_degraded = 0;
+	int buf_half = 0;
+	unsigned long blocks_per_ms = 0; /* measured reshape speed */
+	struct reshape_wait rw = { .completed_fd = -1, .action_fd = -1 };
+	struct imsm_migr_step ckpt; /* where the last checkpoint was written */
+	struct timespec ckpt_time;
+	unsigned long ckpt_window = 0; /* [ms] */
+	char *env;
 	int degraded = 0;
 	int source_layout = 0;
 	int subarray_index = -1;
@@ -12288,13 +12581,29 @@ static int imsm_manage_reshape(
 	buf_size += __le32_to_cpu(migr_rec->dest_depth_per_unit) * 512;
 	/* add space for stripe alignment */
 	buf_size += old_data_stripe_length;
-	if (posix_memalign((void **)&buf, MAX_SECTOR_SIZE, buf_size)) {
+	/* Two buffers: while the kernel reshapes one step, the source
+	 * stripes of the next one are read into the other by a child.
+	 */
+	buf_size = ROUND_UP(buf_size, MAX_SECTOR_SIZE);
+	buf = mmap(NULL, 2 * buf_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		buf = NULL;
 		dprintf("imsm: Cannot allocate checkpoint buffer\n");
 		goto abort;
 	}
 
 	max_position = sra->component_size * ndata;
 	source_layout = imsm_level_to_layout(map_src->raid_level);
+	reshape_wait_open(&rw, sra);
+
+	env = getenv("IMSM_CHECKPOINT_WINDOW");
+	if (env)
+		ckpt_window = strtoul(env, NULL, 10) * 1000;
+	imsm_plan_step(migr_rec, __le32_to_cpu(migr_rec->blocks_per_unit) *
+		       current_migr_unit(migr_rec), max_position,
+		       odata, ndata, old_data_stripe_length, &ckpt);
+	clock_gettime(CLOCK_MONOTONIC, &ckpt_time);
 
 	while (current_migr_unit(migr_rec) <
 	       get_num_migr_units(migr_rec)) {
@@ -12302,7 +12611,12 @@ static int imsm_manage_reshape(
 		unsigned long long current_position =
 			__le32_to_cpu(migr_rec->blocks_per_unit)
 			* current_migr_unit(migr_rec);
-		unsigned long long border;
+		struct imsm_migr_step ms, next;
+		unsigned long long suspend_hi;
+		pid_t prefetch = -1;
+		unsigned long long step_blocks;
+		unsigned long rate;
+		char *step_buf;
 
 		/* Check that array hasn't become failed.
 		 */
@@ -12311,21 +12625,16 @@ static int imsm_manage_reshape(
 			dprintf("imsm: Abort reshape due to degradation level (%i)\n", degraded);
 			goto abort;
 		}
+		if (degraded != prefetch_degraded)
+			/* read again with the current set of devices */
+			prefetched.step = 0;
 
-		next_step = __le32_to_cpu(migr_rec->blocks_per_unit);
-
-		if ((current_position + next_step) > max_position)
-			next_step = max_position - current_position;
-
-		start = current_position * 512;
-
-		/* align reading start to old geometry */
-		start_buf_shift = start % old_data_stripe_length;
-		start_src = start - start_buf_shift;
+		imsm_plan_step(migr_rec, current_position, max_position,
+			       odata, ndata, old_data_stripe_length, &ms);
+		next_step = ms.step;
+		step_buf = buf + buf_half * buf_size;
 
-		border = (start_src / odata) - (start / ndata);
-		border /= 512;
-		if (border <= __le32_to_cpu(migr_rec->dest_depth_per_unit)) {
+		if (ms.critical) {
 			/* save critical stripes to buf
 			 * start     - start address of current unit
 			 *             to backup [bytes]
@@ -12333,25 +12642,22 @@ static int imsm_manage_reshape(
 			 *             to backup alligned to source array
 			 *             [bytes]
 			 */
-			unsigned long long next_step_filler;
 			unsigned long long copy_length = next_step * 512;
 
-			/* allign copy area length to stripe in old geometry */
-			next_step_filler = ((copy_length + start_buf_shift)
-					    % old_data_stripe_length);
-			if (next_step_filler)
-				next_step_filler = (old_data_stripe_length
-						    - next_step_filler);
 			dprintf("save_stripes() parameters: start = %llu,\tstart_src = %llu,\tnext_step*512 = %llu,\tstart_in_buf_shift = %llu,\tnext_step_filler = %llu\n",
-				start, start_src, copy_length,
-				start_buf_shift, next_step_filler);
-
-			if (save_stripes(fds, offsets, map_src->num_members,
-					 chunk, map_src->raid_level,
-					 source_layout, 0, NULL, start_src,
-					 copy_length +
-					 next_step_filler + start_buf_shift,
-					 buf)) {
+				current_position * 512, ms.start_src,
+				copy_length, ms.buf_shift,
+				ms.read_len - copy_length - ms.buf_shift);
+
+			if (prefetched.step &&
+			    prefetched.position == ms.position &&
+			    prefetched.read_len == ms.read_len) {
+				dprintf("imsm: stripes were read ahead\n");
+			} else if (save_stripes(fds, offsets,
+					map_src->num_members, chunk,
+					map_src->raid_level, source_layout,
+					0, NULL, ms.start_src, ms.read_len,
+					step_buf)) {
 				dprintf("imsm: Cannot save stripes to buffer\n");
 				goto abort;
 			}
@@ -12359,7 +12665,7 @@ static int imsm_manage_reshape(
 			 * in backup general migration area
 			 */
 			if (save_backup_imsm(st, dev, sra,
-				buf + start_buf_shift, copy_length)) {
+				step_buf + ms.buf_shift, copy_length)) {
 				dprintf("imsm: Cannot save stripes to target devices\n");
 				goto abort;
 			}
@@ -12368,12 +12674,28 @@ static int imsm_manage_reshape(
 				dprintf("imsm: Cannot write checkpoint to migration record (UNIT_SRC_IN_CP_AREA)\n");
 				goto abort;
 			}
+			ckpt = ms;
+			clock_gettime(CLOCK_MONOTONIC, &ckpt_time);
 		} else {
-			/* set next step to use whole border area */
-			border /= next_step;
+			/* set next step to use whole border area, or as
+			 * much of it as the kernel is expected to reshape
+			 * in IMSM_STEP_TARGET_MS
+			 */
+			unsigned long long border = ms.border / next_step;
+
+			if (border > 1 && blocks_per_ms) {
+				unsigned long long units;
+
+				units = blocks_per_ms * IMSM_STEP_TARGET_MS /
+					next_step;
+				if (units < border)
+					border = units ?: 1;
+			}
 			if (border > 1)
 				next_step *= border;
 		}
+		prefetched.step = 0;
+
 		/* When data backed up, checkpoint stored,
 		 * kick the kernel to reshape unit of data
 		 */
@@ -12381,45 +12703,78 @@ static int imsm_manage_reshape(
 		/* limit next step to array max position */
 		if (next_step > max_position)
 			next_step = max_position;
-		sysfs_set_num(sra, NULL, "suspend_lo", sra->reshape_progress);
-		sysfs_set_num(sra, NULL, "suspend_hi", next_step);
+		suspend_hi = next_step;
+
+		/* If the next step is critical as well, suspend it too
+		 * and read its stripes while this one is reshaped.  The
+		 * kernel only writes below the start of its source.
+		 */
+		if (ms.critical && next_step < max_position) {
+			imsm_plan_step(migr_rec, next_step, max_position,
+				       odata, ndata, old_data_stripe_length,
+				       &next);
+			if (next.critical)
+				suspend_hi = next_step + next.step;
+		}
+		/* Keep what was reshaped since the last written checkpoint
+		 * suspended, a restart from it must find the data there
+		 * the way it was left.
+		 */
+		sysfs_set_num(sra, NULL, "suspend_lo", ckpt.position);
+		sysfs_set_num(sra, NULL, "suspend_hi", suspend_hi);
+		if (suspend_hi > next_step) {
+			prefetch = imsm_prefetch_step(fds, offsets, map_src,
+						      chunk, &next,
+						      buf + !buf_half *
+						      buf_size);
+			prefetch_degraded = degraded;
+		}
+		step_blocks = next_step - sra->reshape_progress;
 		sra->reshape_progress = next_step;
 
 		/* wait until reshape finish */
-		if (wait_for_reshape_imsm(sra, ndata)) {
+		if (wait_for_reshape_imsm(sra, ndata, &rw)) {
 			dprintf("wait_for_reshape_imsm returned error!\n");
+			imsm_prefetch_wait(prefetch);
 			goto abort;
 		}
+		if (imsm_prefetch_wait(prefetch)) {
+			prefetched = next;
+			buf_half = !buf_half;
+		}
 		if (sigterm)
 			goto abort;
 
+		/* measure how fast the kernel reshapes [blocks/ms],
+		 * leaving out the time it sat at sync_max
+		 */
+		rate = step_blocks / max(rw.step_busy, 1UL);
+		blocks_per_ms = blocks_per_ms ?
+			(blocks_per_ms * 3 + rate) / 4 : rate;
+
+		if (!ms.critical && ckpt_window &&
+		    !imsm_checkpoint_due(&ckpt, &ckpt_time, ckpt_window,
+					 sra->reshape_progress, max_position,
+					 ndata)) {
+			/* move on in memory only */
+			set_current_migr_unit(migr_rec, sra->reshape_progress /
+				__le32_to_cpu(migr_rec->blocks_per_unit));
+			continue;
+		}
 		if (save_checkpoint_imsm(st, sra, UNIT_SRC_NORMAL) == 1) {
 			/* ignore error == 2, this can mean end of reshape here
 			 */
 			dprintf("imsm: Cannot write checkpoint to migration record (UNIT_SRC_NORMAL)\n");
 			goto abort;
 		}
-
+		imsm_plan_step(migr_rec, sra->reshape_progress, max_position,
+			       odata, ndata, old_data_stripe_length, &ckpt);
+		clock_gettime(CLOCK_MONOTONIC, &ckpt_time);
 	}
 
 	/* clear migr_rec on disks after successful migration */
-	struct dl *d;
-
 	memset(super->migr_rec_buf, 0, MIGR_REC_BUF_SECTORS*MAX_SECTOR_SIZE);
-	for (d = super->disks; d; d = d->next) {
-		if (d->index < 0 || is_failed(&d->disk))
-			continue;
-		unsigned long long dsize;
-
-		get_dev_size(d->fd, NULL, &dsize);
-		if (lseek64(d->fd, dsize - MIGR_REC_SECTOR_POSITION*sector_size,
-			    SEEK_SET) >= 0) {
-			if ((unsigned int)write(d->fd, super->migr_rec_buf,
-			    MIGR_REC_BUF_SECTORS*sector_size) !=
-			    MIGR_REC_BUF_SECTORS*sector_size)
-				perror("Write migr_rec failed");
-		}
-	}
+	write_migr_rec_buf(super, NULL);
 
 	/* return '1' if done */
 	ret_val = 1;
@@ -12432,7 +12787,9 @@ static int imsm_manage_reshape(
 	imsm_fix_size_mismatch(st, subarray_index);
 
 abort:
-	free(buf);
+	reshape_wait_close(&rw, sra->sys_name);
+	if (buf)
+		munmap(buf, 2 * buf_size);
 	/* See Grow.c: abort_reshape() for further explanation */
 	sysfs_set_num(sra, NULL, "suspend_lo", 0x7FFFFFFFFFFFFFFFULL);
 	sysfs_set_num(sra, NULL, "suspend_hi", 0);
@@ -1242,6 +1242,22 @@ static int write_bitmap0(struct supertype *st, int fd, enum bitmap_update update
 	return rv;
 }
 
+static int metadata_areas0(struct supertype *st,
+			   unsigned long long (*areas)[2], int max)
+{
+	/* The superblock occupies the first 4K of the reserved 64K at
+	 * the end of the device, the bitmap (if any) the rest of it.
+	 */
+	unsigned long long offset;
+
+	if (!st->sb || max < 1 || st->devsize < MD_RESERVED_BYTES)
+		return 0;
+	offset = MD_NEW_SIZE_SECTORS(st->devsize >> 9) * 512ULL;
+	areas[0][0] = offset + MD_SB_BYTES;
+	areas[0][1] = MD_RESERVED_BYTES - MD_SB_BYTES;
+	return 1;
+}
+
 static void free_super0(struct supertype *st)
 {
 	if (st->sb)
@@ -1346,5 +1362,6 @@ struct superswitch super0 = {
 	.locate_bitmap = locate_bitmap0,
 	.write_bitmap = write_bitmap0,
 	.free_super = free_super0,
+	.metadata_areas = metadata_areas0,
 	.name = "0.90",
 };
@@ -112,7 +112,8 @@ struct mdp_superblock_1 {
 
 #define MAX_SB_SIZE 4096
 /* bitmap super size is 256, but we round up to a sector for alignment */
-#define BM_SUPER_SIZE 512
+/* Room for a whole sector of bitmap superblock, even on 4K devices */
+#define BM_SUPER_SIZE 4096
 #define MAX_DEVS ((int)(MAX_SB_SIZE - sizeof(struct mdp_superblock_1)) / 2)
 #define SUPER1_SIZE	(MAX_SB_SIZE + BM_SUPER_SIZE \
 			 + sizeof(struct misc_dev_info))
@@ -233,12 +234,27 @@ static void init_afd(struct align_fd *afd, int fd)
 		afd->blk_sz = 512;
 }
 
+/* Round 'len' up to whole sectors of the device */
+static inline int afd_round(struct align_fd *afd, int len)
+{
+	return ROUND_UP(len, afd->blk_sz);
+}
+
+/* Can 'buf' be handed to the device as it is? */
+static inline int afd_direct(struct align_fd *afd, void *buf, int len)
+{
+	return ((unsigned long)buf % afd->blk_sz) == 0 &&
+		(len % afd->blk_sz) == 0;
+}
+
 static char abuf[4096+4096];
 
 static int aread(struct align_fd *afd, void *buf, int len)
 {
 	/* aligned read.
-	 * On devices with a 4K sector size, we need to read
+	 * If the buffer is aligned and covers whole sectors, read
+	 * straight into it.
+	 * Otherwise, on devices with a 4K sector size, we need to read
 	 * the full sector and copy relevant bits into
 	 * the buffer
 	 */
@@ -248,6 +264,9 @@ static int aread(struct align_fd *afd, void *buf, int len)
 
 	bsize = afd->blk_sz;
 
+	if (bsize > 0 && bsize <= 4096 && afd_direct(afd, buf, len))
+		return read(afd->fd, buf, len);
+
 	if (!bsize || bsize > 4096 || len > 4096) {
 		if (!bsize)
 			fprintf(stderr, "WARNING - aread() called with invalid block size\n");
@@ -270,7 +289,9 @@ static int aread(struct align_fd *afd, void *buf, int len)
 static int awrite(struct align_fd *afd, void *buf, int len)
 {
 	/* aligned write.
-	 * On devices with a 4K sector size, we need to write
+	 * If the buffer is aligned and covers whole sectors, write
+	 * straight from it.
+	 * Otherwise, on devices with a 4K sector size, we need to write
 	 * the full sector.  We pre-read if the sector is larger
 	 * than the write.
 	 * The address must be sector-aligned.
@@ -280,6 +301,9 @@ static int awrite(struct align_fd *afd, void *buf, int len)
 	int n;
 
 	bsize = afd->blk_sz;
+	if (bsize > 0 && bsize <= 4096 && afd_direct(afd, buf, len))
+		return write(afd->fd, buf, len);
+
 	if (!bsize || bsize > 4096 || len > 4096) {
 		if (!bsize)
 			fprintf(stderr, "WARNING - awrite() called with invalid block size\n");
@@ -305,6 +329,70 @@ static int awrite(struct align_fd *afd, void *buf, int len)
 	return len;
 }
 
+/* Size of the buffer used for bulk bitmap initialisation */
+#define BM_BULK_SIZE	(1024 * 1024)
+
+static int awrite_fill(struct align_fd *afd, int fill, unsigned long long len)
+{
+	/* Fill 'len' bytes from the current offset with the byte 'fill'.
+	 * This is used to initialise large bitmaps, so rather than going
+	 * through awrite() 4K at a time, write whole sectors in large
+	 * aligned chunks (the fd is often O_DIRECT) and only use awrite()
+	 * for a trailing partial sector.
+	 * If the pattern is all zeroes, ask the device to zero the range
+	 * itself first, and only write if that isn't supported.
+	 * Returns 0 on success, -1 on failure.
+	 */
+	unsigned long long bulk, done = 0;
+	off64_t offset;
+	void *buf;
+	int n;
+
+	if (afd->blk_sz <= 0 || afd->blk_sz > 4096)
+		return -1;
+	offset = lseek64(afd->fd, 0, SEEK_CUR);
+	if (offset < 0)
+		return -1;
+	bulk = len - len % afd->blk_sz;
+
+	if (fill == 0 && bulk && (offset % afd->blk_sz) == 0) {
+		uint64_t range[2] = { offset, bulk };
+
+		if (ioctl(afd->fd, BLKZEROOUT, &range) == 0) {
+			done = bulk;
+			lseek64(afd->fd, offset + bulk, SEEK_SET);
+		}
+	}
+
+	if (done < bulk) {
+		if (posix_memalign(&buf, 4096, BM_BULK_SIZE) != 0)
+			return -1;
+		memset(buf, fill, BM_BULK_SIZE);
+		while (done < bulk) {
+			n = BM_BULK_SIZE;
+			if ((unsigned long long)n > bulk - done)
+				n = bulk - done;
+			n = write(afd->fd, buf, n);
+			if (n <= 0)
+				break;
+			done += n;
+		}
+		free(buf);
+		if (done < bulk)
+			return -1;
+	}
+
+	if (done < len) {
+		char tail[4096];
+
+		n = len - done;
+		memset(tail, fill, n);
+		if (awrite(afd, tail, n) != n)
+			return -1;
+	}
+	return 0;
+}
+
 static inline unsigned int md_feature_any_ppl_on(__u32 feature_map)
 {
 	return ((__cpu_to_le32(feature_map) &
@@ -1799,7 +1887,12 @@ static int store_super1(struct supertype *st, int fd)
 	if (lseek64(fd, sb_offset << 9, 0)< 0LL)
 		return 3;
 
-	sbsize = ROUND_UP(sizeof(*sb) + 2 * __le32_to_cpu(sb->max_dev), 512);
+	/* The superblock buffer is MAX_SB_SIZE, so whole sectors can be
+	 * written from it directly.  Past the device roles it holds what
+	 * was loaded from the device, or zeroes for a new superblock.
+	 */
+	sbsize = sizeof(*sb) + 2 * __le32_to_cpu(sb->max_dev);
+	sbsize = afd_round(&afd, ROUND_UP(sbsize, 512));
 
 	if (awrite(&afd, sb, sbsize) != sbsize)
 		return 4;
@@ -1808,6 +1901,9 @@ static int store_super1(struct supertype *st, int fd)
 		struct bitmap_super_s *bm = (struct bitmap_super_s*)
 			(((char*)sb)+MAX_SB_SIZE);
 		if (__le32_to_cpu(bm->magic) == BITMAP_MAGIC) {
+			/* The bitmap itself follows in the same sector, so
+			 * this needs the read-modify-write in awrite().
+			 */
 			locate_bitmap1(st, fd, 0);
 			if (awrite(&afd, bm, sizeof(*bm)) != sizeof(*bm))
 				return 5;
@@ -2330,7 +2426,7 @@ static int load_super1(struct supertype *st, int fd, char *devname)
 	 * should get that written out.
 	 */
 	locate_bitmap1(st, fd, 0);
-	if (aread(&afd, bsb, 512) != 512)
+	if (aread(&afd, bsb, afd_round(&afd, 512)) != afd_round(&afd, 512))
 		goto no_bitmap;
 
 	uuid_from_super1(st, uuid);
@@ -2756,19 +2852,17 @@ static int write_bitmap1(struct supertype *st, int fd, enum bitmap_update update
 			towrite = calc_bitmap_size(bms, 512);
 		else
 			towrite = calc_bitmap_size(bms, 4096);
-		while (towrite > 0) {
-			n = towrite;
-			if (n > 4096)
-				n = 4096;
-			n = awrite(&afd, buf, n);
-			if (n > 0)
-				towrite -= n;
-			else
-				break;
-			if (i)
-				memset(buf, 0x00, 4096);
-			else
-				memset(buf, 0xff, 4096);
+		/* The first block carries the bitmap superblock, the
+		 * rest is a plain fill pattern that can be bulk-written.
+		 */
+		n = towrite;
+		if (n > 4096)
+			n = 4096;
+		if (awrite(&afd, buf, n) == n) {
+			towrite -= n;
+			if (towrite > 0 &&
+			    awrite_fill(&afd, i ? 0x00 : 0xff, towrite) == 0)
+				towrite = 0;
 		}
 		fsync(fd);
 		if (towrite) {
@@ -2781,6 +2875,62 @@ static int write_bitmap1(struct supertype *st, int fd, enum bitmap_update update
 	return rv;
 }
 
+static int metadata_areas1(struct supertype *st,
+			   unsigned long long (*areas)[2], int max)
+{
+	/* Everything between the superblock and the data that isn't the
+	 * superblock itself is metadata space: bitmap, PPL and bad block
+	 * log live there.  For 1.1 and 1.2 that is from the end of the
+	 * superblock up to the data, for 1.0 from the end of the data up
+	 * to the superblock.  If a reshape is moving the data, keep clear
+	 * of both the old and the new location.
+	 * A journal device holds nothing but metadata, so the data area
+	 * goes too.
+	 */
+	struct mdp_superblock_1 *sb = st->sb;
+	unsigned long long sb_offset, data_offset, data_end;
+	long long shift = 0;
+	int n = 0;
+
+	if (!sb || max < 2)
+		return 0;
+	sb_offset = __le64_to_cpu(sb->super_offset);
+	data_offset = __le64_to_cpu(sb->data_offset);
+	data_end = data_offset + __le64_to_cpu(sb->data_size);
+	if (__le32_to_cpu(sb->feature_map) & MD_FEATURE_NEW_OFFSET)
+		shift = (int32_t)__le32_to_cpu(sb->new_offset);
+
+	if (data_offset > sb_offset) {
+		unsigned long long start = sb_offset + MAX_SB_SIZE / 512;
+		unsigned long long end = data_offset;
+
+		if (shift < 0)
+			end = data_offset + shift;
+		if (end > start) {
+			areas[n][0] = start * 512;
+			areas[n][1] = (end - start) * 512;
+			n++;
+		}
+	} else {
+		unsigned long long start = data_end;
+
+		if (shift > 0)
+			start = data_end + shift;
+		if (sb_offset > start) {
+			areas[n][0] = start * 512;
+			areas[n][1] = (sb_offset - start) * 512;
+			n++;
+		}
+	}
+
+	if (role_from_sb(sb) == MD_DISK_ROLE_JOURNAL && data_end > data_offset) {
+		areas[n][0] = data_offset * 512;
+		areas[n][1] = (data_end - data_offset) * 512;
+		n++;
+	}
+	return n;
+}
+
 static void free_super1(struct supertype *st)
 {
 
@@ -2980,6 +3130,7 @@ struct superswitch super1 = {
 	.locate_bitmap = locate_bitmap1,
 	.write_bitmap = write_bitmap1,
 	.free_super = free_super1,
+	.metadata_areas = metadata_areas1,
 #if __BYTE_ORDER == BIG_ENDIAN
 	.swapuuid = 0,
 #else
@@ -26,6 +26,7 @@
 #include	"mdadm.h"
 #include	<dirent.h>
 #include	<ctype.h>
+#include	<poll.h>
 #include	"dlink.h"
 
 #define MAX_SYSFS_PATH_LEN	120
@@ -959,6 +960,104 @@ int sysfs_unique_holder(char *devnm, long rdev)
 	return ret;
 }
 
+static int blkdev_cmp(const void *a, const void *b)
+{
+	const struct blkdev_info *d1 = *(const struct blkdev_info **)a;
+	const struct blkdev_info *d2 = *(const struct blkdev_info **)b;
+
+	if (d1->devid < d2->devid)
+		return -1;
+	return d1->devid > d2->devid;
+}
+
+/**
+ * sysfs_scan_blkdevs() - Discover block devices in one pass over sysfs.
+ *
+ * Collects the device number of every block device from
+ * /sys/class/block, in the order they would appear in /proc/partitions.  Devices which /proc/partitions would not
+ * list (empty or hidden) are skipped.  @devname is the /dev node named
+ * after the kernel name if it exists and is the right device, else NULL.
+ *
+ * Return: list of devices, free with free_blkdevs(), NULL on error.
+ */
+struct blkdev_info *sysfs_scan_blkdevs(void)
+{
+	struct blkdev_info *list = NULL, **sorted, *d;
+	char path[PATH_MAX];
+	char buf[PATH_MAX];
+	struct dirent *de;
+	struct stat stb;
+	int cnt = 0, i;
+	DIR *dir;
+
+	dir = opendir("/sys/class/block");
+	if (!dir)
+		return NULL;
+	while ((de = readdir(dir)) != NULL) {
+		int major, minor, n;
+		char *c;
+
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/sys/class/block/%s/dev",
+			 de->d_name);
+		if (load_sys(path, buf, sizeof(buf)) < 0 ||
+		    sscanf(buf, "%d:%d", &major, &minor) != 2)
+			continue;
+		snprintf(path, sizeof(path), "/sys/class/block/%s/hidden",
+			 de->d_name);
+		if (load_sys(path, buf, sizeof(buf)) == 0 && buf[0] == '1')
+			continue;
+		snprintf(path, sizeof(path), "/sys/class/block/%s/size",
+			 de->d_name);
+		if (load_sys(path, buf, sizeof(buf)) < 0 ||
+		    strtoull(buf, NULL, 10) == 0)
+			continue;
+
+		d = xcalloc(1, sizeof(*d));
+		d->devid = makedev(major, minor);
+
+		/* kernel names use '!' where the /dev name has '/' */
+		n = snprintf(buf, sizeof(buf), "/dev/%s", de->d_name);
+		for (c = buf; c < buf + n; c++)
+			if (*c == '!')
+				*c = '/';
+		if (stat(buf, &stb) == 0 && S_ISBLK(stb.st_mode) &&
+		    stb.st_rdev == d->devid)
+			d->devname = xstrdup(buf);
+
+		d->next = list;
+		list = d;
+		cnt++;
+	}
+	closedir(dir);
+
+	if (cnt > 1) {
+		sorted = xmalloc(cnt * sizeof(*sorted));
+		for (i = 0, d = list; d; d = d->next)
+			sorted[i++] = d;
+		qsort(sorted, cnt, sizeof(*sorted), blkdev_cmp);
+		list = NULL;
+		for (i = cnt - 1; i >= 0; i--) {
+			sorted[i]->next = list;
+			list = sorted[i];
+		}
+		free(sorted);
+	}
+	return list;
+}
+
+void free_blkdevs(struct blkdev_info *list)
+{
+	while (list) {
+		struct blkdev_info *d = list;
+
+		list = d->next;
+		free(d->devname);
+		free(d);
+	}
+}
+
 int sysfs_freeze_array(struct mdinfo *sra)
 {
 	/* Try to freeze resync/rebuild on this array/container.
@@ -1014,6 +1113,139 @@ int sysfs_wait(int fd, int *msec)
 	return n;
 }
 
+static long msec_between(struct timespec *from, struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000 +
+		(to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/* Read sync_completed and charge the time since the last read to
+ * busy if it moved, or to idle if it did not.
+ * "delayed" leaves ->completed alone.
+ */
+static int reshape_wait_sample(struct reshape_wait *rw)
+{
+	unsigned long long val = rw->completed;
+	struct timespec now;
+	char buf[50];
+	long ms;
+
+	if (sysfs_fd_get_str(rw->completed_fd, buf, sizeof(buf)) < 0)
+		return RESHAPE_WAIT_ERROR;
+	if (strncmp(buf, "none", 4) == 0)
+		return RESHAPE_WAIT_NONE;
+	if (strncmp(buf, "delayed", 7) != 0) {
+		char *ep;
+
+		val = strtoull(buf, &ep, 0);
+		if (ep == buf || (*ep != 0 && *ep != '\n' && *ep != ' '))
+			return RESHAPE_WAIT_ERROR;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = msec_between(&rw->seen, &now);
+	if (ms > 0) {
+		if (val != rw->completed)
+			rw->step_busy += ms;
+		else
+			rw->step_idle += ms;
+	}
+	rw->completed = val;
+	rw->seen = now;
+	return 0;
+}
+
+int reshape_wait_open(struct reshape_wait *rw, struct mdinfo *sra)
+{
+	memset(rw, 0, sizeof(*rw));
+	rw->completed_fd = sysfs_get_fd(sra, NULL, "sync_completed");
+	rw->action_fd = sysfs_get_fd(sra, NULL, "sync_action");
+	if (rw->completed_fd < 0 || rw->action_fd < 0) {
+		close_fd(&rw->completed_fd);
+		close_fd(&rw->action_fd);
+		return -1;
+	}
+	/* sysfs only notifies about changes after the attribute is read */
+	clock_gettime(CLOCK_MONOTONIC, &rw->seen);
+	reshape_wait_sample(rw);
+	sysfs_fd_get_str(rw->action_fd, rw->action, sizeof(rw->action));
+	return 0;
+}
+
+/*
+ * reshape_wait_step() - wait for the reshape to reach @target.
+ * @rw: waiter set up by reshape_wait_open().
+ * @target: sync_completed value to wait for.
+ * @msec: longest wait, or -1 for no limit.
+ *
+ * Sleeps in poll() until sync_completed or sync_action is updated, so
+ * it returns as soon as the kernel gets there or stops reshaping.
+ * Return: one of enum reshape_wait_result, ->completed holds the last
+ * position read.
+ */
+int reshape_wait_step(struct reshape_wait *rw, unsigned long long target,
+		      int msec)
+{
+	struct timespec deadline, now;
+	int expired = 0;
+	int rv;
+
+	rw->step_busy = rw->step_idle = 0;
+	if (msec >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += msec / 1000;
+		deadline.tv_nsec += (msec % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	while (1) {
+		struct pollfd fds[2] = {
+			{ .fd = rw->completed_fd, .events = POLLPRI },
+			{ .fd = rw->action_fd, .events = POLLPRI },
+		};
+		int tmo = -1;
+
+		rv = reshape_wait_sample(rw);
+		if (rv != 0)
+			break;
+		rv = RESHAPE_WAIT_REACHED;
+		if (rw->completed >= target)
+			break;
+		rv = RESHAPE_WAIT_STOPPED;
+		if (sysfs_fd_get_str(rw->action_fd, rw->action,
+				     sizeof(rw->action)) < 0 ||
+		    strncmp(rw->action, "reshape", 7) != 0)
+			break;
+		rv = RESHAPE_WAIT_TIMEOUT;
+		if (expired)
+			break;
+		if (msec >= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			tmo = max(msec_between(&now, &deadline), 0L);
+		}
+		if (poll(fds, 2, tmo) == 0)
+			expired = 1;
+	}
+
+	rw->steps++;
+	rw->busy += rw->step_busy;
+	rw->idle += rw->step_idle;
+	dprintf("step %d at %llu: %lu ms progressing, %lu ms idle\n",
+		rw->steps, rw->completed, rw->step_busy, rw->step_idle);
+	return rv;
+}
+
+void reshape_wait_close(struct reshape_wait *rw, char *devnm)
+{
+	if (rw->steps)
+		dprintf("%s: %d steps, %llu ms progressing, %llu ms idle\n",
+			devnm, rw->steps, rw->busy, rw->idle);
+	close_fd(&rw->completed_fd);
+	close_fd(&rw->action_fd);
+}
+
 int sysfs_rules_apply_check(const struct mdinfo *sra,
 			    const struct sysfs_entry *ent)
 {
@@ -2005,7 +2005,8 @@ use_random:
 
 int flush_metadata_updates(struct supertype *st)
 {
-	int sfd;
+	struct metadata_update *mu;
+	int sfd, rv;
 	if (!st->updates) {
 		st->update_tail = NULL;
 		return -1;
@@ -2015,20 +2016,34 @@ int flush_metadata_updates(struct supertype *st)
 	if (sfd < 0)
 		return -1;
 
+	rv = send_updates(sfd, st->updates, 0);
+	if (rv == -2) {
+		pr_err("Some metadata updates to %s were not acknowledged\n",
+		       st->container_devnm);
+	} else if (rv != 0) {
+		/* older mdmon, send them one at a time */
+		rv = 0;
+		close(sfd);
+		sfd = connect_monitor(st->container_devnm);
+		if (sfd < 0)
+			return -1;
+		for (mu = st->updates; mu; mu = mu->next) {
+			send_message(sfd, mu, 0);
+			wait_reply(sfd, 0);
+		}
+		ack(sfd, 0);
+		wait_reply(sfd, 0);
+	}
+	close(sfd);
+
 	while (st->updates) {
-		struct metadata_update *mu = st->updates;
+		mu = st->updates;
 		st->updates = mu->next;
-
-		send_message(sfd, mu, 0);
-		wait_reply(sfd, 0);
 		free(mu->buf);
 		free(mu);
 	}
-	ack(sfd, 0);
-	wait_reply(sfd, 0);
-	close(sfd);
 	st->update_tail = NULL;
-	return 0;
+	return rv ? -1 : 0;
 }
 
 void append_metadata_update(struct supertype *st, void *buf, int len)
@@ -2413,3 +2428,193 @@ void sleep_for(unsigned int sec, long nsec, bool wake_after_interrupt)
 		}
 	} while (!wake_after_interrupt && errno == EINTR);
 }
+
+/* Number of devices handled at once by json_scan() */
+#define JSON_SCAN_JOBS 16
+
+struct json_job {
+	pid_t pid;
+	int fd;
+	char *buf;
+	size_t len;
+	size_t size;
+	int status;
+};
+
+void json_print_string(const char *str, size_t len)
+{
+	size_t i;
+
+	putchar('"');
+	for (i = 0; i < len; i++) {
+		unsigned char ch = str[i];
+
+		if (ch == '"' || ch == '\\')
+			printf("\\%c", ch);
+		else if (ch < 0x20)
+			printf("\\u%04x", ch);
+		else
+			putchar(ch);
+	}
+	putchar('"');
+}
+
+static void json_job_start(struct json_job *job, char *name,
+			   int (*fn)(char *name, struct context *c, void *arg),
+			   struct context *c, void *arg)
+{
+	int pfd[2];
+
+	job->fd = -1;
+	job->status = 1;
+	if (pipe(pfd) < 0)
+		return;
+	fflush(stdout);
+	fflush(stderr);
+	job->pid = fork();
+	switch (job->pid) {
+	case 0:
+		close(pfd[0]);
+		dup2(pfd[1], 1);
+		close(pfd[1]);
+		exit(fn(name, c, arg) & 0xff);
+	case -1:
+		close(pfd[0]);
+		close(pfd[1]);
+		return;
+	}
+	close(pfd[1]);
+	job->fd = pfd[0];
+}
+
+static void json_job_read(struct json_job *job)
+{
+	int status;
+	int n;
+
+	if (job->size - job->len < 4096) {
+		job->size += 16384;
+		job->buf = xrealloc(job->buf, job->size);
+	}
+	n = read(job->fd, job->buf + job->len, job->size - job->len);
+	if (n > 0) {
+		job->len += n;
+		return;
+	}
+	if (n < 0 && errno == EINTR)
+		return;
+	close(job->fd);
+	job->fd = -1;
+	if (waitpid(job->pid, &status, 0) == job->pid && WIFEXITED(status))
+		job->status = WEXITSTATUS(status);
+}
+
+/* Give up on the @nrun jobs listed in @running, which keep status 1 */
+static void json_scan_reap(struct json_job *jobs, int *running, int nrun)
+{
+	int i;
+
+	for (i = 0; i < nrun; i++) {
+		struct json_job *job = &jobs[running[i]];
+
+		close(job->fd);
+		job->fd = -1;
+		while (waitpid(job->pid, NULL, 0) < 0 && errno == EINTR)
+			;
+	}
+}
+
+/**
+ * json_scan() - Run --export style reports concurrently, print as JSON.
+ * @key: Name of the JSON array holding the reports.
+ * @names: Devices to report on.
+ * @cnt: Number of @names.
+ * @fn: Prints key=value lines about one device to stdout.
+ * @c: Passed to @fn, with export set.
+ * @arg: Passed to @fn.
+ * @skip_empty: Leave out devices @fn printed nothing about.  Their exit
+ * codes still count.
+ *
+ * Each device is handled by @fn in its own child process, up to
+ * JSON_SCAN_JOBS at a time, so that slow devices don't hold up the rest.
+ * Output is collected and printed in the order of @names as
+ * { "@key": [ { "device": ..., "status": ..., "KEY": "value", ... } ] }.
+ *
+ * Return: the OR of the exit codes of the reported devices.
+ */
+int json_scan(char *key, char **names, int cnt,
+	      int (*fn)(char *name, struct context *c, void *arg),
+	      struct context *c, void *arg, int skip_empty)
+{
+	struct json_job *jobs = xcalloc(cnt, sizeof(*jobs));
+	struct pollfd *pfds = xcalloc(JSON_SCAN_JOBS, sizeof(*pfds));
+	int *running = xcalloc(JSON_SCAN_JOBS, sizeof(*running));
+	int next = 0, nrun = 0, first = 1;
+	int rv = 0;
+	int i, j;
+
+	c->export = 1;
+	while (next < cnt || nrun) {
+		while (nrun < JSON_SCAN_JOBS && next < cnt) {
+			json_job_start(&jobs[next], names[next], fn, c, arg);
+			if (jobs[next].fd >= 0)
+				running[nrun++] = next;
+			next++;
+		}
+		if (!nrun)
+			break;
+		for (i = 0; i < nrun; i++) {
+			pfds[i].fd = jobs[running[i]].fd;
+			pfds[i].events = POLLIN;
+			pfds[i].revents = 0;
+		}
+		if (poll(pfds, nrun, -1) < 0 && errno != EINTR) {
+			json_scan_reap(jobs, running, nrun);
+			break;
+		}
+		for (i = 0, j = 0; i < nrun; i++) {
+			struct json_job *job = &jobs[running[i]];
+
+			if (pfds[i].revents)
+				json_job_read(job);
+			if (job->fd >= 0)
+				running[j++] = running[i];
+		}
+		nrun = j;
+	}
+
+	printf("{\n\t\"%s\": [", key);
+	for (i = 0; i < cnt; i++) {
+		struct json_job *job = &jobs[i];
+		char *line = job->buf, *end, *eq;
+
+		rv |= job->status;
+		if (skip_empty && !job->len)
+			continue;
+		printf("%s\n\t\t{\n\t\t\t\"device\": ", first ? "" : ",");
+		first = 0;
+		json_print_string(names[i], strlen(names[i]));
+		printf(",\n\t\t\t\"status\": %d", job->status);
+		while (line && line < job->buf + job->len) {
+			end = memchr(line, '\n', job->buf + job->len - line);
+			if (!end)
+				end = job->buf + job->len;
+			eq = memchr(line, '=', end - line);
+			if (eq && eq != line) {
+				printf(",\n\t\t\t");
+				json_print_string(line, eq - line);
+				printf(": ");
+				json_print_string(eq + 1, end - eq - 1);
+			}
+			line = end + 1;
+		}
+		printf("\n\t\t}");
+		free(job->buf);
+	}
+	printf("%s]\n}\n", first ? "" : "\n\t");
+
+	free(running);
+	free(pfds);
+	free(jobs);
+	return rv;
+}